@@ -14,11 +14,13 @@ This demo focuses on:
 import sys
 import os
 import time
+import random
 import threading
 from concurrent.futures import ThreadPoolExecutor
 sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
 
 from pyfatfs import FileAccessWrapper, DirectoryAccessWrapper
+from pyfatfs import core as fatfs_core
 import fatfs
 
 class PerformanceBenchmark:
@@ -304,6 +306,367 @@ class PerformanceBenchmark:
         
         self.time_operation("Write 1MB file (chunked, memory efficient)", chunked_file_write)
     
+    def host_page_cache_kb(self):
+        """Return the host page cache size in KB, or None off Linux"""
+        try:
+            with open("/proc/meminfo") as meminfo:
+                for line in meminfo:
+                    if line.startswith("Cached:"):
+                        return int(line.split()[1])
+        except OSError:
+            pass
+        return None
+    
+    def benchmark_direct_io(self, size_mb=64):
+        """Compare the page cached and O_DIRECT image backends on a large image"""
+        print("\n=== Direct I/O Backend Comparison ===")
+        
+        image = "bench_direct.img"
+        drive = 1
+        chunk = b"D" * (1024 * 1024)
+        
+        for name, backend in (("pread", fatfs_core.BACKEND_PREAD), ("O_DIRECT", fatfs_core.BACKEND_DIRECT)):
+            def write_then_read():
+                fatfs.set_backend(backend, drive)
+                if os.path.exists(image):
+                    os.remove(image)
+                fatfs.open_image(image, size=(size_mb + 16) << 20, sector_size=4096, drive=drive)
+                fatfs.mount("", drive, 1)
+                cached_before = self.host_page_cache_kb()
+                
+                start = time.time()
+                fp = fatfs.open(f"{drive}:BIG.BIN", 0x0A)   # FA_WRITE | FA_CREATE_ALWAYS
+                for _ in range(size_mb):
+                    fatfs.write(fp, chunk)
+                fatfs.close(fp)
+                write_time = time.time() - start
+                
+                start = time.time()
+                fp = fatfs.open(f"{drive}:BIG.BIN", 0x01)   # FA_READ
+                while fatfs.read(fp, len(chunk)):
+                    pass
+                fatfs.close(fp)
+                read_time = time.time() - start
+                
+                cached_after = self.host_page_cache_kb()
+                print(f"     write {size_mb / write_time:8.1f} MB/s, read {size_mb / read_time:8.1f} MB/s")
+                if cached_before is not None:
+                    print(f"     host page cache grew by {(cached_after - cached_before) // 1024} MB")
+                return size_mb
+            
+            self.time_operation(f"Write+read {size_mb}MB ({name} backend)", write_then_read)
+        
+        fatfs.set_backend(fatfs_core.BACKEND_FILE, drive)
+        if os.path.exists(image):
+            os.remove(image)
+    
+    def benchmark_compressed_image(self, text_mb=8):
+        """Compare storage and speed of a raw and a compressed image on text files"""
+        print("\n=== Compressed Image Trade-off ===")
+        
+        drive = 1
+        line = b"2025-10-11 14:30:00 INFO worker-%03d processed request id=%08d status=ok\n"
+        text = b"".join(line % (i % 17, i) for i in range(20000))[:256 * 1024]
+        files = text_mb * 4
+        
+        layouts = (
+            ("raw image", "bench_raw.img", None),
+            ("compressed, 16KB blocks", "bench_16k.cmp", 16384),
+            ("compressed, 64KB blocks", "bench_64k.cmp", 65536),
+        )
+        for name, image, block_size in layouts:
+            def write_then_read():
+                if os.path.exists(image):
+                    os.remove(image)
+                if block_size is None:
+                    fatfs.set_backend(fatfs_core.BACKEND_PREAD, drive)
+                    fatfs.open_image(image, size=64 << 20, drive=drive)
+                else:
+                    fatfs.open_compressed(image, size=64 << 20, block_size=block_size, drive=drive)
+                fatfs.mount("", drive, 1)
+                
+                start = time.time()
+                for i in range(files):
+                    fp = fatfs.open(f"{drive}:LOG{i:03d}.TXT", 0x0A)   # FA_WRITE | FA_CREATE_ALWAYS
+                    fatfs.write(fp, text)
+                    fatfs.close(fp)
+                write_time = time.time() - start
+                
+                start = time.time()
+                for i in range(files):
+                    fp = fatfs.open(f"{drive}:LOG{i:03d}.TXT", 0x01)   # FA_READ
+                    while fatfs.read(fp, 65536):
+                        pass
+                    fatfs.close(fp)
+                read_time = time.time() - start
+                
+                # Closing the drive writes the remaining blocks and the index
+                fatfs.set_backend(fatfs_core.BACKEND_FILE, drive)
+                stored = os.stat(image).st_blocks * 512
+                print(f"     write {text_mb / write_time:8.1f} MB/s, read {text_mb / read_time:8.1f} MB/s, "
+                      f"{self.format_size(stored)} on the host for {text_mb}MB of text")
+                os.remove(image)
+                return stored
+            
+            self.time_operation(f"Write+read {text_mb}MB of text ({name})", write_then_read)
+    
+    def benchmark_checksums(self, data_mb=32):
+        """Measure the cost of per-sector checksums on writes, reads and a scrub"""
+        print("\n=== Integrity Checksum Overhead ===")
+        
+        drive = 1
+        image = "bench_crc.img"
+        chunk = os.urandom(1024 * 1024)
+        
+        for checksums in (False, True):
+            label = "checksums on" if checksums else "checksums off"
+            
+            def write_then_read():
+                for path in (image, image + ".crc"):
+                    if os.path.exists(path):
+                        os.remove(path)
+                fatfs.set_backend(fatfs_core.BACKEND_PREAD, drive)
+                fatfs.open_image(image, size=128 << 20, drive=drive)
+                if checksums:
+                    fatfs.enable_checksums(drive=drive)
+                fatfs.mount("", drive, 1)
+                
+                start = time.time()
+                fp = fatfs.open(f"{drive}:DATA.BIN", 0x0A)   # FA_WRITE | FA_CREATE_ALWAYS
+                for _ in range(data_mb):
+                    fatfs.write(fp, chunk)
+                fatfs.close(fp)
+                write_time = time.time() - start
+                
+                start = time.time()
+                fp = fatfs.open(f"{drive}:DATA.BIN", 0x01)   # FA_READ
+                while fatfs.read(fp, 1024 * 1024):
+                    pass
+                fatfs.close(fp)
+                read_time = time.time() - start
+                
+                line = f"     write {data_mb / write_time:8.1f} MB/s, read {data_mb / read_time:8.1f} MB/s"
+                if checksums:
+                    start = time.time()
+                    scrub = fatfs.scrub(0, drive)
+                    scrub_time = time.time() - start
+                    line += f", scrub {128 / scrub_time:8.1f} MB/s ({scrub['errors']} errors)"
+                print(line)
+                
+                fatfs.set_backend(fatfs_core.BACKEND_FILE, drive)
+                for path in (image, image + ".crc"):
+                    if os.path.exists(path):
+                        os.remove(path)
+                return data_mb
+            
+            self.time_operation(f"Write+read {data_mb}MB ({label})", write_then_read)
+    
+    def benchmark_device_profiles(self, files=64):
+        """Compare cache settings on emulated SD card, USB stick and eMMC timing"""
+        print("\n=== Emulated Device Profiles ===")
+        
+        drive = 1
+        image = "bench_device.img"
+        payload = os.urandom(24 * 1024)
+        
+        for profile in sorted(fatfs_core.THROTTLE_PROFILES):
+            for cache in (0, 64, 1024):
+                def small_files():
+                    if os.path.exists(image):
+                        os.remove(image)
+                    # Counted rather than slept, so the figures repeat exactly
+                    fatfs_core.set_throttle(profile, drive=drive, realtime=False, seed=1)
+                    fatfs.set_backend(fatfs_core.BACKEND_PREAD, drive)
+                    fatfs.open_image(image, size=64 << 20, drive=drive)
+                    fatfs.set_cache(cache, drive)
+                    fatfs.mount("", drive, 1)
+                    
+                    for i in range(files):
+                        fp = fatfs.open(f"{drive}:SMALL{i:03d}.BIN", 0x0A)   # FA_WRITE | FA_CREATE_ALWAYS
+                        fatfs.write(fp, payload)
+                        fatfs.close(fp)
+                    for i in range(files):
+                        fp = fatfs.open(f"{drive}:SMALL{i:03d}.BIN", 0x01)   # FA_READ
+                        fatfs.read(fp, len(payload))
+                        fatfs.close(fp)
+                    
+                    stats = fatfs.disk_stats(drive)
+                    fatfs.set_backend(fatfs_core.BACKEND_FILE, drive)
+                    fatfs_core.clear_throttle(drive)
+                    fatfs.set_cache(0, drive)
+                    os.remove(image)
+                    print(f"     {stats['device_us'] / 1e6:8.3f}s of device time, "
+                          f"{stats['device_stalls']} stalls, {stats['writes']} writes")
+                    return stats['device_us']
+                
+                self.time_operation(f"{files} small files on {profile} (cache {cache})", small_files)
+    
+    def make_fragmented_file(self, image, drive, mb):
+        """Mount a new image holding A.BIN and B.BIN of mb MB each; written
+        in turns, the two files interleave their clusters"""
+        block = os.urandom(4096)
+        
+        if os.path.exists(image):
+            os.remove(image)
+        fatfs.set_backend(fatfs_core.BACKEND_PREAD, drive)
+        fatfs.open_image(image, size=1 << 30, drive=drive)
+        fatfs.mount("", drive, 1)
+        
+        a = fatfs.open(f"{drive}:A.BIN", 0x0A)   # FA_WRITE | FA_CREATE_ALWAYS
+        b = fatfs.open(f"{drive}:B.BIN", 0x0A)
+        for _ in range((mb << 20) // len(block)):
+            fatfs.write(a, block)
+            fatfs.write(b, block)
+        fatfs.close(a)
+        fatfs.close(b)
+    
+    def benchmark_fat_chain(self, mb_per_file=24, seeks=20):
+        """Seek to the end of a fragmented file, following its cluster chain"""
+        print("\n=== FAT Chain Walk ===")
+        
+        drive = 1
+        image = "bench_chain.img"
+        self.make_fragmented_file(image, drive, mb_per_file)
+        
+        try:
+            for opt, mode in ((fatfs_core.MOUNT_NOW, "FAT cache"),
+                              (fatfs_core.MOUNT_NOW | fatfs_core.MOUNT_FAT_RAM, "FAT in memory")):
+                def walk_chain():
+                    fatfs.mount("", drive, opt)
+                    before = fatfs.disk_stats(drive)['reads']
+                    for _ in range(seeks):
+                        fp = fatfs.open(f"{drive}:A.BIN", 0x01)   # FA_READ
+                        fatfs.lseek(fp, (mb_per_file << 20) - 1)
+                        fatfs.read(fp, 1)
+                        fatfs.close(fp)
+                        dp = fatfs.opendir(f"{drive}:/")
+                        fatfs.readdir(dp)
+                        fatfs.closedir(dp)
+                    reads = fatfs.disk_stats(drive)['reads'] - before
+                    print(f"     {reads} disk reads for {seeks} seeks")
+                    return reads
+                
+                self.time_operation(f"Seek to the end of a fragmented {mb_per_file}MB file ({mode})", walk_chain)
+        finally:
+            fatfs.set_backend(fatfs_core.BACKEND_FILE, drive)
+            os.remove(image)
+    
+    def benchmark_fast_seek(self, mb_per_file=32, reads=2000):
+        """Read small records at random offsets of a fragmented file"""
+        print("\n=== Random Reads in a Fragmented File ===")
+        
+        drive = 1
+        image = "bench_fastseek.img"
+        self.make_fragmented_file(image, drive, mb_per_file)
+        
+        try:
+            rnd = random.Random(1)
+            offsets = [rnd.randrange(mb_per_file << 20) for _ in range(reads)]
+            
+            def random_reads():
+                # The file is mapped at open, each seek then steps through fragments
+                fp = fatfs.open(f"{drive}:A.BIN", 0x01)   # FA_READ
+                for ofs in offsets:
+                    fatfs.lseek(fp, ofs)
+                    fatfs.read(fp, 512)
+                fatfs.close(fp)
+                return reads
+            
+            self.time_operation(f"{reads} random 512B reads in a fragmented {mb_per_file}MB file", random_reads)
+        finally:
+            fatfs.set_backend(fatfs_core.BACKEND_FILE, drive)
+            os.remove(image)
+    
+    def benchmark_free_count(self, size_mb=512, rounds=20):
+        """Count free clusters right after mount, which scans the whole FAT"""
+        print("\n=== Free Cluster Count ===")
+        
+        drive = 1
+        image = "bench_getfree.img"
+        block = os.urandom(32768)
+        
+        if os.path.exists(image):
+            os.remove(image)
+        fatfs.set_backend(fatfs_core.BACKEND_PREAD, drive)
+        fatfs.open_image(image, size=size_mb << 20, drive=drive)
+        fatfs.mount("", drive, 1)
+        
+        # Files written in turns leave used and free entries mixed across the FAT
+        fps = [fatfs.open(f"{drive}:F{i}.BIN", 0x0A) for i in range(4)]   # FA_WRITE | FA_CREATE_ALWAYS
+        for _ in range((size_mb << 20) // len(block) // 8):
+            for fp in fps:
+                fatfs.write(fp, block)
+        for fp in fps:
+            fatfs.close(fp)
+        fatfs.unlink(f"{drive}:F1.BIN")
+        
+        try:
+            for opt, mode in ((fatfs_core.MOUNT_NOW, "FAT cache"),
+                              (fatfs_core.MOUNT_NOW | fatfs_core.MOUNT_FAT_RAM, "FAT in memory")):
+                def count_free():
+                    for _ in range(rounds):
+                        fatfs.mount("", drive, opt)   # A new mount has no valid free count on FAT16
+                        info = fatfs.getfree(f"{drive}:")
+                    return info['free_clusters']
+                
+                self.time_operation(f"Count free clusters of a {size_mb}MB FAT16 volume x{rounds} ({mode})", count_free)
+        finally:
+            fatfs.set_backend(fatfs_core.BACKEND_FILE, drive)
+            os.remove(image)
+    
+    def benchmark_block_server(self, size_mb=16):
+        """Compare reading a file from a local image and through a block server"""
+        print("\n=== Block Server ===")
+        
+        import subprocess
+        
+        drive = 1
+        image = "bench_served.img"
+        sock = os.path.abspath("bench_served.sock")
+        payload = os.urandom(size_mb << 20)
+        
+        if os.path.exists(image):
+            os.remove(image)
+        fatfs.set_backend(fatfs_core.BACKEND_PREAD, drive)
+        fatfs.open_image(image, size=(size_mb + 16) << 20, drive=drive)
+        fatfs.mount("", drive, 1)
+        fp = fatfs.open(f"{drive}:DATA.BIN", 0x0A)   # FA_WRITE | FA_CREATE_ALWAYS
+        fatfs.write(fp, payload)
+        fatfs.close(fp)
+        
+        def read_back():
+            fatfs.mount("", drive, 1)
+            fp = fatfs.open(f"{drive}:DATA.BIN", 0x01)   # FA_READ
+            while fatfs.read(fp, 1 << 20):
+                pass
+            fatfs.close(fp)
+            return len(payload)
+        
+        self.time_operation(f"Read {size_mb}MB from a local image", read_back)
+        fatfs.set_backend(fatfs_core.BACKEND_FILE, drive)
+        
+        env = dict(os.environ, PYTHONPATH=os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+        server = subprocess.Popen([sys.executable, "-m", "pyfatfs.blockd", image, sock], env=env)
+        try:
+            for _ in range(100):
+                if os.path.exists(sock):
+                    break
+                time.sleep(0.05)
+            
+            for cache in (0, 64):
+                def remote_read():
+                    fatfs_core.open_remote(sock, drive=drive)
+                    fatfs.set_cache(cache, drive)
+                    return read_back()
+                
+                self.time_operation(f"Read {size_mb}MB through a block server (cache {cache})", remote_read)
+        finally:
+            fatfs.set_backend(fatfs_core.BACKEND_FILE, drive)
+            fatfs.set_cache(0, drive)
+            server.terminate()
+            server.wait()
+            os.remove(image)
+    
     def format_size(self, size_bytes):
         """Format file size in human readable format"""
         if size_bytes < 1024:
@@ -389,6 +752,14 @@ def main():
         benchmark.benchmark_concurrent_access()
         benchmark.benchmark_directory_operations()
         benchmark.benchmark_memory_usage()
+        benchmark.benchmark_direct_io()
+        benchmark.benchmark_compressed_image()
+        benchmark.benchmark_checksums()
+        benchmark.benchmark_device_profiles()
+        benchmark.benchmark_block_server()
+        benchmark.benchmark_fat_chain()
+        benchmark.benchmark_free_count()
+        benchmark.benchmark_fast_seek()
         
         benchmark.print_performance_summary()
         
@@ -0,0 +1,63 @@
+"""
+Block server - owns a disk image and serves its sectors to other processes
+
+    pyfatfs-blockd IMAGE SOCKET [--backend pread] [--cache 4096]
+
+Clients attach with core.open_remote(SOCKET) and mount as usual. The image,
+its backend and block cache live in this process only, so every client
+shares one cache instead of keeping its own copy of hot sectors.
+"""
+import argparse
+import signal
+import sys
+
+from . import core
+
+BACKENDS = {
+    'file': core.BACKEND_FILE,
+    'mmap': core.BACKEND_MMAP,
+    'pread': core.BACKEND_PREAD,
+    'uring': core.BACKEND_URING,
+    'direct': core.BACKEND_DIRECT,
+}
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(prog='pyfatfs-blockd',
+                                     description='Serve a FAT image to other processes')
+    parser.add_argument('image', help='Image file, created if missing')
+    parser.add_argument('socket', help='Unix socket path to listen on')
+    parser.add_argument('--backend', choices=sorted(BACKENDS), default='pread')
+    parser.add_argument('--cache', type=int, default=4096,
+                        help='Block cache size in sectors (default 4096)')
+    parser.add_argument('--size', type=int, default=0,
+                        help='Size of a new image in bytes (default: existing size)')
+    parser.add_argument('--sector-size', type=int, default=512)
+    parser.add_argument('--drive', type=int, default=0)
+    args = parser.parse_args(argv)
+
+    res = core.set_backend(BACKENDS[args.backend], args.drive)
+    if res == core.FR_OK:
+        res = core.open_image(args.image, size=args.size, sector_size=args.sector_size,
+                              drive=args.drive)
+    if res == core.FR_OK:
+        res = core.set_cache(args.cache, args.drive)
+    if res != core.FR_OK:
+        print('pyfatfs-blockd: %s: %s' % (args.image, core.get_error_string(res)), file=sys.stderr)
+        return 1
+
+    # SIGTERM shuts down like Ctrl-C: the cache is flushed and the socket removed
+    def stop(signum, frame):
+        raise KeyboardInterrupt
+    signal.signal(signal.SIGTERM, stop)
+
+    try:
+        res = core.serve(args.socket, args.drive)
+    except KeyboardInterrupt:
+        res = core.FR_OK
+    if res != core.FR_OK:
+        print('pyfatfs-blockd: %s: %s' % (args.socket, core.get_error_string(res)), file=sys.stderr)
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
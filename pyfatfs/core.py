@@ -41,19 +41,423 @@ AM_SYS = 0x04    # System
 AM_DIR = 0x10    # Directory
 AM_ARC = 0x20    # Archive
 
-def mount(path="/", drive=0, opt=1):
+# Mount options (opt argument of mount, combined with |)
+MOUNT_NOW = 0x01       # Mount immediately instead of on first access
+MOUNT_FAT_RAM = 0x02   # Load the whole FAT into memory, write back changed sectors on sync
+
+# Disk image backends
+BACKEND_MEMORY = 0   # In-memory disk, discarded on exit
+BACKEND_FILE = 1     # stdio access to fatfs_disk.img
+BACKEND_MMAP = 2     # Shared memory mapping of fatfs_disk.img
+BACKEND_PREAD = 3    # Positional pread/pwrite on fatfs_disk.img
+BACKEND_URING = 4    # io_uring on fatfs_disk.img, falls back to BACKEND_PREAD
+BACKEND_DIRECT = 5   # O_DIRECT on fatfs_disk.img, bypassing the host page cache
+
+# Write durability policies
+SYNC_NONE = 0            # Sync hands buffered data to the OS only
+SYNC_ON_SYNC = 1         # Sync also forces data to stable storage
+SYNC_WRITE_THROUGH = 2   # Every sector write reaches stable storage
+
+# Rough timing of common flash media for set_throttle()
+THROTTLE_PROFILES = {
+    "sd_card": dict(read_latency_us=250, write_latency_us=1000, sync_latency_us=5000,
+                    read_bps=40_000_000, write_bps=12_000_000,
+                    erase_block=128 * 1024, erase_penalty_us=3000,
+                    stall_chance=0.002, stall_us=50_000),
+    "usb_stick": dict(read_latency_us=300, write_latency_us=800, sync_latency_us=8000,
+                      read_bps=30_000_000, write_bps=8_000_000,
+                      erase_block=256 * 1024, erase_penalty_us=4000,
+                      stall_chance=0.005, stall_us=100_000),
+    "emmc": dict(read_latency_us=100, write_latency_us=300, sync_latency_us=1000,
+                 read_bps=150_000_000, write_bps=50_000_000,
+                 erase_block=64 * 1024, erase_penalty_us=1000,
+                 stall_chance=0.0005, stall_us=20_000),
+}
+
+def mount(path="/", drive=0, opt=1, sync_mode=None):
     """
     Mount a filesystem
     
     Args:
-        path (str): Mount point path
+        path (str): Mount point path (kept for compatibility, the drive
+            number selects the volume)
+        drive (int): Drive number (0-9), each drive has its own image
+        opt (int): Mount options (0=delayed mount, MOUNT_NOW=immediate
+            mount, | MOUNT_FAT_RAM to keep the whole FAT in memory)
+        sync_mode (int): Write durability policy (SYNC_NONE, SYNC_ON_SYNC,
+            SYNC_WRITE_THROUGH); None keeps the current policy
+    
+    Returns:
+        int: FatFs result code
+    """
+    if sync_mode is None:
+        return fatfs.mount(path, drive, opt)
+    return fatfs.mount(path, drive, opt, sync_mode)
+
+def set_backend(backend, drive=0):
+    """
+    Select the disk image backend used by the next mount
+    
+    Sectors the block cache holds for the current image are written back
+    first; if that fails, FR_DISK_ERR is returned and the drive keeps its
+    image and cache, as do open_image() and the other open functions.
+    
+    Args:
+        backend (int): One of BACKEND_MEMORY, BACKEND_FILE, BACKEND_MMAP,
+            BACKEND_PREAD, BACKEND_URING, BACKEND_DIRECT
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.set_backend(backend, drive)
+
+def disk_stats(drive=0):
+    """
+    Get the I/O counters of a drive
+    
+    Args:
+        drive (int): Drive number
+    
+    Returns:
+        dict: reads, writes, sectors_read, sectors_written, syncs and the
+            block cache counters cache_hits, cache_misses, cache_evictions,
+            cache_writebacks, flush_writes (backend writes issued when
+            flushing, adjacent dirty sectors are merged into one),
+            readahead_sectors, trimmed_sectors (freed sectors whose host
+            storage was released), zero_sectors (all-zero sectors punched
+            out of the image instead of written), hole_sectors (sectors
+            read from image holes without a transfer), checksum_errors,
+            scrubbed_sectors, device_us (time charged by set_throttle) and
+            device_stalls
+    """
+    return fatfs.disk_stats(drive)
+
+def set_cache(sectors, drive=0):
+    """
+    Resize the write-back sector cache of a drive
+    
+    Dirty sectors are written to the image on sync (f_sync, f_close and
+    directory/volume operations) or when they are evicted.
+    
+    Args:
+        sectors (int): Cache capacity in sectors (0 disables the cache)
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.set_cache(sectors, drive)
+
+def set_readahead(max_sectors, drive=0):
+    """
+    Set the largest readahead window of a drive
+    
+    Sequential sector reads make the disk layer prefetch an adaptive window
+    ahead of the reader, into the block cache when one is configured and
+    as a kernel read hint otherwise.
+    
+    Args:
+        max_sectors (int): Largest window in sectors (0 disables readahead)
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.set_readahead(max_sectors, drive)
+
+def set_throttle(profile=None, drive=0, **params):
+    """
+    Make a drive run at the speed of a slower device
+    
+    Every backend command is charged a latency, its transfer time at the
+    bandwidth caps, a penalty per erase block a write covers only in part
+    and now and then a random stall. Stalls come from a seeded generator,
+    so a run repeats exactly. With realtime=False nothing sleeps and
+    disk_stats()["device_us"] reports the time the device would have
+    taken. The setting is kept for images opened later; the erase block
+    is also what f_mkfs aligns the data area to.
+    
+    Args:
+        profile (str): Name in THROTTLE_PROFILES to start from
+        drive (int): Drive number
+        **params: read_latency_us, write_latency_us, sync_latency_us,
+            read_bps, write_bps, erase_block (bytes, power of 2),
+            erase_penalty_us, stall_chance (0..1 per command), stall_us
+            (mean stall), seed and realtime (default True)
+    
+    Returns:
+        int: FatFs result code
+    """
+    settings = dict(THROTTLE_PROFILES[profile]) if profile else {}
+    settings.update(params)
+    return fatfs.set_throttle(drive=drive, **settings)
+
+def clear_throttle(drive=0):
+    """
+    Run a drive at full speed again
+    
+    Args:
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.clear_throttle(drive)
+
+def open_image(path, size=0, sector_size=512, preallocate=False, drive=0):
+    """
+    Attach the disk to an image file; the volume must be mounted again
+    
+    Args:
+        path (str): Image file path, created if it does not exist
+        size (int): Disk size in bytes (0 = size of the existing image)
+        sector_size (int): Sector size in bytes (512, 1024, 2048 or 4096)
+        preallocate (bool): Reserve host disk space for the whole image
+            instead of creating it sparse
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.open_image(path, size=size, sector_size=sector_size,
+                            preallocate=preallocate, drive=drive)
+
+def open_ramdisk(size=0, sector_size=512, image=None, huge_pages=True, drive=0):
+    """
+    Attach a drive to a RAM disk; the volume must be mounted again
+    
+    Large RAM disks are mapped with huge pages when the host has them
+    reserved (MAP_HUGETLB) and ask for transparent huge pages otherwise.
+    
+    Args:
+        size (int): Disk size in bytes (0 = size of image, or 4MB)
+        sector_size (int): Sector size in bytes (512, 1024, 2048 or 4096)
+        image (str): Image file to load the disk from in bulk
+        huge_pages (bool): Try huge pages for the disk buffer
         drive (int): Drive number
-        opt (int): Mount option (0=delayed mount, 1=immediate mount)
     
     Returns:
         int: FatFs result code
     """
-    return fatfs.mount(path, drive, opt)
+    return fatfs.open_ramdisk(size=size, sector_size=sector_size, image=image,
+                              huge_pages=huge_pages, drive=drive)
+
+def dump_ramdisk(path, drive=0):
+    """
+    Write a RAM disk to an image file, skipping zeroed 1MB blocks so the
+    file stays sparse; close open files first
+    
+    Args:
+        path (str): Image file path
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.dump_ramdisk(path, drive)
+
+def open_overlay(base, delta, sector_size=512, drive=0):
+    """
+    Attach a drive to a copy-on-write overlay of a read-only base image
+    
+    Writes go to the sparse delta file, reads of untouched sectors fall
+    through to the base, so creating a variant does not copy the base.
+    The volume must be mounted again.
+    
+    Args:
+        base (str): Base image; None reopens delta over the base it recorded
+        delta (str): Delta file, created when missing or empty
+        sector_size (int): Sector size of a new delta (512, 1024, 2048 or 4096)
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.open_overlay(base, delta, sector_size=sector_size, drive=drive)
+
+def flatten_overlay(path, drive=0):
+    """
+    Write base and delta of an overlay drive merged into a standalone
+    image; close open files first
+    
+    Args:
+        path (str): Output image path
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.flatten_overlay(path, drive)
+
+def open_compressed(path, size=0, sector_size=512, block_size=65536, image=None, drive=0):
+    """
+    Attach a drive to a compressed image
+    
+    The disk is stored as independently compressed blocks with an index,
+    zero blocks take no space. Decoded blocks are cached in memory and
+    dirty ones are compressed again on sync. The volume must be mounted
+    again.
+    
+    Args:
+        path (str): Compressed image, created when missing or empty
+        size (int): Disk size in bytes of a new image; 0 takes the size of
+            image, or 4MB without one
+        sector_size (int): Sector size of a new image (512, 1024, 2048 or 4096)
+        block_size (int): Compression block size of a new image, a power of
+            two from sector_size to 1MB; larger blocks compress better,
+            smaller ones decode less per random read
+        image (str): Raw image to import into a new compressed image
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.open_compressed(path, size=size, sector_size=sector_size,
+                                 block_size=block_size, image=image, drive=drive)
+
+def export_compressed(path, drive=0):
+    """
+    Write a compressed drive out as a sparse raw image; close open files
+    first
+    
+    Args:
+        path (str): Output image path
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.export_compressed(path, drive)
+
+def open_remote(socket, writable=False, drive=0):
+    """
+    Attach a drive to an image served by another process (see serve);
+    the volume must be mounted again
+    
+    Reads and writes go to the server's block cache. One client at a time
+    may write, the others mount the drive write protected and see only the
+    sectors they have not cached yet, so they should remount after a
+    writer's changes.
+    
+    Args:
+        socket (str): Unix socket path of the server
+        writable (bool): Ask to be the writer; refused while another client
+            writes
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.open_remote(socket, writable=writable, drive=drive)
+
+def serve(socket, drive=0):
+    """
+    Serve the image of a drive to other processes until a signal handler
+    raises, e.g. KeyboardInterrupt. The drive's backend, cache, checksums
+    and throttle apply to all clients; it is not mounted here meanwhile.
+    
+    Args:
+        socket (str): Unix socket path to listen on, replaced if a stale
+            socket is left there
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.serve(socket, drive)
+
+def snapshot(drive=0):
+    """
+    Freeze the current state of a mounted volume; later writes keep the
+    replaced sectors in memory. Sync or close open files first so their
+    data is part of the snapshot
+    
+    Args:
+        drive (int): Drive number
+    
+    Returns:
+        tuple: (result code, snapshot id)
+    """
+    return fatfs.snapshot(drive)
+
+def rollback(snap, drive=0):
+    """
+    Return a volume to a snapshot and remount it. Newer snapshots are
+    dropped and files open on the volume become invalid
+    
+    Args:
+        snap (int): Snapshot id returned by snapshot()
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.rollback(snap, drive)
+
+def release_snapshot(snap, drive=0):
+    """
+    Drop a snapshot, keeping the current contents of the volume
+    
+    Args:
+        snap (int): Snapshot id returned by snapshot()
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.release_snapshot(snap, drive)
+
+def enable_checksums(path="", drive=0):
+    """
+    Keep a CRC32C of every sector, verified when the sector is read back
+    
+    A sector failing verification makes the read fail with FR_DISK_ERR.
+    The table is saved on sync and when the image is closed; call this
+    again after every open_image(). A table the image changed behind
+    (unclean shutdown, writes without checksums) is dropped and rebuilt
+    by scrub().
+    
+    Args:
+        path (str): Checksum table file, "" for the image path plus ".crc",
+            None to keep the table in memory only
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.enable_checksums(path, drive)
+
+def disable_checksums(drive=0):
+    """
+    Stop keeping sector checksums, saving the table
+    
+    Args:
+        drive (int): Drive number
+    
+    Returns:
+        int: FatFs result code
+    """
+    return fatfs.disable_checksums(drive)
+
+def scrub(sectors=0, drive=0):
+    """
+    Verify the next stretch of a drive against its checksums
+    
+    Each call continues where the previous one stopped, wrapping at the
+    end of the drive, so a long scrub can be spread over idle time.
+    Sectors with unknown checksums have them recorded.
+    
+    Args:
+        sectors (int): Sectors to verify, 0 for the whole drive
+        drive (int): Drive number
+    
+    Returns:
+        dict: start, next, scanned, recorded, errors, passes (times the
+            scan wrapped around) and bad_sectors (the first failing
+            sectors), or an error code
+    """
+    return fatfs.scrub(sectors, drive)
 
 def open_file(path, mode=FA_READ):
     """
@@ -148,6 +552,9 @@ def lseek(fp, offset):
     """
     Move read/write pointer, expand size
     
+    Seeks within the file use a cluster link map that is built on the first
+    seek, so they cost a step per fragment rather than a FAT read per cluster.
+    
     Args:
         fp: File pointer
         offset (int): New position
@@ -366,6 +773,22 @@ def getfree(path):
     """
     return fatfs.getfree(path)
 
+def fstrim(path):
+    """
+    Discard all free clusters of the volume so the host releases their
+    storage; freed clusters are already discarded as files shrink, this
+    catches up on images written before
+    
+    Args:
+        path (str): Volume path
+    
+    Returns:
+        dict: trimmed_clusters (free clusters found) and trimmed_sectors
+            (sectors whose host storage was released, 0 when the backend
+            cannot discard), or an error code
+    """
+    return fatfs.fstrim(path)
+
 def getlabel(path):
     """
     Get volume label
@@ -3,9 +3,45 @@
 Test script for working FatFs implementation with actual file I/O operations.
 """
 
+import os
+import struct
+import subprocess
 import sys
+import tempfile
+import time
 import traceback
 
+FR_OK = 0
+FR_DISK_ERR = 1
+FR_NOT_READY = 3
+FR_WRITE_PROTECTED = 10
+FR_INVALID_PARAMETER = 19
+
+def check(ok, what):
+    """Print the outcome of one assertion and return it"""
+    print(f"{'SUCCESS' if ok else 'ERROR'}: {what}")
+    return bool(ok)
+
+def write_file(path, data):
+    """Create or replace a file on a mounted volume"""
+    import fatfs
+    fp = fatfs.open(path, 0x02 | 0x08)  # FA_WRITE | FA_CREATE_ALWAYS
+    if fp < 256:
+        return fp
+    res, written = fatfs.write(fp, data)
+    close_res = fatfs.close(fp)
+    return res or close_res or (written != len(data))
+
+def read_file(path):
+    """Whole contents of a file on a mounted volume, None if it cannot be opened"""
+    import fatfs
+    fp = fatfs.open(path, 0x01)  # FA_READ
+    if fp < 256:
+        return None
+    data = fatfs.read(fp, fatfs.size(fp))
+    fatfs.close(fp)
+    return data
+
 def test_basic_operations():
     """Test basic mount, format, and file operations"""
     print("Testing basic FatFs operations with working implementation...")
@@ -187,6 +223,434 @@ def test_high_level_api():
         traceback.print_exc()
         return False
 
+def test_snapshots():
+    """Snapshot create, rollback and release in different orders"""
+    print("\n" + "="*60)
+    print("Testing snapshots...")
+    
+    import fatfs
+    from pyfatfs import core
+    drive = 1
+    ok = True
+    
+    with tempfile.TemporaryDirectory() as tmp:
+        fatfs.set_backend(core.BACKEND_FILE, drive)
+        fatfs.open_image(os.path.join(tmp, "snap.img"), size=8 << 20, drive=drive)
+        ok &= check(fatfs.mount("", drive, 1) == FR_OK, "Mounted a new volume")
+        a, b, c = f"{drive}:A.TXT", f"{drive}:B.TXT", f"{drive}:C.TXT"
+        
+        try:
+            # Releasing the middle of three snapshots hands its saved sectors
+            # to the older one, which must still roll back to its own state
+            write_file(a, b"one" * 1000)
+            res, s1 = fatfs.snapshot(drive)
+            write_file(a, b"two" * 3000)
+            write_file(b, b"b" * 5000)
+            res2, s2 = fatfs.snapshot(drive)
+            ok &= check(res == FR_OK and res2 == FR_OK and s1 != s2, "Took two snapshots")
+            write_file(a, b"three" * 700)
+            fatfs.unlink(b)
+            write_file(c, b"c" * 20000)
+            
+            ok &= check(fatfs.release_snapshot(s2, drive) == FR_OK, "Released the newer snapshot")
+            ok &= check(read_file(a) == b"three" * 700 and read_file(b) is None,
+                        "Release keeps the current contents")
+            ok &= check(fatfs.rollback(s2, drive) == FR_INVALID_PARAMETER, "A released snapshot is gone")
+            ok &= check(fatfs.rollback(s1, drive) == FR_OK, "Rolled back to the older snapshot")
+            ok &= check(read_file(a) == b"one" * 1000 and read_file(b) is None and read_file(c) is None,
+                        "Older snapshot restored after its successor was released")
+            
+            # Rolling back over several snapshots drops the newer ones only
+            res, s1 = fatfs.snapshot(drive)
+            write_file(a, b"2" * 9000)
+            res, s2 = fatfs.snapshot(drive)
+            write_file(a, b"3" * 100)
+            write_file(b, b"x" * 40000)
+            res, s3 = fatfs.snapshot(drive)
+            fatfs.unlink(a)
+            ok &= check(fatfs.rollback(s2, drive) == FR_OK and read_file(a) == b"2" * 9000 and
+                        read_file(b) is None, "Rolled back across a newer snapshot")
+            ok &= check(fatfs.release_snapshot(s3, drive) == FR_INVALID_PARAMETER,
+                        "Snapshots newer than the rollback target are dropped")
+            ok &= check(fatfs.rollback(s1, drive) == FR_OK and read_file(a) == b"one" * 1000,
+                        "The oldest snapshot survives a rollback to a newer one")
+            
+            # Releasing the oldest snapshot keeps the newer one usable
+            res, s1 = fatfs.snapshot(drive)
+            write_file(a, b"p" * 3000)
+            res, s2 = fatfs.snapshot(drive)
+            write_file(a, b"q" * 3000)
+            ok &= check(fatfs.release_snapshot(s1, drive) == FR_OK and
+                        fatfs.rollback(s2, drive) == FR_OK and read_file(a) == b"p" * 3000,
+                        "Released the oldest snapshot and rolled back to the newer one")
+            fatfs.release_snapshot(s2, drive)
+        finally:
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+    
+    return ok
+
+def test_overlay():
+    """Copy-on-write overlay deltas: reopening, refusing bad files, flattening"""
+    print("\n" + "="*60)
+    print("Testing overlay deltas...")
+    
+    import fatfs
+    from pyfatfs import core
+    drive = 1
+    ok = True
+    
+    with tempfile.TemporaryDirectory() as tmp:
+        base = os.path.join(tmp, "base.img")
+        delta = os.path.join(tmp, "base.delta")
+        flat = os.path.join(tmp, "flat.img")
+        a, b = f"{drive}:A.BIN", f"{drive}:B.BIN"
+        data_a, data_b = os.urandom(300000), os.urandom(50000)
+        
+        try:
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+            fatfs.open_image(base, size=8 << 20, drive=drive)
+            fatfs.mount("", drive, 1)
+            write_file(a, data_a)
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+            with open(base, "rb") as f:
+                base_bytes = f.read()
+            
+            ok &= check(fatfs.open_overlay(base, delta, drive=drive) == FR_OK and
+                        fatfs.mount("", drive, 1) == FR_OK, "Mounted an overlay over the base")
+            write_file(b, data_b)
+            write_file(a, data_a[:1000])
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+            with open(base, "rb") as f:
+                ok &= check(f.read() == base_bytes, "Base image untouched by overlay writes")
+            
+            # None takes the base path recorded in the delta
+            ok &= check(fatfs.open_overlay(None, delta, drive=drive) == FR_OK and
+                        fatfs.mount("", drive, 1) == FR_OK, "Reopened an existing delta")
+            ok &= check(read_file(a) == data_a[:1000] and read_file(b) == data_b,
+                        "Reopened delta keeps the overlay writes")
+            
+            ok &= check(fatfs.flatten_overlay(flat, drive) == FR_OK, "Flattened the overlay")
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+            fatfs.open_image(flat, drive=drive)
+            ok &= check(fatfs.mount("", drive, 1) == FR_OK and read_file(a) == data_a[:1000] and
+                        read_file(b) == data_b, "Flattened image holds base and delta")
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+            
+            # A file that is not a delta must be refused, not overwritten
+            with open(flat, "rb") as f:
+                flat_bytes = f.read()
+            ok &= check(fatfs.open_overlay(base, flat, drive=drive) == FR_NOT_READY,
+                        "Refused a file that is not a delta")
+            with open(flat, "rb") as f:
+                ok &= check(f.read() == flat_bytes, "Refused file left unchanged")
+            
+            with open(base, "r+b") as f:
+                f.truncate(4 << 20)
+            ok &= check(fatfs.open_overlay(None, delta, drive=drive) == FR_NOT_READY,
+                        "Refused a base shorter than the delta")
+        finally:
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+    
+    return ok
+
+def test_compressed():
+    """Compressed images: reopening, import and export, trimming, extent reuse"""
+    print("\n" + "="*60)
+    print("Testing compressed images...")
+    
+    import fatfs
+    from pyfatfs import core
+    drive = 1
+    ok = True
+    
+    with tempfile.TemporaryDirectory() as tmp:
+        path = os.path.join(tmp, "disk.cmp")
+        raw = os.path.join(tmp, "raw.img")
+        imported = os.path.join(tmp, "imported.cmp")
+        a, b = f"{drive}:A.BIN", f"{drive}:B.TXT"
+        data_b = b"compressible text\n" * 20000
+        
+        try:
+            ok &= check(fatfs.open_compressed(path, size=8 << 20, drive=drive) == FR_OK and
+                        fatfs.mount("", drive, 1) == FR_OK, "Mounted a new compressed image")
+            write_file(a, os.urandom(1 << 20))
+            one_copy = os.path.getsize(path)
+            
+            # Rewritten blocks take the extents freed by the previous sync
+            largest = 0
+            for _ in range(6):
+                data_a = os.urandom(1 << 20)
+                write_file(a, data_a)
+                largest = max(largest, os.path.getsize(path))
+            ok &= check(largest < 2 * one_copy + (256 << 10), "Rewrites reuse freed extents")
+            
+            write_file(b, data_b)
+            ok &= check(os.path.getsize(path) < one_copy + len(data_b) // 4, "Text compressed")
+            
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+            ok &= check(fatfs.open_compressed(path, drive=drive) == FR_OK and
+                        fatfs.mount("", drive, 1) == FR_OK and read_file(a) == data_a and
+                        read_file(b) == data_b, "Reopened the compressed image")
+            
+            ok &= check(fatfs.export_compressed(raw, drive) == FR_OK and
+                        os.path.getsize(raw) == 8 << 20, "Exported a raw image")
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+            fatfs.open_image(raw, drive=drive)
+            ok &= check(fatfs.mount("", drive, 1) == FR_OK and read_file(a) == data_a and
+                        read_file(b) == data_b, "Exported image holds the files")
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+            ok &= check(fatfs.open_compressed(imported, image=raw, drive=drive) == FR_OK and
+                        fatfs.mount("", drive, 1) == FR_OK and read_file(a) == data_a and
+                        read_file(b) == data_b, "Imported a raw image")
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+            
+            # Freed clusters are trimmed into zero blocks that take no space
+            fatfs.open_compressed(path, drive=drive)
+            fatfs.mount("", drive, 1)
+            fatfs.unlink(a)
+            fatfs.unlink(b)
+            trimmed = fatfs.fstrim(f"{drive}:")
+            ok &= check(isinstance(trimmed, dict) and trimmed["trimmed_sectors"] > 0,
+                        "Trimmed the free clusters")
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+            ok &= check(os.path.getsize(path) < 64 << 10, "Trimmed blocks released")
+            fatfs.open_compressed(path, drive=drive)
+            fatfs.export_compressed(raw, drive)
+            with open(raw, "rb") as f:
+                ok &= check(f.read().count(b"compressible text") == 0, "Trimmed blocks read as zeros")
+        finally:
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+    
+    return ok
+
+def test_checksums():
+    """Sector checksums: corruption detection, stale tables, scrubbing"""
+    print("\n" + "="*60)
+    print("Testing sector checksums...")
+    
+    import fatfs
+    from pyfatfs import core
+    drive = 1
+    ok = True
+    
+    with tempfile.TemporaryDirectory() as tmp:
+        image = os.path.join(tmp, "disk.img")
+        a = f"{drive}:A.TXT"
+        data = b"checksummed sector data\n" * 2000
+        
+        def attach():
+            fatfs.open_image(image, drive=drive)
+            res = fatfs.enable_checksums("", drive)
+            return res == FR_OK and fatfs.mount("", drive, 1) == FR_OK
+        
+        def corrupt(offset, keep_stamp):
+            """Flip a byte of the file data; bit rot would not touch the mtime"""
+            st = os.stat(image)
+            with open(image, "r+b") as f:
+                contents = f.read()
+                pos = contents.index(data[:64]) + offset
+                f.seek(pos)
+                f.write(bytes([contents[pos] ^ 0xFF]))
+            if keep_stamp:
+                os.utime(image, ns=(st.st_atime_ns, st.st_mtime_ns))
+        
+        try:
+            fatfs.set_backend(core.BACKEND_PREAD, drive)
+            fatfs.open_image(image, size=8 << 20, drive=drive)
+            ok &= check(fatfs.enable_checksums("", drive) == FR_OK and
+                        fatfs.mount("", drive, 1) == FR_OK, "Mounted with checksums")
+            write_file(a, data)
+            fatfs.set_backend(core.BACKEND_PREAD, drive)
+            ok &= check(os.path.exists(image + ".crc"), "Saved the checksum table")
+            
+            ok &= check(attach() and read_file(a) == data, "Reloaded the table and read back")
+            fatfs.set_backend(core.BACKEND_PREAD, drive)
+            
+            corrupt(100, keep_stamp=True)
+            ok &= check(attach(), "Mounted the corrupted image")
+            fp = fatfs.open(a, 0x01)
+            ok &= check(fatfs.read(fp, len(data)) == FR_DISK_ERR, "Corrupted sector fails to read")
+            fatfs.close(fp)
+            result = fatfs.scrub(0, drive)
+            ok &= check(isinstance(result, dict) and result["errors"] == 1 and
+                        len(result["bad_sectors"]) == 1, "Scrub found the corrupted sector")
+            fatfs.set_backend(core.BACKEND_PREAD, drive)
+            
+            # The image changed without the table, so the table is not trusted
+            corrupt(300, keep_stamp=False)
+            rotten = bytearray(data)
+            rotten[100] ^= 0xFF
+            rotten[300] ^= 0xFF
+            ok &= check(attach() and read_file(a) == bytes(rotten), "Dropped a stale table")
+            result = fatfs.scrub(0, drive)
+            ok &= check(isinstance(result, dict) and result["recorded"] == result["scanned"] > 0 and
+                        result["errors"] == 0, "Scrub recorded the unknown checksums")
+            result = fatfs.scrub(0, drive)
+            ok &= check(isinstance(result, dict) and result["recorded"] == 0 and result["errors"] == 0,
+                        "Second scrub verified every sector")
+        finally:
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+    
+    return ok
+
+def test_fat_in_memory():
+    """Free cluster counts and file contents with and without MOUNT_FAT_RAM"""
+    print("\n" + "="*60)
+    print("Testing FAT caching across FAT types...")
+    
+    import random
+    import fatfs
+    from pyfatfs import core
+    drive = 1
+    ok = True
+    
+    def workload(seed):
+        """Create, append to and delete files; returns the expected contents"""
+        rnd = random.Random(seed)
+        files = {}
+        for _ in range(150):
+            name = f"{drive}:F{rnd.randrange(40):02d}.BIN"
+            op = rnd.random()
+            if op < 0.4:
+                data = rnd.randbytes(rnd.choice([10, 600, 5000, 40000]))
+                if write_file(name, data) == FR_OK:
+                    files[name] = data
+            elif op < 0.7 and name in files:
+                data = rnd.randbytes(rnd.choice([100, 3000, 20000]))
+                fp = fatfs.open(name, core.FA_WRITE | core.FA_OPEN_APPEND)
+                res, written = fatfs.write(fp, data)
+                if fatfs.close(fp) == FR_OK and res == FR_OK:
+                    files[name] += data[:written]
+            elif fatfs.unlink(name) == FR_OK:
+                del files[name]
+        return files
+    
+    def count_free_clusters(image):
+        """Free clusters counted from the first FAT of an image"""
+        with open(image, "rb") as f:
+            boot = f.read(512)
+            part = 0
+            if boot[0] not in (0xEB, 0xE9):     # MBR, the volume is in the first partition
+                part = struct.unpack_from("<I", boot, 454)[0] * 512
+                f.seek(part)
+                boot = f.read(512)
+            bps, spc, rsv, nfats, nroot, ts16, _, fsz16 = struct.unpack_from("<HBHBHHBH", boot, 11)
+            total = ts16 or struct.unpack_from("<I", boot, 32)[0]
+            fsz = fsz16 or struct.unpack_from("<I", boot, 36)[0]
+            clusters = (total - rsv - nfats * fsz - (nroot * 32 + bps - 1) // bps) // spc
+            f.seek(part + rsv * bps)
+            fat = f.read(fsz * bps)
+        if clusters < 4085:
+            entries = (int.from_bytes(fat[n * 3 // 2:n * 3 // 2 + 2], "little") >> (n & 1) * 4 & 0xFFF
+                       for n in range(2, clusters + 2))
+        elif clusters < 65525:
+            entries = (struct.unpack_from("<H", fat, n * 2)[0] for n in range(2, clusters + 2))
+        else:
+            entries = (struct.unpack_from("<I", fat, n * 4)[0] & 0x0FFFFFFF for n in range(2, clusters + 2))
+        return sum(1 for e in entries if e == 0)
+    
+    def volume_state(files):
+        return (fatfs.getfree(f"{drive}:")["free_clusters"],
+                all(read_file(name) == data for name, data in files.items()))
+    
+    with tempfile.TemporaryDirectory() as tmp:
+        try:
+            # FAT12, FAT16 and FAT32 as picked by f_mkfs; the images are sparse
+            for kind, size in (("FAT12", 2 << 20), ("FAT16", 64 << 20), ("FAT32", 2200 << 20)):
+                states = {}
+                for opt in (core.MOUNT_NOW, core.MOUNT_NOW | core.MOUNT_FAT_RAM):
+                    image = os.path.join(tmp, f"{kind}-{opt}.img")
+                    fatfs.set_backend(core.BACKEND_FILE, drive)
+                    fatfs.open_image(image, size=size, drive=drive)
+                    fatfs.mount("", drive, opt)
+                    files = workload(size)
+                    live = volume_state(files)
+                    
+                    # FSINFO may cache the FAT32 count, so the FAT written out
+                    # is counted here as well
+                    fatfs.set_backend(core.BACKEND_FILE, drive)
+                    on_disk = count_free_clusters(image)
+                    remounted = {}
+                    for again in (core.MOUNT_NOW, core.MOUNT_NOW | core.MOUNT_FAT_RAM):
+                        fatfs.set_backend(core.BACKEND_FILE, drive)
+                        fatfs.open_image(image, drive=drive)
+                        fatfs.mount("", drive, again)
+                        remounted[again] = volume_state(files)
+                    ok &= check(live[1] and live[0] == on_disk and
+                                all(state == live for state in remounted.values()),
+                                f"{kind} with options {opt} consistent across remounts")
+                    states[opt] = live
+                ok &= check(len(set(states.values())) == 1,
+                            f"{kind} free clusters agree with and without MOUNT_FAT_RAM")
+        finally:
+            fatfs.set_backend(core.BACKEND_FILE, drive)
+    
+    return ok
+
+def test_block_server():
+    """Block server protocol: pipelined writes, read-only clients, one writer"""
+    print("\n" + "="*60)
+    print("Testing the block server...")
+    
+    import fatfs
+    from pyfatfs import core
+    writer, reader = 1, 2
+    ok = True
+    
+    with tempfile.TemporaryDirectory() as tmp:
+        image = os.path.join(tmp, "served.img")
+        sock = os.path.join(tmp, "blockd.sock")
+        root = os.path.dirname(os.path.dirname(os.path.abspath(core.__file__)))
+        env = dict(os.environ, PYTHONPATH=os.pathsep.join(filter(None, [root, os.environ.get("PYTHONPATH")])))
+        server = subprocess.Popen([sys.executable, "-m", "pyfatfs.blockd", image, sock,
+                                   "--size", str(16 << 20)], env=env)
+        files = {f"{writer}:F{i:02d}.BIN": os.urandom(7000 * i + 100) for i in range(24)}
+        
+        try:
+            for _ in range(200):
+                if os.path.exists(sock) or server.poll() is not None:
+                    break
+                time.sleep(0.05)
+            
+            # A client cache flushes many runs at once, each sent without
+            # waiting for the reply to the one before
+            ok &= check(fatfs.open_remote(sock, writable=True, drive=writer) == FR_OK and
+                        fatfs.set_cache(64, writer) == FR_OK and
+                        fatfs.mount("", writer, 1) == FR_OK, "Attached a writer")
+            ok &= check(all(write_file(name, data) == FR_OK for name, data in files.items()),
+                        "Wrote files through the server")
+            ok &= check(fatfs.open_remote(sock, writable=True, drive=reader) == FR_NOT_READY,
+                        "Refused a second writer")
+            
+            ok &= check(fatfs.open_remote(sock, drive=reader) == FR_OK and
+                        fatfs.mount("", reader, 1) == FR_OK, "Attached a read-only client")
+            ok &= check(all(read_file(f"{reader}:" + name[2:]) == data for name, data in files.items()),
+                        "Read-only client sees the pipelined writes")
+            ok &= check(fatfs.open(f"{reader}:NEW.BIN", core.FA_WRITE | core.FA_CREATE_ALWAYS) ==
+                        FR_WRITE_PROTECTED, "Read-only client cannot write")
+            
+            fatfs.set_backend(core.BACKEND_FILE, writer)
+            ok &= check(fatfs.open_remote(sock, writable=True, drive=writer) == FR_OK,
+                        "A writer may attach once the previous one left")
+            fatfs.set_backend(core.BACKEND_FILE, writer)
+            fatfs.set_backend(core.BACKEND_FILE, reader)
+            
+            # SIGTERM flushes the server's cache into the image
+            server.terminate()
+            ok &= check(server.wait(timeout=30) == 0 and not os.path.exists(sock), "Server shut down")
+            fatfs.open_image(image, drive=writer)
+            ok &= check(fatfs.mount("", writer, 1) == FR_OK and
+                        all(read_file(name) == data for name, data in files.items()),
+                        "Served writes reached the image")
+        finally:
+            if server.poll() is None:
+                server.kill()
+                server.wait()
+            fatfs.set_backend(core.BACKEND_FILE, writer)
+            fatfs.set_backend(core.BACKEND_FILE, reader)
+    
+    return ok
+
 def main():
     print("FatFs Working Implementation Test")
     print("=" * 50)
@@ -195,6 +659,12 @@ def main():
     
     success &= test_basic_operations()
     success &= test_high_level_api()
+    success &= test_snapshots()
+    success &= test_overlay()
+    success &= test_compressed()
+    success &= test_checksums()
+    success &= test_fat_in_memory()
+    success &= test_block_server()
     
     print("\n" + "="*50)
     if success:
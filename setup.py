@@ -1,5 +1,13 @@
 from setuptools import setup, Extension
 import os
+import sys
+
+define_macros = []
+
+# io_uring backend: only the kernel UAPI header is needed, the ring is
+# driven with raw syscalls. Without it DISK_BACKEND_URING maps to pread.
+if sys.platform.startswith('linux') and os.path.exists('/usr/include/linux/io_uring.h'):
+    define_macros.append(('DISK_HAVE_IO_URING', '1'))
 
 # Define the C extension
 fatfs_extension = Extension(
@@ -7,12 +15,21 @@ fatfs_extension = Extension(
     sources=[
         'source/ff.c',
         'source/diskio_working.c',
+        'source/diskio_cache.c',
+        'source/diskio_uring.c',
+        'source/diskio_overlay.c',
+        'source/diskio_compress.c',
+        'source/diskio_snapshot.c',
+        'source/diskio_checksum.c',
+        'source/diskio_throttle.c',
+        'source/diskio_remote.c',
         'source/ffsystem.c',
         'source/ffunicode.c',
         'source/fatfs_python.c',
     ],
     include_dirs=['source'],
-    define_macros=[],
+    depends=['source/diskio_working.h'],
+    define_macros=define_macros,
 )
 
 setup(
@@ -21,5 +38,8 @@ setup(
     description='Python bindings for FatFs library',
     packages=['pyfatfs'],
     ext_modules=[fatfs_extension],
+    entry_points={
+        'console_scripts': ['pyfatfs-blockd=pyfatfs.blockd:main'],
+    },
     python_requires='>=3.6',
 )
\ No newline at end of file
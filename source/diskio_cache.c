@@ -0,0 +1,504 @@
+/*-----------------------------------------------------------------------*/
+/* Sector block cache between FatFs and the disk backends                */
+/*-----------------------------------------------------------------------*/
+
+#include "ff.h"
+#include "diskio.h"
+#include "diskio_working.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#define SECTOR_BUFFER_ALIGN 4096
+
+/*-----------------------------------------------------------------------*/
+/* Page aligned sector buffers, usable in place by O_DIRECT transfers    */
+/*-----------------------------------------------------------------------*/
+static BYTE* alloc_sectors(size_t size)
+{
+#ifdef _WIN32
+    return (BYTE*)_aligned_malloc(size, SECTOR_BUFFER_ALIGN);
+#else
+    void* p;
+    return posix_memalign(&p, SECTOR_BUFFER_ALIGN, size) == 0 ? (BYTE*)p : NULL;
+#endif
+}
+
+static void free_sectors(BYTE* p)
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+/*-----------------------------------------------------------------------*/
+/* Slot bookkeeping                                                      */
+/*-----------------------------------------------------------------------*/
+static BYTE* slot_data(DISK_DEVICE* dev, UINT slot)
+{
+    return dev->cache.data + (size_t)slot * dev->sector_size;
+}
+
+static UINT hash_sector(DISK_CACHE* c, LBA_t sector)
+{
+    /* Runs of adjacent sectors land in adjacent buckets */
+    return (UINT)sector & c->hash_mask;
+}
+
+static UINT cache_lookup(DISK_CACHE* c, LBA_t sector)
+{
+    UINT slot = c->buckets[hash_sector(c, sector)];
+
+    while (slot != CACHE_NONE && c->slots[slot].sector != sector) {
+        slot = c->slots[slot].hash_next;
+    }
+    return slot;
+}
+
+static void hash_insert(DISK_CACHE* c, UINT slot)
+{
+    UINT b = hash_sector(c, c->slots[slot].sector);
+
+    c->slots[slot].hash_next = c->buckets[b];
+    c->buckets[b] = slot;
+}
+
+static void hash_remove(DISK_CACHE* c, UINT slot)
+{
+    UINT* link = &c->buckets[hash_sector(c, c->slots[slot].sector)];
+
+    while (*link != slot) {
+        link = &c->slots[*link].hash_next;
+    }
+    *link = c->slots[slot].hash_next;
+}
+
+static void lru_unlink(DISK_CACHE* c, UINT slot)
+{
+    DISK_CACHE_SLOT* s = &c->slots[slot];
+
+    if (s->lru_prev != CACHE_NONE) c->slots[s->lru_prev].lru_next = s->lru_next;
+    else c->lru_head = s->lru_next;
+    if (s->lru_next != CACHE_NONE) c->slots[s->lru_next].lru_prev = s->lru_prev;
+    else c->lru_tail = s->lru_prev;
+}
+
+static void lru_push(DISK_CACHE* c, UINT slot)
+{
+    DISK_CACHE_SLOT* s = &c->slots[slot];
+
+    s->lru_prev = CACHE_NONE;
+    s->lru_next = c->lru_head;
+    if (c->lru_head != CACHE_NONE) c->slots[c->lru_head].lru_prev = slot;
+    c->lru_head = slot;
+    if (c->lru_tail == CACHE_NONE) c->lru_tail = slot;
+}
+
+static void lru_touch(DISK_CACHE* c, UINT slot)
+{
+    if (c->lru_head != slot) {
+        lru_unlink(c, slot);
+        lru_push(c, slot);
+    }
+}
+
+/*-----------------------------------------------------------------------*/
+/* Write a dirty slot back to the backend                                */
+/*-----------------------------------------------------------------------*/
+static DRESULT write_back(DISK_DEVICE* dev, UINT slot)
+{
+    DISK_CACHE* c = &dev->cache;
+    DRESULT res = dev->ops->write(dev, slot_data(dev, slot), c->slots[slot].sector, 1);
+
+    if (res == RES_OK) {
+        c->slots[slot].dirty = 0;
+        c->dirty--;
+        dev->stats.cache_writebacks++;
+    }
+    return res;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Take a slot for a sector, evicting the least recently used one        */
+/*-----------------------------------------------------------------------*/
+static UINT cache_alloc(DISK_DEVICE* dev, LBA_t sector, DRESULT* res)
+{
+    DISK_CACHE* c = &dev->cache;
+    UINT slot;
+
+    if (c->free_head != CACHE_NONE) {
+        slot = c->free_head;
+        c->free_head = c->slots[slot].hash_next;
+        c->used++;
+    } else {
+        slot = c->lru_tail;
+        if (c->slots[slot].dirty) {
+            *res = write_back(dev, slot);
+            if (*res != RES_OK) {
+                return CACHE_NONE;
+            }
+        }
+        hash_remove(c, slot);
+        lru_unlink(c, slot);
+        dev->stats.cache_evictions++;
+    }
+
+    c->slots[slot].sector = sector;
+    c->slots[slot].valid = 1;
+    c->slots[slot].dirty = 0;
+    hash_insert(c, slot);
+    lru_push(c, slot);
+    return slot;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Allocate the cache requested for a drive                              */
+/*-----------------------------------------------------------------------*/
+int cache_init(DISK_DEVICE* dev)
+{
+    DISK_CACHE* c = &dev->cache;
+    UINT buckets = 1;
+
+    memset(c, 0, sizeof(*c));
+    if (dev->cache_sectors == 0) {
+        return 1;
+    }
+
+    while (buckets < dev->cache_sectors) {
+        buckets <<= 1;
+    }
+
+    c->data = alloc_sectors((size_t)dev->cache_sectors * dev->sector_size);
+    c->slots = (DISK_CACHE_SLOT*)calloc(dev->cache_sectors, sizeof(DISK_CACHE_SLOT));
+    c->buckets = (UINT*)malloc(buckets * sizeof(UINT));
+    c->bounce = alloc_sectors((size_t)(dev->cache_sectors / 2 + 1) * dev->sector_size);
+    c->flush_list = (DISK_CACHE_REF*)malloc(dev->cache_sectors * sizeof(DISK_CACHE_REF));
+    c->flush_vec = (const BYTE**)malloc(dev->cache_sectors * sizeof(const BYTE*));
+    if (!c->data || !c->slots || !c->buckets || !c->bounce || !c->flush_list || !c->flush_vec) {
+        cache_release(dev);
+        return 0;
+    }
+
+    memset(c->buckets, 0xFF, buckets * sizeof(UINT));   /* All CACHE_NONE */
+    for (UINT i = 0; i < dev->cache_sectors; i++) {
+        c->slots[i].hash_next = i + 1 < dev->cache_sectors ? i + 1 : CACHE_NONE;
+    }
+
+    c->capacity = dev->cache_sectors;
+    c->hash_mask = buckets - 1;
+    c->lru_head = c->lru_tail = CACHE_NONE;
+    c->free_head = 0;
+    return 1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Free the cache; dirty slots must have been flushed by the caller      */
+/*-----------------------------------------------------------------------*/
+void cache_release(DISK_DEVICE* dev)
+{
+    DISK_CACHE* c = &dev->cache;
+
+    free_sectors(c->data);
+    free(c->slots);
+    free(c->buckets);
+    free_sectors(c->bounce);
+    free(c->flush_list);
+    free(c->flush_vec);
+    memset(c, 0, sizeof(*c));
+}
+
+/*-----------------------------------------------------------------------*/
+/* Read sectors through the cache                                        */
+/*-----------------------------------------------------------------------*/
+DRESULT cache_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count)
+{
+    DISK_CACHE* c = &dev->cache;
+    UINT ss = dev->sector_size;
+    DRESULT res;
+    UINT i, slot;
+
+    /* Streaming transfers bypass the cache so they do not wipe the working set */
+    if (count > c->capacity / 2) {
+        res = dev->ops->read(dev, buff, sector, count);
+        if (res != RES_OK) {
+            return res;
+        }
+        for (i = 0; c->used && i < count; i++) {
+            slot = cache_lookup(c, sector + i);
+            if (slot != CACHE_NONE) {
+                memcpy(buff + (size_t)i * ss, slot_data(dev, slot), ss);  /* Cached copy is newer */
+            }
+        }
+        return RES_OK;
+    }
+
+    i = 0;
+    while (i < count) {
+        slot = cache_lookup(c, sector + i);
+        if (slot != CACHE_NONE) {
+            memcpy(buff + (size_t)i * ss, slot_data(dev, slot), ss);
+            lru_touch(c, slot);
+            dev->stats.cache_hits++;
+            i++;
+            continue;
+        }
+
+        /* Load the whole run of missing sectors with one backend call */
+        UINT n = 1;
+        while (i + n < count && cache_lookup(c, sector + i + n) == CACHE_NONE) {
+            n++;
+        }
+        res = dev->ops->read(dev, buff + (size_t)i * ss, sector + i, n);
+        if (res != RES_OK) {
+            return res;
+        }
+        dev->stats.cache_misses += n;
+
+        for (UINT k = 0; k < n; k++) {
+            slot = cache_alloc(dev, sector + i + k, &res);
+            if (slot == CACHE_NONE) {
+                return res;
+            }
+            memcpy(slot_data(dev, slot), buff + (size_t)(i + k) * ss, ss);
+        }
+        i += n;
+    }
+
+    return RES_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Write sectors into the cache, deferring the backend write             */
+/*-----------------------------------------------------------------------*/
+DRESULT cache_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    DISK_CACHE* c = &dev->cache;
+    UINT ss = dev->sector_size;
+    DRESULT res = RES_OK;
+    UINT i, slot;
+
+    /* Write-through policy and streaming transfers go straight to the backend,
+       so do zeros filling a host block, which it can punch out as a whole */
+    if (dev->sync_mode == DISK_SYNC_WRITE_THROUGH || count > c->capacity / 2 ||
+        ((size_t)count * ss >= DISK_SPARSE_BLOCK && disk_is_zero(buff, (size_t)count * ss))) {
+        res = dev->ops->write(dev, buff, sector, count);
+        if (res != RES_OK) {
+            return res;
+        }
+        for (i = 0; c->used && i < count; i++) {
+            slot = cache_lookup(c, sector + i);
+            if (slot != CACHE_NONE) {
+                memcpy(slot_data(dev, slot), buff + (size_t)i * ss, ss);
+                if (c->slots[slot].dirty) {
+                    c->slots[slot].dirty = 0;
+                    c->dirty--;
+                }
+            }
+        }
+        return RES_OK;
+    }
+
+    for (i = 0; i < count; i++) {
+        slot = cache_lookup(c, sector + i);
+        if (slot == CACHE_NONE) {
+            slot = cache_alloc(dev, sector + i, &res);
+            if (slot == CACHE_NONE) {
+                return res;
+            }
+        } else {
+            lru_touch(c, slot);
+        }
+        memcpy(slot_data(dev, slot), buff + (size_t)i * ss, ss);
+        if (!c->slots[slot].dirty) {
+            c->slots[slot].dirty = 1;
+            c->dirty++;
+        }
+    }
+
+    return RES_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Write a run of dirty slots holding consecutive sectors                */
+/*-----------------------------------------------------------------------*/
+static DRESULT write_run(DISK_DEVICE* dev, const DISK_CACHE_REF* run, UINT count)
+{
+    DISK_CACHE* c = &dev->cache;
+    UINT ss = dev->sector_size;
+    UINT chunk = count, i, k;
+    DRESULT res;
+
+    if (count > 1 && !dev->ops->writev) {
+        chunk = c->capacity / 2 + 1;    /* Gathered through the bounce buffer */
+    }
+
+    for (i = 0; i < count; i += chunk) {
+        UINT n = count - i < chunk ? count - i : chunk;
+
+        if (n == 1) {
+            res = dev->ops->write(dev, slot_data(dev, run[i].slot), run[i].sector, 1);
+        } else if (dev->ops->writev) {
+            for (k = 0; k < n; k++) {
+                c->flush_vec[k] = slot_data(dev, run[i + k].slot);
+            }
+            res = dev->ops->writev(dev, c->flush_vec, run[i].sector, n);
+        } else {
+            for (k = 0; k < n; k++) {
+                memcpy(c->bounce + (size_t)k * ss, slot_data(dev, run[i + k].slot), ss);
+            }
+            res = dev->ops->write(dev, c->bounce, run[i].sector, n);
+        }
+        if (res != RES_OK) {
+            return res;
+        }
+
+        dev->stats.cache_writebacks += n;
+        dev->stats.flush_writes++;
+    }
+
+    return RES_OK;
+}
+
+static int compare_refs(const void* a, const void* b)
+{
+    LBA_t sa = ((const DISK_CACHE_REF*)a)->sector;
+    LBA_t sb = ((const DISK_CACHE_REF*)b)->sector;
+
+    return sa < sb ? -1 : sa > sb;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Write every dirty slot back, merging adjacent sectors into one write  */
+/*-----------------------------------------------------------------------*/
+DRESULT cache_flush(DISK_DEVICE* dev)
+{
+    DISK_CACHE* c = &dev->cache;
+    DISK_CACHE_REF* list = c->flush_list;
+    UINT n = 0, i, run;
+    DRESULT res = RES_OK;
+
+    if (c->dirty == 0) {
+        return RES_OK;
+    }
+
+    for (UINT slot = 0; slot < c->capacity; slot++) {
+        if (c->slots[slot].valid && c->slots[slot].dirty) {
+            list[n].sector = c->slots[slot].sector;
+            list[n].slot = slot;
+            n++;
+        }
+    }
+    qsort(list, n, sizeof(DISK_CACHE_REF), compare_refs);
+
+    for (i = 0; i < n; i += run) {
+        run = 1;
+        while (i + run < n && list[i + run].sector == list[i].sector + run) {
+            run++;
+        }
+        res = write_run(dev, list + i, run);
+        if (res != RES_OK) {
+            break;
+        }
+    }
+
+    /* Queued runs still reference the slots, so wait for them even on failure */
+    if (dev->ops->drain && dev->ops->drain(dev) != RES_OK) {
+        return RES_ERROR;
+    }
+
+    /* A queued write is only done once drained, so the written runs turn clean
+       here. On failure every slot stays dirty and the next flush retries it. */
+    if (res != RES_OK) {
+        return res;
+    }
+    for (i = 0; i < n; i++) {
+        c->slots[list[i].slot].dirty = 0;
+    }
+    c->dirty -= n;
+    return RES_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Load sectors that are not cached yet as clean slots                   */
+/*-----------------------------------------------------------------------*/
+DRESULT cache_prefetch(DISK_DEVICE* dev, LBA_t sector, UINT count)
+{
+    DISK_CACHE* c = &dev->cache;
+    UINT ss = dev->sector_size;
+    UINT i = 0, limit = c->capacity / 2 + 1;
+    DRESULT res;
+
+    while (i < count) {
+        if (cache_lookup(c, sector + i) != CACHE_NONE) {
+            i++;
+            continue;
+        }
+
+        /* One backend read per run of uncached sectors */
+        UINT n = 1;
+        while (i + n < count && n < limit && cache_lookup(c, sector + i + n) == CACHE_NONE) {
+            n++;
+        }
+        res = dev->ops->read(dev, c->bounce, sector + i, n);
+        if (res != RES_OK) {
+            return res;
+        }
+
+        for (UINT k = 0; k < n; k++) {
+            UINT slot = cache_alloc(dev, sector + i + k, &res);
+            if (slot == CACHE_NONE) {
+                return res;
+            }
+            memcpy(slot_data(dev, slot), c->bounce + (size_t)k * ss, ss);
+        }
+        i += n;
+    }
+
+    return RES_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Forget the cached sectors of a discarded range, dirty ones unwritten  */
+/*-----------------------------------------------------------------------*/
+static void drop_slot(DISK_CACHE* c, UINT slot)
+{
+    hash_remove(c, slot);
+    lru_unlink(c, slot);
+    if (c->slots[slot].dirty) {
+        c->dirty--;
+    }
+    c->slots[slot].valid = 0;
+    c->slots[slot].dirty = 0;
+    c->slots[slot].hash_next = c->free_head;
+    c->free_head = slot;
+    c->used--;
+}
+
+void cache_discard(DISK_DEVICE* dev, LBA_t sector, LBA_t count)
+{
+    DISK_CACHE* c = &dev->cache;
+
+    if (c->used == 0) {
+        return;
+    }
+
+    /* Short ranges probe the hash, long ones sweep the slots */
+    if (count <= c->capacity) {
+        for (LBA_t i = 0; i < count; i++) {
+            UINT slot = cache_lookup(c, sector + i);
+            if (slot != CACHE_NONE) {
+                drop_slot(c, slot);
+            }
+        }
+    } else {
+        for (UINT slot = 0; slot < c->capacity; slot++) {
+            if (c->slots[slot].valid && c->slots[slot].sector - sector < count) {
+                drop_slot(c, slot);
+            }
+        }
+    }
+}
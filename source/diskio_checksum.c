@@ -0,0 +1,597 @@
+/*-----------------------------------------------------------------------*/
+/* Per-sector integrity checksums                                        */
+/*-----------------------------------------------------------------------*/
+/* A layer over the drive's backend keeps the CRC32C of every sector in  */
+/* a table: writes record it, reads verify it and fail with RES_ERROR on */
+/* a mismatch. The table is kept in a sidecar file next to the image and */
+/* written on CTRL_SYNC. A sector whose checksum is unknown (new table,  */
+/* discarded or failed write) passes unchecked until it is written or    */
+/* scrubbed, so a table that may be stale is dropped rather than trusted */
+/* and rebuilt by scrubbing.                                             */
+
+#include "ff.h"
+#include "diskio.h"
+#include "diskio_working.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define CRC_HAVE_SSE42 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC_HAVE_ARM 1
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* CRC32C (Castagnoli)                                                   */
+/*-----------------------------------------------------------------------*/
+#define CRC32C_POLY     0x82F63B78      /* Reflected polynomial */
+
+static DWORD crc_table[8][256];         /* Slicing-by-8 tables */
+static DWORD (*crc_update)(DWORD crc, const BYTE* p, size_t n);
+
+static DWORD crc32c_soft(DWORD crc, const BYTE* p, size_t n)
+{
+    for (; n && ((size_t)p & 7); n--) {
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    for (; n >= 8; p += 8, n -= 8) {
+        DWORD lo = crc ^ ((DWORD)p[0] | (DWORD)p[1] << 8 | (DWORD)p[2] << 16 | (DWORD)p[3] << 24);
+        DWORD hi = (DWORD)p[4] | (DWORD)p[5] << 8 | (DWORD)p[6] << 16 | (DWORD)p[7] << 24;
+
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+    }
+    for (; n; n--) {
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC_HAVE_SSE42
+/* Built for SSE4.2 alone, it is only called after the CPU was checked */
+__attribute__((target("sse4.2")))
+static DWORD crc32c_sse42(DWORD crc, const BYTE* p, size_t n)
+{
+    QWORD c = crc;
+
+    for (; n && ((size_t)p & 7); n--) {
+        c = _mm_crc32_u8((DWORD)c, *p++);
+    }
+    for (; n >= 8; p += 8, n -= 8) {
+        QWORD w;
+
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    for (; n; n--) {
+        c = _mm_crc32_u8((DWORD)c, *p++);
+    }
+    return (DWORD)c;
+}
+#endif
+
+#ifdef CRC_HAVE_ARM
+static DWORD crc32c_arm(DWORD crc, const BYTE* p, size_t n)
+{
+    for (; n && ((size_t)p & 7); n--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    for (; n >= 8; p += 8, n -= 8) {
+        QWORD w;
+
+        memcpy(&w, p, 8);
+        crc = __crc32cd(crc, w);
+    }
+    for (; n; n--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static void crc_init(void)
+{
+    for (DWORD i = 0; i < 256; i++) {
+        DWORD c = i;
+
+        for (int k = 0; k < 8; k++) {
+            c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+        }
+        crc_table[0][i] = c;
+    }
+    for (DWORD i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc_table[t][i] = crc_table[0][crc_table[t - 1][i] & 0xFF] ^ (crc_table[t - 1][i] >> 8);
+        }
+    }
+
+    crc_update = crc32c_soft;
+#if defined(CRC_HAVE_SSE42)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_update = crc32c_sse42;
+    }
+#elif defined(CRC_HAVE_ARM)
+    crc_update = crc32c_arm;
+#endif
+}
+
+DWORD disk_crc32c(DWORD crc, const void* data, size_t len)
+{
+    if (!crc_update) {
+        crc_init();
+    }
+    return ~crc_update(~crc, (const BYTE*)data, len);
+}
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CHECKSUM_MAGIC      "FATFSCRC"
+#define CHECKSUM_VERSION    1
+#define CHECKSUM_HEADER     4096                /* Header size, the table follows */
+#define CHECKSUM_PAGE       1024                /* Table entries written together */
+#define CHECKSUM_SCRUB      (1024 * 1024)       /* Bytes per scrub read */
+
+/* Sidecar state, the table is trusted only when closed cleanly */
+#define STATE_CLEAN         0
+#define STATE_OPEN          1
+
+#define CRC_UNKNOWN         0                   /* Table entry of an unchecked sector */
+
+struct DISK_CHECKSUM {
+    DWORD*  table;              /* Tagged CRC32C per sector, CRC_UNKNOWN: unchecked */
+    BYTE*   dirty;              /* 1 bit per table page not written to the sidecar */
+    int     any_dirty;
+    int     fd;                 /* Sidecar (-1:table kept in memory) */
+    int     clean;              /* Sidecar header says STATE_CLEAN */
+    LBA_t   cursor;             /* Next sector to scrub */
+};
+
+/* Checksum of a sector as stored in the table, never CRC_UNKNOWN */
+static DWORD sector_tag(DISK_DEVICE* dev, const BYTE* data)
+{
+    DWORD crc = disk_crc32c(0, data, dev->sector_size);
+
+    return crc != CRC_UNKNOWN ? crc : 1;
+}
+
+static void set_entry(DISK_CHECKSUM* c, LBA_t sector, DWORD tag)
+{
+    DWORD page = (DWORD)(sector / CHECKSUM_PAGE);
+
+    c->table[sector] = tag;
+    c->dirty[page / 8] |= (BYTE)(1 << (page % 8));
+    c->any_dirty = 1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Sidecar file                                                          */
+/*-----------------------------------------------------------------------*/
+/* The image as last seen by the table, a change made without the layer  */
+/* makes the table stale */
+static void image_stamp(DISK_DEVICE* dev, BYTE* hdr)
+{
+    struct stat st;
+
+    memset(hdr + 32, 0, 24);
+    if (stat(dev->path, &st) == 0) {
+        disk_st_le(hdr + 32, (QWORD)st.st_size, 8);
+        disk_st_le(hdr + 40, (QWORD)st.st_mtime, 8);
+#ifdef __linux__
+        disk_st_le(hdr + 48, (QWORD)st.st_mtim.tv_nsec, 8);
+#endif
+    }
+}
+
+static int write_header(DISK_DEVICE* dev, DISK_CHECKSUM* c, DWORD state)
+{
+    BYTE hdr[CHECKSUM_HEADER];
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, CHECKSUM_MAGIC, 8);
+    disk_st_le(hdr + 8, CHECKSUM_VERSION, 4);
+    disk_st_le(hdr + 12, dev->sector_size, 4);
+    disk_st_le(hdr + 16, dev->sector_count, 8);
+    disk_st_le(hdr + 24, state, 4);
+    image_stamp(dev, hdr);
+    if (!disk_pwrite_full(c->fd, hdr, sizeof(hdr), 0)) {
+        return 0;
+    }
+    c->clean = state == STATE_CLEAN;
+    return 1;
+}
+
+/* Write the changed table pages */
+static int write_table(DISK_DEVICE* dev, DISK_CHECKSUM* c)
+{
+    DWORD pages = (DWORD)((dev->sector_count + CHECKSUM_PAGE - 1) / CHECKSUM_PAGE);
+    BYTE buf[CHECKSUM_PAGE * 4];
+
+    for (DWORD p = 0; p < pages; p++) {
+        if (!(c->dirty[p / 8] & (1 << (p % 8)))) {
+            continue;
+        }
+
+        LBA_t first = (LBA_t)p * CHECKSUM_PAGE;
+        UINT n = dev->sector_count - first < CHECKSUM_PAGE ? (UINT)(dev->sector_count - first) : CHECKSUM_PAGE;
+        for (UINT i = 0; i < n; i++) {
+            disk_st_le(buf + i * 4, c->table[first + i], 4);
+        }
+        if (!disk_pwrite_full(c->fd, buf, (size_t)n * 4, CHECKSUM_HEADER + (off_t)first * 4)) {
+            return 0;
+        }
+        c->dirty[p / 8] &= (BYTE)~(1 << (p % 8));
+    }
+    c->any_dirty = 0;
+    return 1;
+}
+
+/* A table is loaded only if it was closed cleanly over this very image */
+static int load_table(DISK_DEVICE* dev, DISK_CHECKSUM* c)
+{
+    BYTE hdr[CHECKSUM_HEADER], stamp[CHECKSUM_HEADER];
+    BYTE buf[CHECKSUM_PAGE * 4];
+    struct stat st;
+
+    if (fstat(c->fd, &st) != 0) {
+        return 0;
+    }
+    if (st.st_size == 0) {
+        return 1;       /* New sidecar */
+    }
+    if (st.st_size < CHECKSUM_HEADER || !disk_pread_full(c->fd, hdr, sizeof(hdr), 0) ||
+        memcmp(hdr, CHECKSUM_MAGIC, 8) != 0 || disk_ld_le(hdr + 8, 4) != CHECKSUM_VERSION) {
+        return 0;       /* Never overwrite a file that is not a checksum table */
+    }
+    if (disk_ld_le(hdr + 12, 4) != dev->sector_size || disk_ld_le(hdr + 16, 8) != dev->sector_count) {
+        return 0;
+    }
+
+    image_stamp(dev, stamp);
+    if (disk_ld_le(hdr + 24, 4) != STATE_CLEAN || memcmp(hdr + 32, stamp + 32, 24) != 0) {
+        return 1;       /* Stale, start over with unknown checksums */
+    }
+
+    for (LBA_t first = 0; first < dev->sector_count; first += CHECKSUM_PAGE) {
+        UINT n = dev->sector_count - first < CHECKSUM_PAGE ? (UINT)(dev->sector_count - first) : CHECKSUM_PAGE;
+
+        if (!disk_pread_full(c->fd, buf, (size_t)n * 4, CHECKSUM_HEADER + (off_t)first * 4)) {
+            return 0;
+        }
+        for (UINT i = 0; i < n; i++) {
+            c->table[first + i] = (DWORD)disk_ld_le(buf + i * 4, 4);
+        }
+    }
+    c->clean = 1;
+    return 1;
+}
+
+/* Everything but the first write after a sync finds the header open */
+static DRESULT mark_open(DISK_DEVICE* dev, DISK_CHECKSUM* c)
+{
+    if (c->fd < 0 || !c->clean) {
+        return RES_OK;
+    }
+    if (!write_header(dev, c, STATE_OPEN)) {
+        return RES_ERROR;
+    }
+    if (dev->sync_mode != DISK_SYNC_NONE && disk_datasync(c->fd) != 0) {
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+static DRESULT save_table(DISK_DEVICE* dev, DISK_CHECKSUM* c)
+{
+    if (c->fd < 0 || (!c->any_dirty && c->clean)) {
+        return RES_OK;
+    }
+    if (!write_table(dev, c) || !write_header(dev, c, STATE_CLEAN)) {
+        return RES_ERROR;
+    }
+    if (dev->sync_mode != DISK_SYNC_NONE && disk_datasync(c->fd) != 0) {
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Backend operations layered over the drive's own                       */
+/*-----------------------------------------------------------------------*/
+static DRESULT crc_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count)
+{
+    DISK_CHECKSUM* c = dev->crc;
+    DRESULT res = dev->crc_lower->read(dev, buff, sector, count);
+
+    if (res != RES_OK) {
+        return res;
+    }
+    for (UINT i = 0; i < count; i++) {
+        DWORD tag = c->table[sector + i];
+
+        if (tag != CRC_UNKNOWN && tag != sector_tag(dev, buff + (size_t)i * dev->sector_size)) {
+            dev->stats.checksum_errors++;
+            return RES_ERROR;
+        }
+    }
+    return RES_OK;
+}
+
+/* The data on the backend is unknown after a failed write */
+static DRESULT record_write(DISK_DEVICE* dev, const BYTE* buff, const BYTE* const* bufs,
+                            LBA_t sector, UINT count, DRESULT res)
+{
+    DISK_CHECKSUM* c = dev->crc;
+
+    for (UINT i = 0; i < count; i++) {
+        const BYTE* data = buff ? buff + (size_t)i * dev->sector_size : bufs[i];
+
+        set_entry(c, sector + i, res == RES_OK ? sector_tag(dev, data) : CRC_UNKNOWN);
+    }
+    if (res == RES_OK && dev->sync_mode == DISK_SYNC_WRITE_THROUGH) {
+        res = save_table(dev, c);
+    }
+    return res;
+}
+
+static DRESULT crc_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    DRESULT res = mark_open(dev, dev->crc);
+
+    if (res != RES_OK) {
+        return res;
+    }
+    return record_write(dev, buff, NULL, sector, count, dev->crc_lower->write(dev, buff, sector, count));
+}
+
+static DRESULT crc_writev(DISK_DEVICE* dev, const BYTE* const* bufs, LBA_t sector, UINT count)
+{
+    DRESULT res = mark_open(dev, dev->crc);
+
+    if (res != RES_OK) {
+        return res;
+    }
+    return record_write(dev, NULL, bufs, sector, count, dev->crc_lower->writev(dev, bufs, sector, count));
+}
+
+static DRESULT crc_sync(DISK_DEVICE* dev)
+{
+    DRESULT res = dev->crc_lower->sync(dev);
+
+    /* The table never describes data that has not reached the backend */
+    return res == RES_OK ? save_table(dev, dev->crc) : res;
+}
+
+/* Discarded sectors may read back as anything */
+static DRESULT crc_trim(DISK_DEVICE* dev, LBA_t sector, LBA_t count)
+{
+    DRESULT res = mark_open(dev, dev->crc);
+
+    if (res == RES_OK) {
+        res = dev->crc_lower->trim(dev, sector, count);
+    }
+    for (LBA_t i = 0; i < count; i++) {
+        set_entry(dev->crc, sector + i, CRC_UNKNOWN);
+    }
+    return res;
+}
+
+static void free_checksum(DISK_DEVICE* dev)
+{
+    DISK_CHECKSUM* c = dev->crc;
+
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+    free(c->table);
+    free(c->dirty);
+    free(c);
+    dev->crc = NULL;
+}
+
+static void uninstall(DISK_DEVICE* dev)
+{
+    dev->ops = dev->crc_lower;
+    dev->crc_lower = NULL;
+    free_checksum(dev);
+}
+
+/* The table is saved after the backend is closed, which may touch the
+   image once more. The layer is removed first, a layer below restores
+   its own on close */
+static void crc_close(DISK_DEVICE* dev)
+{
+    DISK_CHECKSUM* c = dev->crc;
+    const DISK_OPS* lower = dev->crc_lower;
+
+    dev->ops = lower;
+    dev->crc_lower = NULL;
+    lower->close(dev);
+    if (c->fd >= 0) {
+        c->clean = 0;
+        save_table(dev, c);
+    }
+    free_checksum(dev);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Start keeping checksums of a drive                                    */
+/*-----------------------------------------------------------------------*/
+DRESULT checksum_enable(DISK_DEVICE* dev, const char* path)
+{
+    DISK_CHECKSUM* c;
+    size_t pages = (size_t)((dev->sector_count + CHECKSUM_PAGE - 1) / CHECKSUM_PAGE);
+
+    /* Snapshots restore sectors below the layer they would have to wrap */
+    if (dev->crc || dev->snap_lower) {
+        return RES_PARERR;
+    }
+
+    c = (DISK_CHECKSUM*)calloc(1, sizeof(DISK_CHECKSUM));
+    if (!c) {
+        return RES_ERROR;
+    }
+    dev->crc = c;
+    c->fd = -1;
+    c->table = (DWORD*)calloc((size_t)dev->sector_count, sizeof(DWORD));
+    c->dirty = (BYTE*)calloc((pages + 7) / 8, 1);
+    if (!c->table || !c->dirty) {
+        free_checksum(dev);
+        return RES_ERROR;
+    }
+
+    if (path) {
+        c->fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (c->fd < 0 || !load_table(dev, c)) {
+            free_checksum(dev);
+            return RES_ERROR;
+        }
+        if (!c->clean) {
+            /* A dropped table is rewritten in full on the next save */
+            memset(c->dirty, 0xFF, (pages + 7) / 8);
+            c->any_dirty = 1;
+        }
+        if (ftruncate(c->fd, CHECKSUM_HEADER + (off_t)dev->sector_count * 4) != 0 ||
+            !write_header(dev, c, STATE_OPEN)) {
+            free_checksum(dev);
+            return RES_ERROR;
+        }
+    }
+
+    /* Dirty cached sectors still pass through the layer when flushed */
+    dev->crc_lower = dev->ops;
+    dev->crc_ops = *dev->ops;
+    dev->crc_ops.close = crc_close;
+    dev->crc_ops.read = crc_read;
+    dev->crc_ops.write = crc_write;
+    dev->crc_ops.writev = dev->ops->writev ? crc_writev : NULL;
+    dev->crc_ops.sync = crc_sync;
+    dev->crc_ops.trim = dev->ops->trim ? crc_trim : NULL;
+    dev->ops = &dev->crc_ops;
+    return RES_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Stop keeping checksums, saving the table                              */
+/*-----------------------------------------------------------------------*/
+DRESULT checksum_disable(DISK_DEVICE* dev)
+{
+    DRESULT res;
+
+    if (dev->ops != &dev->crc_ops) {
+        return RES_PARERR;
+    }
+
+    res = cache_flush(dev);
+    if (res == RES_OK) {
+        res = crc_sync(dev);
+    }
+    if (res != RES_OK) {
+        return res;
+    }
+    uninstall(dev);
+    return RES_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Verify a stretch of the backend, recording unknown checksums          */
+/*-----------------------------------------------------------------------*/
+DRESULT checksum_scrub(DISK_DEVICE* dev, LBA_t count, DISK_SCRUB* result)
+{
+    DISK_CHECKSUM* c = dev->crc;
+    UINT ss = dev->sector_size;
+    UINT batch = CHECKSUM_SCRUB / ss;
+    BYTE* buf;
+    DRESULT res = RES_OK;
+
+    if (!c) {
+        return RES_PARERR;
+    }
+    memset(result, 0, sizeof(*result));
+    result->start = c->cursor;
+    if (count == 0 || count > dev->sector_count) {
+        count = dev->sector_count;
+    }
+
+    buf = (BYTE*)malloc(CHECKSUM_SCRUB);
+    if (!buf) {
+        return RES_ERROR;
+    }
+
+    /* Queued writes first, the table already describes them */
+    if (dev->crc_lower->drain) {
+        res = dev->crc_lower->drain(dev);
+    }
+
+    while (res == RES_OK && result->scanned < count) {
+        LBA_t left = dev->sector_count - c->cursor;
+        UINT n = batch;
+
+        if (n > left) n = (UINT)left;
+        if (n > count - result->scanned) n = (UINT)(count - result->scanned);
+
+        res = dev->crc_lower->read(dev, buf, c->cursor, n);
+        for (UINT i = 0; res == RES_OK && i < n; i++) {
+            LBA_t sect = c->cursor + i;
+            DWORD tag = sector_tag(dev, buf + (size_t)i * ss);
+
+            if (c->table[sect] == CRC_UNKNOWN) {
+                set_entry(c, sect, tag);
+                result->recorded++;
+            } else if (c->table[sect] != tag) {
+                if (result->bad_count < DISK_SCRUB_BAD) {
+                    result->bad[result->bad_count++] = sect;
+                }
+                result->errors++;
+                dev->stats.checksum_errors++;
+            }
+        }
+        if (res != RES_OK) {
+            break;
+        }
+
+        dev->stats.scrubbed_sectors += n;
+        result->scanned += n;
+        c->cursor += n;
+        if (c->cursor == dev->sector_count) {
+            c->cursor = 0;
+            result->passes++;
+        }
+    }
+    result->next = c->cursor;
+
+    free(buf);
+    return res;
+}
+
+#else
+
+DRESULT checksum_enable(DISK_DEVICE* dev, const char* path)
+{
+    (void)dev;
+    (void)path;
+    return RES_NOTRDY;
+}
+
+DRESULT checksum_disable(DISK_DEVICE* dev)
+{
+    (void)dev;
+    return RES_PARERR;
+}
+
+DRESULT checksum_scrub(DISK_DEVICE* dev, LBA_t count, DISK_SCRUB* result)
+{
+    (void)dev;
+    (void)count;
+    (void)result;
+    return RES_PARERR;
+}
+
+#endif
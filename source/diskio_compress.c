@@ -0,0 +1,764 @@
+/*-----------------------------------------------------------------------*/
+/* Compressed image backend                                              */
+/*-----------------------------------------------------------------------*/
+/* The disk is split into fixed-size blocks compressed independently, so */
+/* any sector is reached by decoding a single block. A header block is   */
+/* followed by an index giving the method and extent of every block in   */
+/* the data area; zero blocks take no space. Rewritten blocks go to free */
+/* space and the index is updated on CTRL_SYNC, the extents they replace */
+/* are reused only after that so the synced state stays intact.          */
+
+#include "ff.h"
+#include "diskio.h"
+#include "diskio_working.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define COMPRESS_MAGIC      "FATFSCMP"
+#define COMPRESS_VERSION    1
+#define COMPRESS_HEADER     4096                /* Header size, the index follows */
+#define COMPRESS_ENTRY      16                  /* Bytes per index entry */
+#define COMPRESS_ALIGN      512                 /* Extent granularity of the data area */
+#define COMPRESS_SLOTS      8                   /* Decoded blocks kept in memory */
+#define COMPRESS_CHUNK      (1024 * 1024)       /* Bytes per call when importing or exporting */
+
+/* Storage method of a block, recorded per block in the index */
+#define METHOD_ZERO         0   /* All zeros, no extent */
+#define METHOD_STORED       1   /* Uncompressed */
+#define METHOD_LZ           2   /* Bundled LZ77 codec below */
+
+/* Bundled codec: LZ4 style sequences of literals and a back reference */
+#define LZ_MIN_MATCH        4
+#define LZ_MAX_DIST         65535
+#define LZ_HASH_BITS        12
+
+typedef struct {
+    QWORD   ofs;                /* Extent in the file */
+    DWORD   len;                /* Stored bytes */
+    DWORD   method;             /* METHOD_* */
+} COMPRESS_ENTRY_T;
+
+typedef struct {
+    QWORD   ofs;
+    QWORD   len;
+} COMPRESS_EXTENT;
+
+typedef struct {
+    DWORD   block;
+    BYTE    valid;
+    BYTE    dirty;              /* Newer than the stored block */
+    DWORD   used;               /* Tick of the last access */
+    BYTE*   data;
+} COMPRESS_SLOT;
+
+typedef struct {
+    COMPRESS_EXTENT* list;
+    UINT    count;
+    UINT    capacity;
+} EXTENT_LIST;
+
+struct DISK_COMPRESS {
+    UINT    block_size;
+    UINT    block_sectors;
+    DWORD   block_count;
+    QWORD   data_ofs;           /* Start of the data area */
+    QWORD   end;                /* End of the used data area */
+    COMPRESS_ENTRY_T* index;
+    DWORD   dirty_lo;           /* Index entries not written to the file yet */
+    DWORD   dirty_hi;
+    EXTENT_LIST free;           /* Reusable extents */
+    EXTENT_LIST pending;        /* Replaced extents, reusable after the next index write */
+    COMPRESS_SLOT slots[COMPRESS_SLOTS];
+    DWORD   tick;
+    BYTE*   packed;             /* One compressed block */
+    DWORD   hash[1 << LZ_HASH_BITS];
+};
+
+static QWORD round_up(QWORD n, QWORD unit)
+{
+    return (n + unit - 1) / unit * unit;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Bundled codec                                                         */
+/*-----------------------------------------------------------------------*/
+static BYTE* lz_put_len(BYTE* op, const BYTE* oend, size_t len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (BYTE)len;
+    return op;
+}
+
+/* One sequence; the last one carries literals only (mlen == 0) */
+static BYTE* lz_put_seq(BYTE* op, const BYTE* oend, const BYTE* lit, size_t litlen, size_t dist, size_t mlen)
+{
+    size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    BYTE* token = op++;
+
+    if (token >= oend) return NULL;
+    *token = (BYTE)(((litlen < 15 ? litlen : 15) << 4) | (ml < 15 ? ml : 15));
+    if (litlen >= 15 && !(op = lz_put_len(op, oend, litlen - 15))) return NULL;
+    if ((size_t)(oend - op) < litlen) return NULL;
+    memcpy(op, lit, litlen);
+    op += litlen;
+    if (!mlen) return op;
+
+    if (oend - op < 2) return NULL;
+    *op++ = (BYTE)dist;
+    *op++ = (BYTE)(dist >> 8);
+    if (ml >= 15 && !(op = lz_put_len(op, oend, ml - 15))) return NULL;
+    return op;
+}
+
+static UINT lz_hash(const BYTE* p)
+{
+    DWORD v;
+
+    memcpy(&v, p, 4);
+    return (UINT)((v * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+/* Compressed size, 0 when it would not fit in cap */
+static size_t lz_compress(DWORD* hash, const BYTE* src, size_t n, BYTE* dst, size_t cap)
+{
+    const BYTE* ip = src;
+    const BYTE* anchor = src;
+    const BYTE* end = src + n;
+    BYTE* op = dst;
+
+    memset(hash, 0, sizeof(DWORD) << LZ_HASH_BITS);
+    while (ip + LZ_MIN_MATCH <= end) {
+        UINT h = lz_hash(ip);
+        const BYTE* ref = src + hash[h];
+
+        hash[h] = (DWORD)(ip - src);
+        if (ref < ip && ip - ref <= LZ_MAX_DIST && memcmp(ref, ip, LZ_MIN_MATCH) == 0) {
+            size_t mlen = LZ_MIN_MATCH;
+
+            while (ip + mlen < end && ref[mlen] == ip[mlen]) mlen++;
+            op = lz_put_seq(op, dst + cap, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), mlen);
+            if (!op) return 0;
+            ip += mlen;
+            anchor = ip;
+        } else {
+            ip++;
+        }
+    }
+
+    op = lz_put_seq(op, dst + cap, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+static int lz_get_len(const BYTE** ip, const BYTE* iend, size_t* len)
+{
+    BYTE b;
+
+    do {
+        if (*ip >= iend) return 0;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+/* 1: src decoded to exactly size bytes, 0: corrupted */
+static int lz_decompress(const BYTE* src, size_t n, BYTE* dst, size_t size)
+{
+    const BYTE* ip = src;
+    const BYTE* iend = src + n;
+    BYTE* op = dst;
+    BYTE* oend = dst + size;
+
+    while (ip < iend) {
+        BYTE token = *ip++;
+        size_t len = token >> 4;
+
+        if (len == 15 && !lz_get_len(&ip, iend, &len)) return 0;
+        if ((size_t)(iend - ip) < len || (size_t)(oend - op) < len) return 0;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return 0;
+        size_t dist = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        len = token & 15;
+        if (len == 15 && !lz_get_len(&ip, iend, &len)) return 0;
+        len += LZ_MIN_MATCH;
+        if (dist == 0 || dist > (size_t)(op - dst) || (size_t)(oend - op) < len) return 0;
+
+        /* Byte by byte, a reference may overlap the bytes it produces */
+        for (size_t i = 0; i < len; i++) {
+            op[i] = op[i - dist];
+        }
+        op += len;
+    }
+    return op == oend;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Data area space                                                       */
+/*-----------------------------------------------------------------------*/
+static int add_extent(EXTENT_LIST* l, QWORD ofs, QWORD len)
+{
+    if (l->count == l->capacity) {
+        UINT capacity = l->capacity ? l->capacity * 2 : 64;
+        COMPRESS_EXTENT* list = (COMPRESS_EXTENT*)realloc(l->list, capacity * sizeof(COMPRESS_EXTENT));
+        if (!list) {
+            return 0;
+        }
+        l->list = list;
+        l->capacity = capacity;
+    }
+    l->list[l->count].ofs = ofs;
+    l->list[l->count].len = len;
+    l->count++;
+    return 1;
+}
+
+static int compare_extents(const void* a, const void* b)
+{
+    QWORD x = ((const COMPRESS_EXTENT*)a)->ofs;
+    QWORD y = ((const COMPRESS_EXTENT*)b)->ofs;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Sort and merge touching extents, giving up the ones at the end of the area */
+static void merge_free(DISK_COMPRESS* c)
+{
+    EXTENT_LIST* l = &c->free;
+    UINT n = 0;
+
+    qsort(l->list, l->count, sizeof(COMPRESS_EXTENT), compare_extents);
+    for (UINT i = 0; i < l->count; i++) {
+        if (n && l->list[n - 1].ofs + l->list[n - 1].len == l->list[i].ofs) {
+            l->list[n - 1].len += l->list[i].len;
+        } else {
+            l->list[n++] = l->list[i];
+        }
+    }
+    l->count = n;
+
+    if (n && l->list[n - 1].ofs + l->list[n - 1].len == c->end) {
+        c->end = l->list[--l->count].ofs;
+    }
+}
+
+/* First fit from the free extents, else from the end of the area */
+static QWORD alloc_extent(DISK_COMPRESS* c, QWORD len)
+{
+    EXTENT_LIST* l = &c->free;
+
+    for (UINT i = 0; i < l->count; i++) {
+        if (l->list[i].len >= len) {
+            QWORD ofs = l->list[i].ofs;
+
+            l->list[i].ofs += len;
+            l->list[i].len -= len;
+            if (l->list[i].len == 0) {
+                l->list[i] = l->list[--l->count];
+            }
+            return ofs;
+        }
+    }
+
+    QWORD ofs = c->end;
+    c->end += len;
+    return ofs;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Image header and index                                                */
+/*-----------------------------------------------------------------------*/
+static int write_index(DISK_DEVICE* dev, DISK_COMPRESS* c)
+{
+    DWORD lo = c->dirty_lo, hi = c->dirty_hi;
+
+    if (lo >= hi) {
+        return 1;
+    }
+
+    BYTE* buf = (BYTE*)malloc((size_t)(hi - lo) * COMPRESS_ENTRY);
+    if (!buf) {
+        return 0;
+    }
+    for (DWORD i = lo; i < hi; i++) {
+        BYTE* p = buf + (size_t)(i - lo) * COMPRESS_ENTRY;
+        disk_st_le(p, c->index[i].ofs, 8);
+        disk_st_le(p + 8, c->index[i].len, 4);
+        disk_st_le(p + 12, c->index[i].method, 4);
+    }
+
+    int ok = disk_pwrite_full(dev->fd, buf, (size_t)(hi - lo) * COMPRESS_ENTRY,
+                              COMPRESS_HEADER + (off_t)lo * COMPRESS_ENTRY);
+    free(buf);
+    if (ok) {
+        c->dirty_lo = c->block_count;
+        c->dirty_hi = 0;
+    }
+    return ok;
+}
+
+static void mark_entry(DISK_COMPRESS* c, DWORD block)
+{
+    if (block < c->dirty_lo) c->dirty_lo = block;
+    if (block + 1 > c->dirty_hi) c->dirty_hi = block + 1;
+}
+
+static int set_geometry(DISK_DEVICE* dev, DISK_COMPRESS* c, UINT block_size)
+{
+    if (block_size < dev->sector_size || block_size > COMPRESS_CHUNK ||
+        (block_size & (block_size - 1)) != 0) {
+        return 0;
+    }
+    c->block_size = block_size;
+    c->block_sectors = block_size / dev->sector_size;
+    c->block_count = (DWORD)((dev->sector_count + c->block_sectors - 1) / c->block_sectors);
+    c->data_ofs = round_up(COMPRESS_HEADER + (QWORD)c->block_count * COMPRESS_ENTRY, COMPRESS_HEADER);
+    c->end = c->data_ofs;
+    c->dirty_lo = c->block_count;
+    c->dirty_hi = 0;
+    c->index = (COMPRESS_ENTRY_T*)calloc(c->block_count ? c->block_count : 1, sizeof(COMPRESS_ENTRY_T));
+    return c->index != NULL;
+}
+
+static int create_image(DISK_DEVICE* dev, DISK_COMPRESS* c)
+{
+    BYTE hdr[COMPRESS_HEADER];
+
+    if (!set_geometry(dev, c, dev->compress_block_size)) {
+        return 0;
+    }
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, COMPRESS_MAGIC, 8);
+    disk_st_le(hdr + 8, COMPRESS_VERSION, 4);
+    disk_st_le(hdr + 12, dev->sector_size, 4);
+    disk_st_le(hdr + 16, dev->sector_count, 8);
+    disk_st_le(hdr + 24, c->block_size, 4);
+    disk_st_le(hdr + 32, c->data_ofs, 8);
+
+    /* All blocks start out as zero blocks, the index is a hole */
+    return disk_pwrite_full(dev->fd, hdr, sizeof(hdr), 0) &&
+           ftruncate(dev->fd, (off_t)c->data_ofs) == 0;
+}
+
+static int load_image(DISK_DEVICE* dev, DISK_COMPRESS* c, const BYTE* hdr)
+{
+    if (disk_ld_le(hdr + 8, 4) != COMPRESS_VERSION) {
+        return 0;
+    }
+
+    dev->sector_size = (WORD)disk_ld_le(hdr + 12, 4);
+    dev->sector_count = (LBA_t)disk_ld_le(hdr + 16, 8);
+    if (dev->sector_size < FF_MIN_SS || dev->sector_size > FF_MAX_SS ||
+        !set_geometry(dev, c, (UINT)disk_ld_le(hdr + 24, 4)) || disk_ld_le(hdr + 32, 8) != c->data_ofs) {
+        return 0;
+    }
+
+    size_t bytes = (size_t)c->block_count * COMPRESS_ENTRY;
+    BYTE* buf = (BYTE*)malloc(bytes ? bytes : 1);
+    int ok = buf && disk_pread_full(dev->fd, buf, bytes, COMPRESS_HEADER);
+
+    for (DWORD i = 0; ok && i < c->block_count; i++) {
+        const BYTE* p = buf + (size_t)i * COMPRESS_ENTRY;
+        COMPRESS_ENTRY_T* e = &c->index[i];
+
+        e->ofs = disk_ld_le(p, 8);
+        e->len = (DWORD)disk_ld_le(p + 8, 4);
+        e->method = (DWORD)disk_ld_le(p + 12, 4);
+        if (e->method > METHOD_LZ || e->len > c->block_size || (e->method != METHOD_ZERO && e->ofs < c->data_ofs)) {
+            ok = 0;
+        }
+    }
+    free(buf);
+
+    /* Space between the stored blocks is free */
+    for (DWORD i = 0; ok && i < c->block_count; i++) {
+        if (c->index[i].method != METHOD_ZERO) {
+            ok = add_extent(&c->free, c->index[i].ofs, round_up(c->index[i].len, COMPRESS_ALIGN));
+        }
+    }
+    if (ok) {
+        EXTENT_LIST* l = &c->free;
+        QWORD pos = c->data_ofs;
+        UINT n = l->count;
+
+        qsort(l->list, n, sizeof(COMPRESS_EXTENT), compare_extents);
+        for (UINT i = 0; ok && i < n; i++) {
+            if (l->list[i].ofs < pos) {
+                ok = 0;     /* Overlapping blocks */
+            } else if (l->list[i].ofs > pos) {
+                ok = add_extent(l, pos, l->list[i].ofs - pos);
+            }
+            pos = l->list[i].ofs + l->list[i].len;
+        }
+        if (ok) {
+            memmove(l->list, l->list + n, (l->count - n) * sizeof(COMPRESS_EXTENT));
+            l->count -= n;
+            c->end = pos;
+        }
+    }
+    return ok;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Block transfer                                                        */
+/*-----------------------------------------------------------------------*/
+static int load_block(DISK_DEVICE* dev, DISK_COMPRESS* c, DWORD block, BYTE* data)
+{
+    COMPRESS_ENTRY_T* e = &c->index[block];
+
+    switch (e->method) {
+    case METHOD_ZERO:
+        memset(data, 0, c->block_size);
+        return 1;
+
+    case METHOD_STORED:
+        return e->len == c->block_size && disk_pread_full(dev->fd, data, c->block_size, (off_t)e->ofs);
+
+    default:
+        return disk_pread_full(dev->fd, c->packed, e->len, (off_t)e->ofs) &&
+               lz_decompress(c->packed, e->len, data, c->block_size);
+    }
+}
+
+static int release_extent(DISK_COMPRESS* c, DWORD block)
+{
+    COMPRESS_ENTRY_T* e = &c->index[block];
+
+    if (e->method != METHOD_ZERO &&
+        !add_extent(&c->pending, e->ofs, round_up(e->len, COMPRESS_ALIGN))) {
+        return 0;
+    }
+    e->ofs = 0;
+    e->len = 0;
+    e->method = METHOD_ZERO;
+    mark_entry(c, block);
+    return 1;
+}
+
+static int store_block(DISK_DEVICE* dev, DISK_COMPRESS* c, DWORD block, const BYTE* data)
+{
+    COMPRESS_ENTRY_T* e = &c->index[block];
+    const BYTE* out = c->packed;
+    size_t len;
+    DWORD method = METHOD_LZ;
+
+    if (!release_extent(c, block)) {
+        return 0;
+    }
+    if (disk_is_zero(data, c->block_size)) {
+        return 1;
+    }
+
+    /* Keep the block as is unless compressing saves space */
+    len = lz_compress(c->hash, data, c->block_size, c->packed, c->block_size);
+    if (len == 0 || round_up(len, COMPRESS_ALIGN) >= c->block_size) {
+        out = data;
+        len = c->block_size;
+        method = METHOD_STORED;
+    }
+
+    QWORD ofs = alloc_extent(c, round_up(len, COMPRESS_ALIGN));
+    if (!disk_pwrite_full(dev->fd, out, len, (off_t)ofs)) {
+        return 0;
+    }
+    e->ofs = ofs;
+    e->len = (DWORD)len;
+    e->method = method;
+    return 1;
+}
+
+/* Slot holding a block, loaded unless the caller overwrites all of it */
+static COMPRESS_SLOT* get_slot(DISK_DEVICE* dev, DISK_COMPRESS* c, DWORD block, int load)
+{
+    COMPRESS_SLOT* victim = &c->slots[0];
+
+    for (UINT i = 0; i < COMPRESS_SLOTS; i++) {
+        COMPRESS_SLOT* s = &c->slots[i];
+
+        if (s->valid && s->block == block) {
+            s->used = ++c->tick;
+            return s;
+        }
+        if (!s->valid || (victim->valid && s->used < victim->used)) {
+            victim = s;
+        }
+    }
+
+    if (victim->valid && victim->dirty) {
+        if (!store_block(dev, c, victim->block, victim->data)) {
+            return NULL;
+        }
+        victim->dirty = 0;
+    }
+    victim->valid = 0;
+    if (load && !load_block(dev, c, block, victim->data)) {
+        return NULL;
+    }
+    victim->block = block;
+    victim->valid = 1;
+    victim->dirty = 0;
+    victim->used = ++c->tick;
+    return victim;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Backend operations                                                    */
+/*-----------------------------------------------------------------------*/
+static void compress_close(DISK_DEVICE* dev);
+static DRESULT compress_sync(DISK_DEVICE* dev);
+
+static int compress_open(DISK_DEVICE* dev)
+{
+    DISK_COMPRESS* c = (DISK_COMPRESS*)calloc(1, sizeof(DISK_COMPRESS));
+    BYTE hdr[COMPRESS_HEADER];
+    struct stat st;
+    int ok;
+
+    if (!c) {
+        return 0;
+    }
+    dev->compress = c;
+
+    dev->fd = open(dev->path, O_RDWR | O_CREAT, 0644);
+    if (dev->fd < 0) {
+        compress_close(dev);
+        return 0;
+    }
+
+    if (fstat(dev->fd, &st) != 0) {
+        ok = 0;
+    } else if (st.st_size == 0) {
+        ok = create_image(dev, c);
+    } else {
+        /* Never overwrite a file that is not a compressed image */
+        ok = st.st_size >= COMPRESS_HEADER && disk_pread_full(dev->fd, hdr, sizeof(hdr), 0) &&
+             memcmp(hdr, COMPRESS_MAGIC, 8) == 0 && load_image(dev, c, hdr);
+    }
+
+    c->packed = (BYTE*)malloc(c->block_size ? c->block_size : 1);
+    for (UINT i = 0; ok && i < COMPRESS_SLOTS; i++) {
+        c->slots[i].data = (BYTE*)malloc(c->block_size);
+        ok = c->slots[i].data != NULL;
+    }
+    if (!ok || !c->packed) {
+        compress_close(dev);
+        return 0;
+    }
+    return 1;
+}
+
+static void compress_close(DISK_DEVICE* dev)
+{
+    DISK_COMPRESS* c = dev->compress;
+
+    if (c->index && dev->fd >= 0) {
+        compress_sync(dev);
+    }
+    if (dev->fd >= 0) {
+        close(dev->fd);
+        dev->fd = -1;
+    }
+    for (UINT i = 0; i < COMPRESS_SLOTS; i++) {
+        free(c->slots[i].data);
+    }
+    free(c->index);
+    free(c->free.list);
+    free(c->pending.list);
+    free(c->packed);
+    free(c);
+    dev->compress = NULL;
+}
+
+static DRESULT compress_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count)
+{
+    DISK_COMPRESS* c = dev->compress;
+    UINT ss = dev->sector_size;
+
+    /* One block at a time, the sectors of a block are contiguous in it */
+    for (UINT i = 0, n; i < count; i += n) {
+        DWORD block = (DWORD)((sector + i) / c->block_sectors);
+        UINT first = (UINT)((sector + i) % c->block_sectors);
+        COMPRESS_SLOT* s = get_slot(dev, c, block, 1);
+
+        if (!s) {
+            return RES_ERROR;
+        }
+        n = c->block_sectors - first < count - i ? c->block_sectors - first : count - i;
+        memcpy(buff + (size_t)i * ss, s->data + (size_t)first * ss, (size_t)n * ss);
+    }
+    return RES_OK;
+}
+
+static DRESULT compress_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    DISK_COMPRESS* c = dev->compress;
+    UINT ss = dev->sector_size;
+
+    for (UINT i = 0, n; i < count; i += n) {
+        DWORD block = (DWORD)((sector + i) / c->block_sectors);
+        UINT first = (UINT)((sector + i) % c->block_sectors);
+
+        n = c->block_sectors - first < count - i ? c->block_sectors - first : count - i;
+        COMPRESS_SLOT* s = get_slot(dev, c, block, n < c->block_sectors);
+        if (!s) {
+            return RES_ERROR;
+        }
+        memcpy(s->data + (size_t)first * ss, buff + (size_t)i * ss, (size_t)n * ss);
+        s->dirty = 1;
+    }
+
+    if (dev->sync_mode == DISK_SYNC_WRITE_THROUGH) {
+        return compress_sync(dev);
+    }
+    return RES_OK;
+}
+
+static DRESULT compress_sync(DISK_DEVICE* dev)
+{
+    DISK_COMPRESS* c = dev->compress;
+
+    for (UINT i = 0; i < COMPRESS_SLOTS; i++) {
+        COMPRESS_SLOT* s = &c->slots[i];
+
+        if (s->valid && s->dirty) {
+            if (!store_block(dev, c, s->block, s->data)) {
+                return RES_ERROR;
+            }
+            s->dirty = 0;
+        }
+    }
+
+    /* Block data is written before the index entries that point at it */
+    if (c->dirty_lo < c->dirty_hi) {
+        if (dev->sync_mode != DISK_SYNC_NONE && disk_datasync(dev->fd) != 0) {
+            return RES_ERROR;
+        }
+        if (!write_index(dev, c)) {
+            return RES_ERROR;
+        }
+        if (dev->sync_mode != DISK_SYNC_NONE && disk_datasync(dev->fd) != 0) {
+            return RES_ERROR;
+        }
+    }
+
+    /* Nothing refers to the replaced extents any more */
+    if (c->pending.count) {
+        for (UINT i = 0; i < c->pending.count; i++) {
+            COMPRESS_EXTENT* x = &c->pending.list[i];
+
+            disk_punch_hole(dev->fd, (off_t)x->ofs, (off_t)x->len);
+            if (!add_extent(&c->free, x->ofs, x->len)) {
+                return RES_ERROR;
+            }
+        }
+        c->pending.count = 0;
+        merge_free(c);
+        if (ftruncate(dev->fd, (off_t)c->end) != 0) {
+            return RES_ERROR;
+        }
+    }
+    return RES_OK;
+}
+
+static DRESULT compress_trim(DISK_DEVICE* dev, LBA_t sector, LBA_t count)
+{
+    DISK_COMPRESS* c = dev->compress;
+    DWORD first = (DWORD)((sector + c->block_sectors - 1) / c->block_sectors);
+    DWORD last = (DWORD)((sector + count) / c->block_sectors);
+
+    /* Blocks inside the range become zero blocks, partial ones are kept */
+    for (DWORD block = first; block < last; block++) {
+        for (UINT i = 0; i < COMPRESS_SLOTS; i++) {
+            if (c->slots[i].valid && c->slots[i].block == block) {
+                c->slots[i].valid = 0;
+                c->slots[i].dirty = 0;
+            }
+        }
+        if (!release_extent(c, block)) {
+            return RES_ERROR;
+        }
+    }
+    return RES_OK;
+}
+
+const DISK_OPS compress_ops = {
+    compress_open, compress_close, compress_read, compress_write, compress_sync, NULL, NULL, NULL, compress_trim
+};
+
+/*-----------------------------------------------------------------------*/
+/* Conversion from and to raw images                                     */
+/*-----------------------------------------------------------------------*/
+DRESULT compress_import(DISK_DEVICE* dev, const char* image)
+{
+    UINT ss = dev->sector_size;
+    UINT chunk = COMPRESS_CHUNK / ss;
+    BYTE* buf = (BYTE*)malloc(COMPRESS_CHUNK);
+    int fd = open(image, O_RDONLY);
+    struct stat st;
+    DRESULT res = (buf && fd >= 0 && fstat(fd, &st) == 0) ? RES_OK : RES_ERROR;
+
+    /* A shorter image leaves the rest of the disk zeroed */
+    for (LBA_t s = 0; res == RES_OK && s < dev->sector_count && (QWORD)s * ss < (QWORD)st.st_size; s += chunk) {
+        UINT n = dev->sector_count - s < chunk ? (UINT)(dev->sector_count - s) : chunk;
+        size_t len = (size_t)n * ss;
+        ssize_t got = pread(fd, buf, len, (off_t)s * ss);
+
+        if (got < 0) {
+            res = RES_ERROR;
+        } else if (got > 0) {
+            memset(buf + got, 0, len - (size_t)got);
+            if (!disk_is_zero(buf, len)) {
+                res = compress_write(dev, buf, s, n);
+            }
+        }
+    }
+
+    if (res == RES_OK) {
+        res = compress_sync(dev);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buf);
+    return res;
+}
+
+DRESULT compress_export(DISK_DEVICE* dev, const char* path)
+{
+    return disk_export_image(dev, path, compress_read);
+}
+
+#else
+
+const DISK_OPS compress_ops = { NULL };
+
+DRESULT compress_import(DISK_DEVICE* dev, const char* image)
+{
+    (void)dev;
+    (void)image;
+    return RES_NOTRDY;
+}
+
+DRESULT compress_export(DISK_DEVICE* dev, const char* path)
+{
+    (void)dev;
+    (void)path;
+    return RES_NOTRDY;
+}
+
+#endif
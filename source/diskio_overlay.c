@@ -0,0 +1,266 @@
+/*-----------------------------------------------------------------------*/
+/* Copy-on-write overlay of a read-only base image                       */
+/*-----------------------------------------------------------------------*/
+/* The delta file starts with a header block holding the geometry and    */
+/* the base path, followed by a bitmap of the sectors it owns and then a */
+/* sparse copy of the disk. Only sectors written since the overlay was   */
+/* created take space, and creating one does not copy the base.          */
+
+#include "ff.h"
+#include "diskio.h"
+#include "diskio_working.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define OVERLAY_MAGIC       "FATFSOVL"
+#define OVERLAY_VERSION     1
+#define OVERLAY_BLOCK       4096                /* Header size and region alignment */
+#define OVERLAY_PATH_OFS    64                  /* Base path inside the header */
+
+struct DISK_OVERLAY {
+    int     base_fd;
+    BYTE*   map;                /* 1 bit per sector, set: sector lives in the delta */
+    size_t  map_bytes;
+    size_t  dirty_lo;           /* Bitmap bytes not written to the delta yet */
+    size_t  dirty_hi;
+    off_t   data_ofs;           /* Sector 0 of the delta copy */
+};
+
+static off_t round_block(QWORD n)
+{
+    return (off_t)((n + OVERLAY_BLOCK - 1) / OVERLAY_BLOCK * OVERLAY_BLOCK);
+}
+
+static int in_delta(const DISK_OVERLAY* o, LBA_t sector)
+{
+    return (o->map[sector / 8] >> (sector % 8)) & 1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Delta file header                                                     */
+/*-----------------------------------------------------------------------*/
+static int create_delta(DISK_DEVICE* dev, DISK_OVERLAY* o)
+{
+    BYTE hdr[OVERLAY_BLOCK];
+    struct stat st;
+
+    if (!dev->base_path[0] ||
+        fstat(o->base_fd, &st) != 0 || st.st_size < dev->sector_size) {
+        return 0;
+    }
+
+    dev->sector_count = (LBA_t)(st.st_size / dev->sector_size);
+    o->map_bytes = (size_t)((dev->sector_count + 7) / 8);
+    o->data_ofs = OVERLAY_BLOCK + round_block(o->map_bytes);
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, OVERLAY_MAGIC, 8);
+    disk_st_le(hdr + 8, OVERLAY_VERSION, 4);
+    disk_st_le(hdr + 12, dev->sector_size, 4);
+    disk_st_le(hdr + 16, dev->sector_count, 8);
+    disk_st_le(hdr + 24, (QWORD)o->data_ofs, 8);
+    strcpy((char*)hdr + OVERLAY_PATH_OFS, dev->base_path);
+
+    /* The bitmap and the sector copy stay holes until written */
+    return disk_pwrite_full(dev->fd, hdr, sizeof(hdr), 0) &&
+           ftruncate(dev->fd, o->data_ofs + (off_t)dev->sector_count * dev->sector_size) == 0;
+}
+
+static int load_delta(DISK_DEVICE* dev, DISK_OVERLAY* o, const BYTE* hdr)
+{
+    if (disk_ld_le(hdr + 8, 4) != OVERLAY_VERSION) {
+        return 0;
+    }
+
+    dev->sector_size = (WORD)disk_ld_le(hdr + 12, 4);
+    dev->sector_count = (LBA_t)disk_ld_le(hdr + 16, 8);
+    o->data_ofs = (off_t)disk_ld_le(hdr + 24, 8);
+    o->map_bytes = (size_t)((dev->sector_count + 7) / 8);
+
+    /* The base recorded at creation, unless the caller moved it */
+    if (!dev->base_path[0]) {
+        memcpy(dev->base_path, hdr + OVERLAY_PATH_OFS, DISK_PATH_MAX - 1);
+        dev->base_path[DISK_PATH_MAX - 1] = '\0';
+    }
+
+    return dev->sector_size >= FF_MIN_SS && dev->sector_size <= FF_MAX_SS &&
+           o->data_ofs >= OVERLAY_BLOCK + round_block(o->map_bytes);
+}
+
+static int write_map(DISK_DEVICE* dev, DISK_OVERLAY* o)
+{
+    if (o->dirty_lo < o->dirty_hi) {
+        if (!disk_pwrite_full(dev->fd, o->map + o->dirty_lo, o->dirty_hi - o->dirty_lo,
+                              OVERLAY_BLOCK + (off_t)o->dirty_lo)) {
+            return 0;
+        }
+        o->dirty_lo = o->map_bytes;
+        o->dirty_hi = 0;
+    }
+    return 1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Backend operations                                                    */
+/*-----------------------------------------------------------------------*/
+static void overlay_close(DISK_DEVICE* dev);
+
+static int overlay_open(DISK_DEVICE* dev)
+{
+    DISK_OVERLAY* o = (DISK_OVERLAY*)calloc(1, sizeof(DISK_OVERLAY));
+    BYTE hdr[OVERLAY_BLOCK];
+    struct stat st;
+    int ok;
+
+    if (!o) {
+        return 0;
+    }
+    o->base_fd = -1;
+    dev->overlay = o;
+
+    dev->fd = open(dev->path, O_RDWR | O_CREAT, 0644);
+    if (dev->fd < 0) {
+        overlay_close(dev);
+        return 0;
+    }
+
+    if (fstat(dev->fd, &st) != 0) {
+        ok = 0;
+    } else if (st.st_size == 0) {
+        o->base_fd = open(dev->base_path, O_RDONLY);
+        ok = o->base_fd >= 0 && create_delta(dev, o);
+    } else {
+        /* Never overwrite a file that is not a delta */
+        ok = st.st_size >= OVERLAY_BLOCK && disk_pread_full(dev->fd, hdr, sizeof(hdr), 0) &&
+             memcmp(hdr, OVERLAY_MAGIC, 8) == 0 && load_delta(dev, o, hdr);
+        if (ok) {
+            o->base_fd = open(dev->base_path, O_RDONLY);
+        }
+    }
+
+    /* A base shorter than the overlay was replaced behind our back */
+    if (!ok || o->base_fd < 0 || fstat(o->base_fd, &st) != 0 ||
+        (QWORD)st.st_size < (QWORD)dev->sector_count * dev->sector_size) {
+        overlay_close(dev);
+        return 0;
+    }
+
+    o->map = (BYTE*)calloc(o->map_bytes ? o->map_bytes : 1, 1);
+    if (!o->map || !disk_pread_full(dev->fd, o->map, o->map_bytes, OVERLAY_BLOCK)) {
+        overlay_close(dev);
+        return 0;
+    }
+    o->dirty_lo = o->map_bytes;
+    o->dirty_hi = 0;
+    return 1;
+}
+
+static void overlay_close(DISK_DEVICE* dev)
+{
+    DISK_OVERLAY* o = dev->overlay;
+
+    if (o->map && dev->fd >= 0) {
+        write_map(dev, o);
+    }
+    if (o->base_fd >= 0) {
+        close(o->base_fd);
+    }
+    if (dev->fd >= 0) {
+        close(dev->fd);
+        dev->fd = -1;
+    }
+    free(o->map);
+    free(o);
+    dev->overlay = NULL;
+}
+
+static DRESULT overlay_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count)
+{
+    DISK_OVERLAY* o = dev->overlay;
+    UINT ss = dev->sector_size;
+
+    /* One read per run of sectors living in the same layer */
+    for (UINT i = 0, n; i < count; i += n) {
+        int delta = in_delta(o, sector + i);
+        off_t ofs = (off_t)(sector + i) * ss;
+
+        for (n = 1; i + n < count && in_delta(o, sector + i + n) == delta; n++) ;
+        if (!disk_pread_full(delta ? dev->fd : o->base_fd, buff + (size_t)i * ss, (size_t)n * ss,
+                             delta ? o->data_ofs + ofs : ofs)) {
+            return RES_ERROR;
+        }
+    }
+    return RES_OK;
+}
+
+static DRESULT overlay_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    DISK_OVERLAY* o = dev->overlay;
+    UINT ss = dev->sector_size;
+    size_t lo = (size_t)(sector / 8), hi = (size_t)((sector + count - 1) / 8) + 1;
+
+    if (!disk_pwrite_full(dev->fd, buff, (size_t)count * ss, o->data_ofs + (off_t)sector * ss)) {
+        return RES_ERROR;
+    }
+
+    for (LBA_t s = sector; s < sector + count; s++) {
+        o->map[s / 8] |= (BYTE)(1 << (s % 8));
+    }
+    if (lo < o->dirty_lo) o->dirty_lo = lo;
+    if (hi > o->dirty_hi) o->dirty_hi = hi;
+
+    if (dev->sync_mode == DISK_SYNC_WRITE_THROUGH &&
+        (!write_map(dev, o) || disk_datasync(dev->fd) != 0)) {
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+static DRESULT overlay_sync(DISK_DEVICE* dev)
+{
+    DISK_OVERLAY* o = dev->overlay;
+
+    /* Sector data is written before the bitmap bits that point at it */
+    if (dev->sync_mode != DISK_SYNC_NONE && disk_datasync(dev->fd) != 0) {
+        return RES_ERROR;
+    }
+    if (!write_map(dev, o)) {
+        return RES_ERROR;
+    }
+    if (dev->sync_mode != DISK_SYNC_NONE && disk_datasync(dev->fd) != 0) {
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+const DISK_OPS overlay_ops = {
+    overlay_open, overlay_close, overlay_read, overlay_write, overlay_sync, NULL, NULL, NULL, NULL
+};
+
+/*-----------------------------------------------------------------------*/
+/* Write base and delta merged into a standalone image                   */
+/*-----------------------------------------------------------------------*/
+DRESULT overlay_flatten(DISK_DEVICE* dev, const char* path)
+{
+    return disk_export_image(dev, path, overlay_read);
+}
+
+#else
+
+const DISK_OPS overlay_ops = { NULL };
+
+DRESULT overlay_flatten(DISK_DEVICE* dev, const char* path)
+{
+    (void)dev;
+    (void)path;
+    return RES_NOTRDY;
+}
+
+#endif
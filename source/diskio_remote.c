@@ -0,0 +1,698 @@
+/*-----------------------------------------------------------------------*/
+/* Block server and the backend talking to it                            */
+/*-----------------------------------------------------------------------*/
+/* A server process owns an image, its backend and block cache and      */
+/* serves sectors to other processes over a Unix domain socket. Requests */
+/* carry a tag and are answered in order, so a client sends a whole     */
+/* batch before it waits: a read of many sectors goes out as one request */
+/* per 256 sectors, and the writes of a cache flush are not waited for   */
+/* until the flush drains. One client at a time may write, the others    */
+/* see the drive write protected.                                        */
+
+#include "ff.h"
+#include "diskio.h"
+#include "diskio_working.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define REMOTE_VERSION      1
+#define REMOTE_MAX_SECTORS  256         /* Sectors per request */
+#define REMOTE_WINDOW       64          /* Writes in flight before a client waits */
+#define REMOTE_MAX_CLIENTS  64
+#define REMOTE_OUT_LIMIT    (4 * 1024 * 1024)   /* Queued reply bytes before a client is not read */
+#define REMOTE_POLL_MS      100         /* Idle callback interval of the server */
+
+/* Request operations */
+#define OP_HELLO            1   /* sector: protocol version, flags: REQ_WRITER */
+#define OP_READ             2
+#define OP_WRITE            3   /* count sectors of data follow */
+#define OP_SYNC             4
+#define OP_TRIM             5
+
+#define REQ_WRITER          1   /* Ask to be the writer of the drive */
+
+/* Client and server share the host, fields are in native byte order */
+typedef struct {
+    DWORD   op;
+    DWORD   count;
+    QWORD   sector;
+    QWORD   tag;
+    DWORD   flags;
+    DWORD   reserved;
+} REMOTE_REQUEST;
+
+/* Read data follows a successful OP_READ reply */
+typedef struct {
+    DWORD   status;             /* DRESULT */
+    DWORD   count;              /* OP_HELLO: sector size */
+    QWORD   tag;
+    QWORD   value;              /* OP_HELLO: sector count */
+} REMOTE_REPLY;
+
+struct DISK_REMOTE {
+    int     fd;
+    QWORD   tag;                /* Tag of the next request */
+    QWORD   acked;              /* Tag of the next reply */
+    DRESULT error;              /* First failed write not reported yet */
+    int     broken;             /* Connection lost or out of step */
+};
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS          MSG_NOSIGNAL    /* A closed peer is an error, not SIGPIPE */
+#else
+#define SEND_FLAGS          0
+#endif
+
+static int send_full(int fd, struct iovec* iov, int iovcnt)
+{
+    struct msghdr msg;
+
+    while (iovcnt > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)iovcnt;
+
+        ssize_t n = sendmsg(fd, &msg, SEND_FLAGS);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+
+        /* Skip the buffers sent completely, then trim a partial one */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (BYTE*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 1;
+}
+
+static int recv_full(int fd, void* buff, size_t len)
+{
+    BYTE* p = (BYTE*)buff;
+
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static int socket_address(const char* path, struct sockaddr_un* addr)
+{
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return 0;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Client side                                                           */
+/*-----------------------------------------------------------------------*/
+/* Send one request, data either contiguous (buff) or per sector (bufs) */
+static int send_request(DISK_DEVICE* dev, DWORD op, LBA_t sector, UINT count,
+                        const BYTE* buff, const BYTE* const* bufs, DWORD flags)
+{
+    DISK_REMOTE* r = dev->remote;
+    REMOTE_REQUEST req;
+    struct iovec iov[REMOTE_MAX_SECTORS + 1];
+    int iovcnt = 1;
+
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.count = count;
+    req.sector = sector;
+    req.tag = r->tag;
+    req.flags = flags;
+    iov[0].iov_base = &req;
+    iov[0].iov_len = sizeof(req);
+
+    if (buff) {
+        iov[1].iov_base = (void*)buff;
+        iov[1].iov_len = (size_t)count * dev->sector_size;
+        iovcnt = 2;
+    } else if (bufs) {
+        for (UINT i = 0; i < count; i++) {
+            iov[iovcnt].iov_base = (void*)bufs[i];
+            iov[iovcnt].iov_len = dev->sector_size;
+            iovcnt++;
+        }
+    }
+
+    if (!send_full(r->fd, iov, iovcnt)) {
+        r->broken = 1;
+        return 0;
+    }
+    r->tag++;
+    return 1;
+}
+
+/* Take the next reply, the data of a read goes to buff */
+static DRESULT take_reply(DISK_DEVICE* dev, BYTE* buff, REMOTE_REPLY* rep)
+{
+    DISK_REMOTE* r = dev->remote;
+
+    if (!recv_full(r->fd, rep, sizeof(*rep)) || rep->tag != r->acked) {
+        r->broken = 1;
+        return RES_ERROR;
+    }
+    r->acked++;
+
+    if (rep->status != RES_OK) {
+        return (DRESULT)rep->status;
+    }
+    if (buff && !recv_full(r->fd, buff, (size_t)rep->count * dev->sector_size)) {
+        r->broken = 1;
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+/* Wait for the writes sent before tag, keeping the first failure */
+static void collect_writes(DISK_DEVICE* dev, QWORD tag)
+{
+    DISK_REMOTE* r = dev->remote;
+    REMOTE_REPLY rep;
+
+    while (!r->broken && r->acked < tag) {
+        DRESULT res = take_reply(dev, NULL, &rep);
+        if (res != RES_OK && r->error == RES_OK) {
+            r->error = res;
+        }
+    }
+}
+
+/* Report the first failure since the last call */
+static DRESULT take_error(DISK_DEVICE* dev)
+{
+    DISK_REMOTE* r = dev->remote;
+    DRESULT res = r->broken ? RES_ERROR : r->error;
+
+    r->error = RES_OK;
+    return res;
+}
+
+static void remote_close(DISK_DEVICE* dev);
+
+static int remote_open(DISK_DEVICE* dev)
+{
+    DISK_REMOTE* r = (DISK_REMOTE*)calloc(1, sizeof(DISK_REMOTE));
+    struct sockaddr_un addr;
+    REMOTE_REPLY rep;
+
+    if (!r) {
+        return 0;
+    }
+    dev->remote = r;
+    r->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (r->fd < 0 || !socket_address(dev->path, &addr) ||
+        connect(r->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        remote_close(dev);
+        return 0;
+    }
+
+    /* The server's image defines the geometry */
+    if (!send_request(dev, OP_HELLO, REMOTE_VERSION, 0, NULL, NULL, dev->read_only ? 0 : REQ_WRITER) ||
+        take_reply(dev, NULL, &rep) != RES_OK ||
+        rep.count < FF_MIN_SS || rep.count > FF_MAX_SS || rep.value == 0) {
+        remote_close(dev);
+        return 0;
+    }
+    dev->sector_size = (WORD)rep.count;
+    dev->sector_count = (LBA_t)rep.value;
+    return 1;
+}
+
+static void remote_close(DISK_DEVICE* dev)
+{
+    DISK_REMOTE* r = dev->remote;
+
+    if (r->fd >= 0) {
+        collect_writes(dev, r->tag);
+        close(r->fd);
+    }
+    free(r);
+    dev->remote = NULL;
+}
+
+static DRESULT remote_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count)
+{
+    DISK_REMOTE* r = dev->remote;
+    QWORD first = r->tag;
+    DRESULT res = RES_OK;
+    REMOTE_REPLY rep;
+
+    if (r->broken) {
+        return RES_ERROR;
+    }
+
+    /* The whole batch goes out before the first reply is read */
+    for (UINT i = 0, n; i < count; i += n) {
+        n = count - i < REMOTE_MAX_SECTORS ? count - i : REMOTE_MAX_SECTORS;
+        if (!send_request(dev, OP_READ, sector + i, n, NULL, NULL, 0)) {
+            return RES_ERROR;
+        }
+    }
+
+    /* Replies to writes still in flight come first */
+    collect_writes(dev, first);
+
+    for (UINT i = 0, n; i < count && !r->broken; i += n) {
+        n = count - i < REMOTE_MAX_SECTORS ? count - i : REMOTE_MAX_SECTORS;
+        DRESULT rr = take_reply(dev, buff + (size_t)i * dev->sector_size, &rep);
+        if (rr != RES_OK && res == RES_OK) {
+            res = rr;
+        }
+    }
+    return r->broken ? RES_ERROR : res;
+}
+
+/* Writes are pipelined, at most REMOTE_WINDOW of them unanswered */
+static DRESULT send_writes(DISK_DEVICE* dev, const BYTE* buff, const BYTE* const* bufs, LBA_t sector, UINT count)
+{
+    DISK_REMOTE* r = dev->remote;
+
+    if (r->broken) {
+        return RES_ERROR;
+    }
+    for (UINT i = 0, n; i < count; i += n) {
+        n = count - i < REMOTE_MAX_SECTORS ? count - i : REMOTE_MAX_SECTORS;
+        if (r->tag - r->acked >= REMOTE_WINDOW) {
+            collect_writes(dev, r->tag - REMOTE_WINDOW / 2);
+        }
+        if (!send_request(dev, OP_WRITE, sector + i, n, buff ? buff + (size_t)i * dev->sector_size : NULL,
+                          bufs ? bufs + i : NULL, 0)) {
+            return RES_ERROR;
+        }
+    }
+    return RES_OK;
+}
+
+static DRESULT remote_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    DRESULT res = send_writes(dev, buff, NULL, sector, count);
+
+    /* A direct write reports its own outcome */
+    collect_writes(dev, dev->remote->tag);
+    return res == RES_OK ? take_error(dev) : res;
+}
+
+/* Cache flushes leave the outcome to remote_drain */
+static DRESULT remote_writev(DISK_DEVICE* dev, const BYTE* const* bufs, LBA_t sector, UINT count)
+{
+    return send_writes(dev, NULL, bufs, sector, count);
+}
+
+static DRESULT remote_drain(DISK_DEVICE* dev)
+{
+    collect_writes(dev, dev->remote->tag);
+    return take_error(dev);
+}
+
+static DRESULT remote_request(DISK_DEVICE* dev, DWORD op, LBA_t sector, LBA_t count)
+{
+    REMOTE_REPLY rep;
+    DRESULT res;
+
+    if (dev->remote->broken || !send_request(dev, op, sector, (UINT)count, NULL, NULL, 0)) {
+        return RES_ERROR;
+    }
+    collect_writes(dev, dev->remote->tag - 1);
+    res = take_reply(dev, NULL, &rep);
+    if (res == RES_OK) {
+        res = take_error(dev);
+    }
+    return res;
+}
+
+/* The server syncs its cache and backend */
+static DRESULT remote_sync(DISK_DEVICE* dev)
+{
+    return remote_request(dev, OP_SYNC, 0, 0);
+}
+
+static DRESULT remote_trim(DISK_DEVICE* dev, LBA_t sector, LBA_t count)
+{
+    /* Longer ranges are rare, the server only releases host storage */
+    while (count > 0) {
+        LBA_t n = count < 0xFFFFFFFF ? count : 0xFFFFFFFF;
+        DRESULT res = remote_request(dev, OP_TRIM, sector, n);
+
+        if (res != RES_OK) {
+            return res;
+        }
+        sector += n;
+        count -= n;
+    }
+    return RES_OK;
+}
+
+const DISK_OPS remote_ops = {
+    remote_open, remote_close, remote_read, remote_write, remote_sync, NULL, remote_writev, remote_drain, remote_trim
+};
+
+/*-----------------------------------------------------------------------*/
+/* Server side                                                           */
+/*-----------------------------------------------------------------------*/
+typedef struct {
+    int     fd;
+    int     hello;              /* Handshake done */
+    BYTE*   in;                 /* Received bytes not processed yet */
+    size_t  in_len;
+    size_t  in_cap;
+    BYTE*   out;                /* Replies not sent yet */
+    size_t  out_len;
+    size_t  out_pos;
+    size_t  out_cap;
+} REMOTE_CLIENT;
+
+typedef struct {
+    BYTE    pdrv;
+    UINT    ss;
+    LBA_t   sectors;
+    int     writer;             /* Client index of the writer (-1:none) */
+    REMOTE_CLIENT clients[REMOTE_MAX_CLIENTS];
+    UINT    count;
+} REMOTE_SERVER;
+
+static int reserve(BYTE** buf, size_t* cap, size_t need)
+{
+    if (need > *cap) {
+        size_t size = *cap ? *cap : 65536;
+        while (size < need) {
+            size *= 2;
+        }
+        BYTE* p = (BYTE*)realloc(*buf, size);
+        if (!p) {
+            return 0;
+        }
+        *buf = p;
+        *cap = size;
+    }
+    return 1;
+}
+
+static void drop_client(REMOTE_SERVER* s, UINT i)
+{
+    REMOTE_CLIENT* c = &s->clients[i];
+
+    /* What the writer left behind reaches the image */
+    if (s->writer == (int)i) {
+        disk_ioctl(s->pdrv, CTRL_SYNC, NULL);
+        s->writer = -1;
+    } else if (s->writer == (int)s->count - 1) {
+        s->writer = (int)i;     /* Moved into the freed entry below */
+    }
+
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    s->clients[i] = s->clients[--s->count];
+}
+
+/* Serve one request, 0 drops the client */
+static int serve_request(REMOTE_SERVER* s, UINT i, const REMOTE_REQUEST* req, const BYTE* data)
+{
+    REMOTE_CLIENT* c = &s->clients[i];
+    size_t data_len = req->op == OP_READ ? (size_t)req->count * s->ss : 0;
+    REMOTE_REPLY rep;
+
+    if (!c->hello && req->op != OP_HELLO) {
+        return 0;
+    }
+    if (!reserve(&c->out, &c->out_cap, c->out_len + sizeof(rep) + data_len)) {
+        return 0;
+    }
+
+    memset(&rep, 0, sizeof(rep));
+    rep.tag = req->tag;
+    rep.count = req->count;
+
+    switch (req->op) {
+    case OP_HELLO:
+        rep.status = RES_OK;
+        if (req->sector != REMOTE_VERSION) {
+            rep.status = RES_PARERR;
+        } else if (req->flags & REQ_WRITER) {
+            if (s->writer >= 0) {
+                rep.status = RES_WRPRT;     /* One writer at a time */
+            } else {
+                s->writer = (int)i;
+            }
+        }
+        c->hello = rep.status == RES_OK;
+        rep.count = s->ss;
+        rep.value = s->sectors;
+        break;
+
+    case OP_READ:
+        rep.status = disk_read(s->pdrv, c->out + c->out_len + sizeof(rep), (LBA_t)req->sector, req->count);
+        break;
+
+    case OP_WRITE:
+        rep.status = s->writer != (int)i ? RES_WRPRT :
+                     disk_write(s->pdrv, data, (LBA_t)req->sector, req->count);
+        break;
+
+    case OP_SYNC:
+        rep.status = disk_ioctl(s->pdrv, CTRL_SYNC, NULL);
+        break;
+
+    case OP_TRIM: {
+        LBA_t range[2] = { (LBA_t)req->sector, (LBA_t)(req->sector + req->count - 1) };
+        rep.status = s->writer != (int)i ? RES_WRPRT :
+                     req->count == 0 ? RES_OK : disk_ioctl(s->pdrv, CTRL_TRIM, range);
+        break;
+    }
+
+    default:
+        return 0;
+    }
+
+    memcpy(c->out + c->out_len, &rep, sizeof(rep));
+    c->out_len += sizeof(rep) + (rep.status == RES_OK ? data_len : 0);
+    return 1;
+}
+
+/* Serve the complete requests received from a client */
+static int serve_input(REMOTE_SERVER* s, UINT i)
+{
+    REMOTE_CLIENT* c = &s->clients[i];
+    size_t pos = 0;
+
+    while (c->in_len - pos >= sizeof(REMOTE_REQUEST)) {
+        REMOTE_REQUEST req;
+
+        memcpy(&req, c->in + pos, sizeof(req));
+        if ((req.op == OP_READ || req.op == OP_WRITE) && req.count > REMOTE_MAX_SECTORS) {
+            return 0;
+        }
+
+        size_t len = sizeof(req) + (req.op == OP_WRITE ? (size_t)req.count * s->ss : 0);
+        if (c->in_len - pos < len) {
+            break;
+        }
+        if (!serve_request(s, i, &req, c->in + pos + sizeof(req))) {
+            return 0;
+        }
+        pos += len;
+    }
+
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    return 1;
+}
+
+static int receive(REMOTE_SERVER* s, UINT i)
+{
+    REMOTE_CLIENT* c = &s->clients[i];
+    size_t want = sizeof(REMOTE_REQUEST) + (size_t)REMOTE_MAX_SECTORS * s->ss;
+
+    if (!reserve(&c->in, &c->in_cap, want)) {
+        return 0;
+    }
+    ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+    if (n < 0) {
+        return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    if (n == 0) {
+        return 0;       /* Closed by the client */
+    }
+    c->in_len += (size_t)n;
+    return serve_input(s, i);
+}
+
+static int transmit(REMOTE_CLIENT* c)
+{
+    while (c->out_pos < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos, SEND_FLAGS);
+        if (n < 0) {
+            return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->out_pos += (size_t)n;
+    }
+    c->out_pos = c->out_len = 0;
+    return 1;
+}
+
+static int listen_socket(const char* path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (!socket_address(path, &addr)) {
+        return -1;
+    }
+    /* A socket left by a server that did not shut down, nothing else */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, REMOTE_MAX_CLIENTS) != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Serve a drive until idle(), called after each poll round, says stop   */
+/*-----------------------------------------------------------------------*/
+DRESULT remote_serve(BYTE pdrv, const char* path, int (*idle)(void* arg), void* arg)
+{
+    REMOTE_SERVER* s;
+    struct pollfd fds[REMOTE_MAX_CLIENTS + 1];
+    WORD ss;
+    int lfd;
+
+    if (disk_initialize(pdrv) & STA_NOINIT) {
+        return RES_NOTRDY;
+    }
+    s = (REMOTE_SERVER*)calloc(1, sizeof(REMOTE_SERVER));
+    if (!s) {
+        return RES_ERROR;
+    }
+    s->pdrv = pdrv;
+    s->writer = -1;
+    disk_ioctl(pdrv, GET_SECTOR_SIZE, &ss);
+    disk_ioctl(pdrv, GET_SECTOR_COUNT, &s->sectors);
+    s->ss = ss;
+
+    lfd = listen_socket(path);
+    if (lfd < 0) {
+        free(s);
+        return RES_PARERR;
+    }
+
+    for (;;) {
+        fds[0].fd = lfd;
+        fds[0].events = s->count < REMOTE_MAX_CLIENTS ? POLLIN : 0;
+        for (UINT i = 0; i < s->count; i++) {
+            REMOTE_CLIENT* c = &s->clients[i];
+
+            /* A client not reading its replies is not read either */
+            fds[i + 1].fd = c->fd;
+            fds[i + 1].events = (c->out_len - c->out_pos < REMOTE_OUT_LIMIT ? POLLIN : 0) |
+                                (c->out_pos < c->out_len ? POLLOUT : 0);
+            fds[i + 1].revents = 0;
+        }
+
+        int n = poll(fds, s->count + 1, REMOTE_POLL_MS);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        /* After every round, so clients keeping the server busy cannot hold off a stop */
+        if (idle && idle(arg)) {
+            break;
+        }
+        if (n <= 0) {
+            continue;
+        }
+
+        /* Newest first, a dropped client is replaced by the last one */
+        for (UINT i = s->count; i-- > 0; ) {
+            short ev = fds[i + 1].revents;
+            REMOTE_CLIENT* c = &s->clients[i];
+            int ok = 1;
+
+            if (ev & (POLLIN | POLLHUP | POLLERR)) {
+                ok = receive(s, i);
+            }
+            if (ok && c->out_pos < c->out_len) {
+                ok = transmit(c);
+            }
+            if (!ok) {
+                drop_client(s, i);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(lfd, NULL, NULL);
+
+            if (fd >= 0) {
+                REMOTE_CLIENT* c = &s->clients[s->count++];
+
+                memset(c, 0, sizeof(*c));
+                c->fd = fd;
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            }
+        }
+    }
+
+    while (s->count > 0) {
+        drop_client(s, s->count - 1);
+    }
+    close(lfd);
+    unlink(path);
+    free(s);
+    return disk_ioctl(pdrv, CTRL_SYNC, NULL);
+}
+
+#else
+
+const DISK_OPS remote_ops = { NULL };
+
+DRESULT remote_serve(BYTE pdrv, const char* path, int (*idle)(void* arg), void* arg)
+{
+    (void)pdrv;
+    (void)path;
+    (void)idle;
+    (void)arg;
+    return RES_NOTRDY;
+}
+
+#endif
@@ -0,0 +1,264 @@
+/*-----------------------------------------------------------------------*/
+/* Point-in-time snapshots of a drive                                    */
+/*-----------------------------------------------------------------------*/
+/* Snapshots form a stack and only the newest one preserves sectors: the */
+/* first backend write to a sector after it was taken saves the old     */
+/* contents. A sector untouched since an older snapshot still holds its  */
+/* contents of that time, so a rollback applies the saved sectors from   */
+/* the newest snapshot down to the target.                               */
+
+#include "ff.h"
+#include "diskio.h"
+#include "diskio_working.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct DISK_SNAPSHOT {
+    UINT    id;
+    BYTE*   map;                /* 1 bit per sector, set: saved below */
+    LBA_t*  sectors;            /* Saved sector numbers, in save order */
+    BYTE*   data;               /* Their contents when the snapshot was taken */
+    UINT    count;
+    UINT    capacity;
+};
+
+static int is_saved(const DISK_SNAPSHOT* s, LBA_t sector)
+{
+    return (s->map[sector / 8] >> (sector % 8)) & 1;
+}
+
+static int reserve(DISK_DEVICE* dev, DISK_SNAPSHOT* s, UINT count)
+{
+    UINT capacity = s->capacity ? s->capacity : 64;
+
+    while (capacity - s->count < count) {
+        capacity *= 2;
+    }
+    if (capacity != s->capacity) {
+        LBA_t* sectors = (LBA_t*)realloc(s->sectors, capacity * sizeof(LBA_t));
+        if (!sectors) {
+            return 0;
+        }
+        s->sectors = sectors;
+
+        BYTE* data = (BYTE*)realloc(s->data, (size_t)capacity * dev->sector_size);
+        if (!data) {
+            return 0;
+        }
+        s->data = data;
+        s->capacity = capacity;
+    }
+    return 1;
+}
+
+static void free_snapshot(DISK_SNAPSHOT* s)
+{
+    free(s->map);
+    free(s->sectors);
+    free(s->data);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Save the sectors a write is about to replace                          */
+/*-----------------------------------------------------------------------*/
+static DRESULT save_sectors(DISK_DEVICE* dev, LBA_t sector, UINT count)
+{
+    DISK_SNAPSHOT* s = &dev->snaps[dev->snap_count - 1];
+    UINT ss = dev->sector_size;
+
+    for (UINT i = 0, n; i < count; i += n) {
+        if (is_saved(s, sector + i)) {
+            n = 1;
+            continue;
+        }
+
+        /* One backend read per run of sectors not saved yet */
+        for (n = 1; i + n < count && !is_saved(s, sector + i + n); n++) ;
+        if (!reserve(dev, s, n)) {
+            return RES_ERROR;
+        }
+        DRESULT res = dev->snap_lower->read(dev, s->data + (size_t)s->count * ss, sector + i, n);
+        if (res != RES_OK) {
+            return res;
+        }
+        for (UINT k = 0; k < n; k++) {
+            LBA_t sect = sector + i + k;
+            s->map[sect / 8] |= (BYTE)(1 << (sect % 8));
+            s->sectors[s->count++] = sect;
+        }
+    }
+    return RES_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Backend operations layered over the drive's own while snapshots exist */
+/*-----------------------------------------------------------------------*/
+static DRESULT snap_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    DRESULT res = save_sectors(dev, sector, count);
+
+    return res == RES_OK ? dev->snap_lower->write(dev, buff, sector, count) : res;
+}
+
+static DRESULT snap_writev(DISK_DEVICE* dev, const BYTE* const* bufs, LBA_t sector, UINT count)
+{
+    DRESULT res = save_sectors(dev, sector, count);
+
+    return res == RES_OK ? dev->snap_lower->writev(dev, bufs, sector, count) : res;
+}
+
+static void uninstall(DISK_DEVICE* dev)
+{
+    dev->ops = dev->snap_lower;
+    dev->snap_lower = NULL;
+    free(dev->snaps);
+    dev->snaps = NULL;
+    dev->snap_count = 0;
+}
+
+/* Snapshots describe the open image only, closing it drops them. The
+   layer is removed first, a layer below restores its own on close */
+static void snap_close(DISK_DEVICE* dev)
+{
+    for (UINT i = 0; i < dev->snap_count; i++) {
+        free_snapshot(&dev->snaps[i]);
+    }
+    uninstall(dev);
+    dev->ops->close(dev);
+}
+
+static int find_snapshot(DISK_DEVICE* dev, UINT id)
+{
+    for (UINT i = 0; i < dev->snap_count; i++) {
+        if (dev->snaps[i].id == id) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Freeze the current backend contents                                   */
+/*-----------------------------------------------------------------------*/
+DRESULT snapshot_create(DISK_DEVICE* dev, UINT* id)
+{
+    DISK_SNAPSHOT* snaps;
+
+    /* Dirty cached sectors belong to the frozen state */
+    if (cache_flush(dev) != RES_OK) {
+        return RES_ERROR;
+    }
+
+    snaps = (DISK_SNAPSHOT*)realloc(dev->snaps, (dev->snap_count + 1) * sizeof(DISK_SNAPSHOT));
+    if (!snaps) {
+        return RES_ERROR;
+    }
+    dev->snaps = snaps;
+
+    DISK_SNAPSHOT* s = &snaps[dev->snap_count];
+    memset(s, 0, sizeof(*s));
+    s->map = (BYTE*)calloc((size_t)((dev->sector_count + 7) / 8), 1);
+    if (!s->map) {
+        return RES_ERROR;
+    }
+    s->id = dev->snap_next_id++;
+    dev->snap_count++;
+
+    if (!dev->snap_lower) {
+        dev->snap_lower = dev->ops;
+        dev->snap_ops = *dev->ops;
+        dev->snap_ops.write = snap_write;
+        dev->snap_ops.writev = dev->ops->writev ? snap_writev : NULL;
+        dev->snap_ops.close = snap_close;
+        dev->snap_ops.trim = NULL;  /* Discarded sectors may still belong to a snapshot */
+        dev->ops = &dev->snap_ops;
+    }
+
+    *id = s->id;
+    return RES_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Return the backend to a snapshot, dropping newer ones                 */
+/*-----------------------------------------------------------------------*/
+DRESULT snapshot_rollback(DISK_DEVICE* dev, UINT id)
+{
+    int target = find_snapshot(dev, id);
+    UINT ss = dev->sector_size;
+    DRESULT res = RES_OK;
+
+    if (target < 0) {
+        return RES_PARERR;
+    }
+
+    /* Cached sectors are newer than any snapshot, discard them unwritten */
+    cache_release(dev);
+    cache_init(dev);    /* Runs uncached if the memory is gone */
+    dev->ra.window = 0;
+
+    for (int i = (int)dev->snap_count - 1; i >= target && res == RES_OK; i--) {
+        DISK_SNAPSHOT* s = &dev->snaps[i];
+
+        /* Runs were saved together, restore them with one write each */
+        for (UINT j = 0, n; j < s->count && res == RES_OK; j += n) {
+            for (n = 1; j + n < s->count && s->sectors[j + n] == s->sectors[j] + n; n++) ;
+            res = dev->snap_lower->write(dev, s->data + (size_t)j * ss, s->sectors[j], n);
+        }
+    }
+    if (res == RES_OK && dev->snap_lower->drain) {
+        res = dev->snap_lower->drain(dev);
+    }
+    if (res != RES_OK) {
+        return res;
+    }
+
+    while (dev->snap_count > (UINT)target + 1) {
+        free_snapshot(&dev->snaps[--dev->snap_count]);
+    }
+
+    /* The target stays, preserving from its point in time again */
+    DISK_SNAPSHOT* s = &dev->snaps[target];
+    memset(s->map, 0, (size_t)((dev->sector_count + 7) / 8));
+    s->count = 0;
+    return RES_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Drop a snapshot, handing its saved sectors to the next older one      */
+/*-----------------------------------------------------------------------*/
+DRESULT snapshot_release(DISK_DEVICE* dev, UINT id)
+{
+    int k = find_snapshot(dev, id);
+    UINT ss = dev->sector_size;
+
+    if (k < 0) {
+        return RES_PARERR;
+    }
+
+    /* Sectors the older snapshot has not saved still had these contents
+       when it was taken */
+    if (k > 0) {
+        DISK_SNAPSHOT* s = &dev->snaps[k];
+        DISK_SNAPSHOT* older = &dev->snaps[k - 1];
+
+        for (UINT j = 0; j < s->count; j++) {
+            LBA_t sect = s->sectors[j];
+            if (is_saved(older, sect)) {
+                continue;
+            }
+            if (!reserve(dev, older, 1)) {
+                return RES_ERROR;
+            }
+            memcpy(older->data + (size_t)older->count * ss, s->data + (size_t)j * ss, ss);
+            older->map[sect / 8] |= (BYTE)(1 << (sect % 8));
+            older->sectors[older->count++] = sect;
+        }
+    }
+
+    free_snapshot(&dev->snaps[k]);
+    memmove(&dev->snaps[k], &dev->snaps[k + 1], (dev->snap_count - k - 1) * sizeof(DISK_SNAPSHOT));
+    if (--dev->snap_count == 0) {
+        uninstall(dev);
+    }
+    return RES_OK;
+}
@@ -0,0 +1,212 @@
+/*-----------------------------------------------------------------------*/
+/* Device timing emulation                                               */
+/*-----------------------------------------------------------------------*/
+/* A layer right over the backend charges every command the time a slow  */
+/* device would take: a fixed latency, the transfer at a bandwidth cap,  */
+/* a penalty per erase block a write covers only in part and now and     */
+/* then a stall. The device serves one command at a time. Stalls come    */
+/* from a seeded generator, so a run can be repeated exactly; with       */
+/* realtime off nothing sleeps and disk_stats reports the device time.   */
+
+#include "ff.h"
+#include "diskio.h"
+#include "diskio_working.h"
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static QWORD next_random(DISK_DEVICE* dev)
+{
+    /* xorshift64* */
+    QWORD x = dev->throttle_rng;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    dev->throttle_rng = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static QWORD transfer_us(QWORD bytes, QWORD bps)
+{
+    return bps ? bytes * 1000000 / bps : 0;
+}
+
+/* Erase blocks a write starts or ends inside of, each is rewritten whole */
+static UINT partial_blocks(DISK_DEVICE* dev, LBA_t sector, LBA_t count)
+{
+    UINT eb = dev->throttle.erase_block / dev->sector_size;
+    LBA_t end = sector + count;
+
+    if (eb <= 1) {
+        return 0;
+    }
+    if (sector / eb == (end - 1) / eb) {
+        return (sector % eb || end % eb) ? 1 : 0;
+    }
+    return (sector % eb ? 1 : 0) + (end % eb ? 1 : 0);
+}
+
+#ifndef _WIN32
+static QWORD monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (QWORD)ts.tv_sec * 1000000 + (QWORD)ts.tv_nsec / 1000;
+}
+#endif
+
+/* Account a command, waiting for it when emulating in real time */
+static void charge(DISK_DEVICE* dev, QWORD us)
+{
+    const DISK_THROTTLE* t = &dev->throttle;
+
+    if (t->stall_ppm && next_random(dev) % 1000000 < t->stall_ppm) {
+        us += t->stall_us / 2 + (t->stall_us ? next_random(dev) % t->stall_us : 0);
+        dev->stats.device_stalls++;
+    }
+    dev->stats.device_us += us;
+
+    if (!t->realtime || us == 0) {
+        return;
+    }
+#ifdef _WIN32
+    Sleep((DWORD)((us + 999) / 1000));
+#else
+    /* A command starts when the device is done with the previous one, an
+       oversleep is absorbed instead of adding up */
+    QWORD now = monotonic_us();
+    if (dev->throttle_busy < now) {
+        dev->throttle_busy = now;
+    }
+    dev->throttle_busy += us;
+
+    QWORD wait = dev->throttle_busy - now;
+    struct timespec ts = { (time_t)(wait / 1000000), (long)(wait % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) != 0) ;
+#endif
+}
+
+static void charge_read(DISK_DEVICE* dev, UINT count)
+{
+    charge(dev, dev->throttle.read_latency_us +
+                transfer_us((QWORD)count * dev->sector_size, dev->throttle.read_bps));
+}
+
+static void charge_write(DISK_DEVICE* dev, LBA_t sector, UINT count)
+{
+    charge(dev, dev->throttle.write_latency_us +
+                transfer_us((QWORD)count * dev->sector_size, dev->throttle.write_bps) +
+                (QWORD)partial_blocks(dev, sector, count) * dev->throttle.erase_penalty_us);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Backend operations layered over the drive's own                       */
+/*-----------------------------------------------------------------------*/
+static DRESULT throttle_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count)
+{
+    if (dev->throttle_on) {
+        charge_read(dev, count);
+    }
+    return dev->throttle_lower->read(dev, buff, sector, count);
+}
+
+static DRESULT throttle_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    if (dev->throttle_on) {
+        charge_write(dev, sector, count);
+    }
+    return dev->throttle_lower->write(dev, buff, sector, count);
+}
+
+static DRESULT throttle_writev(DISK_DEVICE* dev, const BYTE* const* bufs, LBA_t sector, UINT count)
+{
+    if (dev->throttle_on) {
+        charge_write(dev, sector, count);
+    }
+    return dev->throttle_lower->writev(dev, bufs, sector, count);
+}
+
+static DRESULT throttle_sync(DISK_DEVICE* dev)
+{
+    if (dev->throttle_on) {
+        charge(dev, dev->throttle.sync_latency_us);
+    }
+    return dev->throttle_lower->sync(dev);
+}
+
+/* A discard is a command without a transfer */
+static DRESULT throttle_trim(DISK_DEVICE* dev, LBA_t sector, LBA_t count)
+{
+    if (dev->throttle_on) {
+        charge(dev, dev->throttle.write_latency_us);
+    }
+    return dev->throttle_lower->trim(dev, sector, count);
+}
+
+static void throttle_close(DISK_DEVICE* dev)
+{
+    const DISK_OPS* lower = dev->throttle_lower;
+
+    dev->ops = lower;
+    dev->throttle_lower = NULL;
+    lower->close(dev);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Put the layer over a backend that was just opened                     */
+/*-----------------------------------------------------------------------*/
+void throttle_install(DISK_DEVICE* dev)
+{
+    if (!dev->throttle_on || dev->throttle_lower) {
+        return;
+    }
+
+    dev->throttle_rng = dev->throttle.seed ? dev->throttle.seed : 1;
+    dev->throttle_busy = 0;
+
+    dev->throttle_lower = dev->ops;
+    dev->throttle_ops = *dev->ops;
+    dev->throttle_ops.close = throttle_close;
+    dev->throttle_ops.read = throttle_read;
+    dev->throttle_ops.write = throttle_write;
+    dev->throttle_ops.writev = dev->ops->writev ? throttle_writev : NULL;
+    dev->throttle_ops.sync = throttle_sync;
+    dev->throttle_ops.trim = dev->ops->trim ? throttle_trim : NULL;
+    dev->ops = &dev->throttle_ops;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Set the emulated timing of a drive (NULL: full speed)                 */
+/*-----------------------------------------------------------------------*/
+DRESULT throttle_set(DISK_DEVICE* dev, const DISK_THROTTLE* t)
+{
+    if (t && t->erase_block && (t->erase_block & (t->erase_block - 1)) != 0) {
+        return RES_PARERR;
+    }
+
+    /* The layer goes right over the backend, under checksums and snapshots */
+    if (t && dev->initialized && !dev->throttle_lower && (dev->crc_lower || dev->snap_lower)) {
+        return RES_PARERR;
+    }
+
+    if (!t) {
+        /* An installed layer stays until the backend closes, passing through */
+        dev->throttle_on = 0;
+        return RES_OK;
+    }
+
+    dev->throttle = *t;
+    dev->throttle_on = 1;
+    dev->throttle_rng = t->seed ? t->seed : 1;
+    dev->throttle_busy = 0;
+    if (dev->initialized) {
+        throttle_install(dev);
+    }
+    return RES_OK;
+}
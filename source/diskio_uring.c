@@ -0,0 +1,525 @@
+/*-----------------------------------------------------------------------*/
+/* io_uring engine of the DISK_BACKEND_URING backend                     */
+/*-----------------------------------------------------------------------*/
+/* The ring is driven with raw syscalls so no liburing is needed. Large  */
+/* transfers are split into requests that are in flight together, cache */
+/* write-back runs are queued until uring_drain() and readahead is read  */
+/* into a staging buffer while the caller carries on.                    */
+
+#include "ff.h"
+#include "diskio.h"
+#include "diskio_working.h"
+
+#ifdef DISK_HAVE_IO_URING
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+#define URING_DEPTH     32              /* Requests in flight */
+#define URING_CHUNK     (64 * 1024)     /* Bytes per request of a contiguous transfer */
+#define URING_IOV       128             /* Sectors per request of a vectored write */
+
+/* Completion groups, each waited for on its own */
+#define GROUP_IO        0   /* Synchronous disk_read/disk_write */
+#define GROUP_FLUSH     1   /* Cache write-back queued by uring_writev */
+#define GROUP_RA        2   /* Readahead into the staging buffer */
+#define GROUPS          3
+
+typedef struct {
+    int     busy;
+    int     group;
+    int     write;
+    off_t   offset;             /* Position of iov[0] */
+    int     iovcnt;
+    struct iovec iov[URING_IOV];
+} URING_REQ;
+
+struct DISK_URING {
+    int     ring_fd;
+    int     fd;                 /* Image descriptor */
+
+    void*   sq_ring;
+    size_t  sq_ring_size;
+    void*   cq_ring;
+    size_t  cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t  sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    unsigned queued;            /* SQEs not handed to the kernel yet */
+    unsigned pending[GROUPS];   /* Requests not completed */
+    int     failed[GROUPS];     /* A request of the group failed */
+    URING_REQ reqs[URING_DEPTH];
+
+    /* Readahead staging buffer, valid once pending[GROUP_RA] is 0 */
+    BYTE*   ra_buf;
+    UINT    ra_capacity;        /* Sectors */
+    LBA_t   ra_sector;
+    UINT    ra_count;
+};
+
+/*-----------------------------------------------------------------------*/
+/* Ring plumbing                                                         */
+/*-----------------------------------------------------------------------*/
+static int ring_enter(DISK_URING* u, unsigned min_complete)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+    while (u->queued || min_complete) {
+        long n = syscall(__NR_io_uring_enter, u->ring_fd, u->queued, min_complete, flags, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        u->queued -= (unsigned)n;
+        if (min_complete || n == 0) {
+            break;
+        }
+    }
+    return 1;
+}
+
+/* Finish a request the kernel completed short or asked us to retry */
+static int finish_sync(DISK_URING* u, URING_REQ* r, size_t done)
+{
+    off_t offset = r->offset;
+
+    for (int i = 0; i < r->iovcnt; i++) {
+        BYTE* buf = (BYTE*)r->iov[i].iov_base;
+        size_t len = r->iov[i].iov_len;
+
+        if (done >= len) {
+            done -= len;
+            offset += (off_t)len;
+            continue;
+        }
+        buf += done;
+        offset += (off_t)done;
+        len -= done;
+        done = 0;
+
+        while (len > 0) {
+            ssize_t n = r->write ? pwrite(u->fd, buf, len, offset) : pread(u->fd, buf, len, offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return 0;
+            }
+            buf += n;
+            len -= (size_t)n;
+            offset += n;
+        }
+    }
+    return 1;
+}
+
+static size_t request_bytes(const URING_REQ* r)
+{
+    size_t len = 0;
+
+    for (int i = 0; i < r->iovcnt; i++) {
+        len += r->iov[i].iov_len;
+    }
+    return len;
+}
+
+/* Process every completion the kernel has posted */
+static void reap(DISK_URING* u)
+{
+    unsigned head = *u->cq_head;
+
+    while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+        URING_REQ* r = &u->reqs[cqe->user_data];
+        int ok;
+
+        if (cqe->res >= 0 && (size_t)cqe->res == request_bytes(r)) {
+            ok = 1;
+        } else if (cqe->res > 0 || cqe->res == -EINTR || cqe->res == -EAGAIN) {
+            ok = finish_sync(u, r, cqe->res > 0 ? (size_t)cqe->res : 0);
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            u->failed[r->group] = 1;
+        }
+        u->pending[r->group]--;
+        r->busy = 0;
+        head++;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Block until a request completes */
+static int wait_one(DISK_URING* u)
+{
+    if (!ring_enter(u, 1)) {
+        return 0;
+    }
+    reap(u);
+    return 1;
+}
+
+static int wait_group(DISK_URING* u, int group)
+{
+    while (u->pending[group]) {
+        if (!wait_one(u)) {
+            return 0;
+        }
+    }
+    if (u->failed[group]) {
+        u->failed[group] = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static URING_REQ* get_req(DISK_URING* u)
+{
+    for (;;) {
+        for (unsigned i = 0; i < URING_DEPTH; i++) {
+            if (!u->reqs[i].busy) {
+                u->reqs[i].busy = 1;
+                u->reqs[i].iovcnt = 0;
+                return &u->reqs[i];
+            }
+        }
+        if (!wait_one(u)) {
+            return NULL;
+        }
+    }
+}
+
+static void queue_req(DISK_URING* u, URING_REQ* r, int group, int write, off_t offset)
+{
+    unsigned tail = *u->sq_tail;
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe* sqe = &u->sqes[index];
+
+    r->group = group;
+    r->write = write;
+    r->offset = offset;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = u->fd;
+    sqe->off = (unsigned long long)offset;
+    sqe->addr = (unsigned long long)(uintptr_t)r->iov;
+    sqe->len = (unsigned)r->iovcnt;
+    sqe->user_data = (unsigned long long)(r - u->reqs);
+
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    u->pending[group]++;
+}
+
+/* Queue a contiguous transfer split into URING_CHUNK requests */
+static int queue_span(DISK_URING* u, BYTE* buf, size_t len, off_t offset, int group, int write)
+{
+    while (len > 0) {
+        size_t n = len < URING_CHUNK ? len : URING_CHUNK;
+        URING_REQ* r = get_req(u);
+
+        if (!r) {
+            return 0;
+        }
+        r->iov[0].iov_base = buf;
+        r->iov[0].iov_len = n;
+        r->iovcnt = 1;
+        queue_req(u, r, group, write, offset);
+        buf += n;
+        offset += (off_t)n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* After a failed submit, take back the SQEs the kernel has not consumed,
+   failing their groups, and wait for the ones it has. Nothing may be left
+   pointing at a caller's buffer once the error is returned. */
+static void abandon_group(DISK_URING* u, int group)
+{
+    unsigned tail = *u->sq_tail;
+
+    for (; u->queued; u->queued--) {
+        struct io_uring_sqe* sqe = &u->sqes[--tail & *u->sq_mask];
+        URING_REQ* r = &u->reqs[sqe->user_data];
+
+        u->failed[r->group] = 1;
+        u->pending[r->group]--;
+        r->busy = 0;
+    }
+    __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+    wait_group(u, group);
+}
+
+/* Drop staged readahead that a write is about to make stale */
+static void drop_readahead(DISK_URING* u, LBA_t sector, LBA_t count)
+{
+    if (u->ra_count && sector < u->ra_sector + u->ra_count && u->ra_sector < sector + count) {
+        wait_group(u, GROUP_RA);
+        u->ra_count = 0;
+    }
+}
+
+/*-----------------------------------------------------------------------*/
+/* Set up the ring on an open image descriptor                           */
+/*-----------------------------------------------------------------------*/
+int uring_setup(DISK_DEVICE* dev)
+{
+    struct io_uring_params p;
+    DISK_URING* u = (DISK_URING*)calloc(1, sizeof(DISK_URING));
+
+    if (!u) {
+        return 0;
+    }
+
+    memset(&p, 0, sizeof(p));
+    u->ring_fd = (int)syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if (u->ring_fd < 0) {
+        free(u);
+        return 0;       /* Kernel without io_uring, or blocked by seccomp */
+    }
+    u->fd = dev->fd;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size) {
+            u->sq_ring_size = u->cq_ring_size;
+        }
+        u->cq_ring_size = 0;
+    }
+#endif
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        close(u->ring_fd);
+        free(u);
+        return 0;
+    }
+    if (u->cq_ring_size) {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          u->ring_fd, IORING_OFF_CQ_RING);
+    } else {
+        u->cq_ring = u->sq_ring;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*)mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+    if (u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        dev->uring = u;
+        if (u->sqes == MAP_FAILED) u->sqes = NULL;
+        if (u->cq_ring == MAP_FAILED) u->cq_ring = NULL;
+        uring_teardown(dev);
+        return 0;
+    }
+
+    u->sq_tail = (unsigned*)((BYTE*)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned*)((BYTE*)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)((BYTE*)u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned*)((BYTE*)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned*)((BYTE*)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned*)((BYTE*)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)((BYTE*)u->cq_ring + p.cq_off.cqes);
+
+    dev->uring = u;
+    return 1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Wait for outstanding requests and release the ring                    */
+/*-----------------------------------------------------------------------*/
+void uring_teardown(DISK_DEVICE* dev)
+{
+    DISK_URING* u = dev->uring;
+
+    if (!u) {
+        return;
+    }
+
+    if (u->sqes) {
+        for (int g = 0; g < GROUPS; g++) {
+            wait_group(u, g);
+        }
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_ring && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->ring_fd);
+    free(u->ra_buf);
+    free(u);
+    dev->uring = NULL;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Read sectors, from staged readahead when it covers the range          */
+/*-----------------------------------------------------------------------*/
+DRESULT uring_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count)
+{
+    DISK_URING* u = dev->uring;
+    UINT ss = dev->sector_size;
+
+    if (u->ra_count && sector >= u->ra_sector && sector + count <= u->ra_sector + u->ra_count) {
+        if (wait_group(u, GROUP_RA)) {
+            memcpy(buff, u->ra_buf + (size_t)(sector - u->ra_sector) * ss, (size_t)count * ss);
+            return RES_OK;
+        }
+        u->ra_count = 0;    /* Failed readahead, read again below */
+    }
+
+    if (!queue_span(u, buff, (size_t)count * ss, (off_t)sector * ss, GROUP_IO, 0) ||
+        !ring_enter(u, 0)) {
+        abandon_group(u, GROUP_IO);
+        return RES_ERROR;
+    }
+    return wait_group(u, GROUP_IO) ? RES_OK : RES_ERROR;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Write sectors and wait for them                                       */
+/*-----------------------------------------------------------------------*/
+DRESULT uring_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    DISK_URING* u = dev->uring;
+    UINT ss = dev->sector_size;
+
+    drop_readahead(u, sector, count);
+    if (!queue_span(u, (BYTE*)buff, (size_t)count * ss, (off_t)sector * ss, GROUP_IO, 1) ||
+        !ring_enter(u, 0)) {
+        abandon_group(u, GROUP_IO);
+        return RES_ERROR;
+    }
+    if (!wait_group(u, GROUP_IO)) {
+        return RES_ERROR;
+    }
+    if (dev->sync_mode == DISK_SYNC_WRITE_THROUGH && fdatasync(u->fd) != 0) {
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Queue a write-back run; buffers must stay put until uring_drain()     */
+/*-----------------------------------------------------------------------*/
+DRESULT uring_writev(DISK_DEVICE* dev, const BYTE* const* bufs, LBA_t sector, UINT count)
+{
+    DISK_URING* u = dev->uring;
+    UINT ss = dev->sector_size;
+
+    drop_readahead(u, sector, count);
+    for (UINT i = 0; i < count; ) {
+        URING_REQ* r = get_req(u);
+        UINT n = count - i < URING_IOV ? count - i : URING_IOV;
+
+        if (!r) {
+            abandon_group(u, GROUP_FLUSH);
+            return RES_ERROR;
+        }
+        for (UINT k = 0; k < n; k++) {
+            r->iov[k].iov_base = (void*)bufs[i + k];
+            r->iov[k].iov_len = ss;
+        }
+        r->iovcnt = (int)n;
+        queue_req(u, r, GROUP_FLUSH, 1, (off_t)(sector + i) * ss);
+        i += n;
+    }
+
+    /* Start the transfer now, completion is collected by uring_drain() */
+    if (!ring_enter(u, 0)) {
+        abandon_group(u, GROUP_FLUSH);
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Wait for the queued write-back                                        */
+/*-----------------------------------------------------------------------*/
+DRESULT uring_drain(DISK_DEVICE* dev)
+{
+    return wait_group(dev->uring, GROUP_FLUSH) ? RES_OK : RES_ERROR;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Punch out discarded sectors once nothing in flight touches them       */
+/*-----------------------------------------------------------------------*/
+DRESULT uring_trim(DISK_DEVICE* dev, LBA_t sector, LBA_t count)
+{
+    DISK_URING* u = dev->uring;
+
+    if (!wait_group(u, GROUP_FLUSH)) {
+        return RES_ERROR;
+    }
+    drop_readahead(u, sector, count);
+    return disk_punch_sectors(dev, u->fd, sector, count);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Start reading ahead into the staging buffer without waiting           */
+/*-----------------------------------------------------------------------*/
+void uring_prefetch(DISK_DEVICE* dev, LBA_t sector, UINT count)
+{
+    DISK_URING* u = dev->uring;
+    UINT ss = dev->sector_size;
+    LBA_t keep = dev->ra.next;     /* Staged sectors from here on are still wanted */
+    UINT kept = 0;
+
+    if (!wait_group(u, GROUP_RA)) {
+        u->ra_count = 0;
+    }
+
+    /* Slide the unread tail of the previous window to the front */
+    if (u->ra_count && keep >= u->ra_sector && keep < u->ra_sector + u->ra_count &&
+        sector == u->ra_sector + u->ra_count) {
+        kept = (UINT)(u->ra_sector + u->ra_count - keep);
+        memmove(u->ra_buf, u->ra_buf + (size_t)(keep - u->ra_sector) * ss, (size_t)kept * ss);
+    }
+
+    if (kept + count > u->ra_capacity) {
+        BYTE* buf = (BYTE*)realloc(u->ra_buf, (size_t)(kept + count) * ss);
+        if (!buf) {
+            u->ra_count = 0;
+            return;
+        }
+        u->ra_buf = buf;
+        u->ra_capacity = kept + count;
+    }
+
+    u->ra_sector = sector - kept;
+    u->ra_count = kept + count;
+    if (!queue_span(u, u->ra_buf + (size_t)kept * ss, (size_t)count * ss, (off_t)sector * ss, GROUP_RA, 0) ||
+        !ring_enter(u, 0)) {
+        abandon_group(u, GROUP_RA);
+        u->ra_count = 0;
+    }
+}
+
+#endif
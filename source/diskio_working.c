@@ -2,288 +2,2014 @@
 /* Working disk I/O module for FatFs Python bindings with memory/file backend */
 /*-----------------------------------------------------------------------*/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE         /* O_DIRECT and statx() on glibc */
+#endif
+
 #include "ff.h"
 #include "diskio.h"
+#include "diskio_working.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#define DISK_HAVE_MMAP  1
+#define DISK_HAVE_PREAD 1
+#endif
 
-/* Configuration */
-#define SECTOR_SIZE     512
-#define TOTAL_SECTORS   8192    /* 4MB virtual disk (8192 * 512 bytes) */
-#define DISK_IMAGE_FILE "fatfs_disk.img"
+#if defined(__linux__) || defined(__FreeBSD__)
+#include <sys/uio.h>
+#define DISK_HAVE_PWRITEV 1
+#define DISK_IOV_BATCH  128     /* iovecs per pwritev call, below any IOV_MAX */
+#endif
+
+#if defined(DISK_HAVE_PREAD) && defined(O_DIRECT)
+#define DISK_HAVE_DIRECT 1
+#define DIRECT_BOUNCE   (256 * 1024)    /* Bytes of the aligned bounce buffer */
+#define DIRECT_ALIGN    4096            /* Alignment when the kernel cannot tell */
+#endif
+
+/* Configuration defaults, overridable at runtime with open_disk_image() */
+#define DEFAULT_SECTOR_SIZE 512
+#define DEFAULT_DISK_SIZE   (4UL * 1024 * 1024)    /* 4MB virtual disk */
+#define DISK_IMAGE_FILE     "fatfs_disk.img"        /* Image of drive 0 */
+#define DISK_IMAGE_PATTERN  "fatfs_disk%u.img"      /* Images of drives 1.. */
+#define DEFAULT_READAHEAD   64                      /* Largest readahead window in sectors */
+#define RAMDISK_HUGE_PAGE   (2UL * 1024 * 1024)     /* MAP_HUGETLB is tried on multiples of this */
+#define RAMDISK_IO_CHUNK    (1UL * 1024 * 1024)     /* Bytes per call when loading or dumping */
+#define SPARSE_READ_MIN     (32 * 1024)             /* Reads from this size look for holes first */
 
-/* Virtual disk storage */
-static BYTE* virtual_disk = NULL;
-static int disk_initialized = 0;
+#ifdef _WIN32
+#define disk_fseek(f, ofs)  _fseeki64((f), (__int64)(ofs), SEEK_SET)
+#else
+#define disk_fseek(f, ofs)  fseeko((f), (off_t)(ofs), SEEK_SET)
+#endif
+
+/* One slot per physical drive, pdrv == logical drive number */
+static DISK_DEVICE disk_devices[FF_VOLUMES];
+static int disk_devices_ready = 0;
 
-/* File-based backing store option */
-static FILE* disk_file = NULL;
-static int use_file_backend = 1;  /* Set to 0 for pure memory backend */
+static const DISK_OPS* backend_ops(int backend);
 
 /*-----------------------------------------------------------------------*/
-/* Initialize virtual disk storage                                       */
+/* Look up a drive, filling the table with defaults on first use         */
 /*-----------------------------------------------------------------------*/
-static int init_virtual_disk(void)
+static DISK_DEVICE* get_device(BYTE pdrv)
 {
-    if (use_file_backend) {
-        /* Try to open existing disk image */
-        disk_file = fopen(DISK_IMAGE_FILE, "r+b");
-        if (!disk_file) {
-            /* Create new disk image */
-            disk_file = fopen(DISK_IMAGE_FILE, "w+b");
-            if (!disk_file) {
-                return 0; /* Failed to create */
-            }
-            
-            /* Initialize with zeros */
-            BYTE zero_sector[SECTOR_SIZE];
-            memset(zero_sector, 0, SECTOR_SIZE);
-            
-            for (int i = 0; i < TOTAL_SECTORS; i++) {
-                if (fwrite(zero_sector, 1, SECTOR_SIZE, disk_file) != SECTOR_SIZE) {
-                    fclose(disk_file);
-                    disk_file = NULL;
-                    return 0;
-                }
-            }
-            fflush(disk_file);
-        }
-    } else {
-        /* Memory-based backend */
-        if (!virtual_disk) {
-            virtual_disk = (BYTE*)calloc(TOTAL_SECTORS * SECTOR_SIZE, 1);
-            if (!virtual_disk) {
-                return 0; /* Memory allocation failed */
+    if (!disk_devices_ready) {
+        for (UINT i = 0; i < FF_VOLUMES; i++) {
+            DISK_DEVICE* dev = &disk_devices[i];
+
+            memset(dev, 0, sizeof(*dev));
+            dev->backend = DISK_BACKEND_FILE;
+            dev->ops = backend_ops(dev->backend);
+            dev->sync_mode = DISK_SYNC_NONE;
+            dev->sector_size = DEFAULT_SECTOR_SIZE;
+            dev->sector_count = (LBA_t)(DEFAULT_DISK_SIZE / DEFAULT_SECTOR_SIZE);
+            dev->size_auto = 1;
+            dev->fd = -1;
+            dev->ra.max_window = DEFAULT_READAHEAD;
+            if (i == 0) {
+                strcpy(dev->path, DISK_IMAGE_FILE);
+            } else {
+                snprintf(dev->path, sizeof(dev->path), DISK_IMAGE_PATTERN, i);
             }
         }
+        disk_devices_ready = 1;
     }
-    
-    disk_initialized = 1;
-    return 1;
+
+    return pdrv < FF_VOLUMES ? &disk_devices[pdrv] : NULL;
 }
 
+#ifndef _WIN32
 /*-----------------------------------------------------------------------*/
-/* Cleanup disk storage                                                  */
+/* Force file data to stable storage                                     */
+/*-----------------------------------------------------------------------*/
+int disk_datasync(int fd)
+{
+#if defined(__APPLE__)
+    return fsync(fd);
+#else
+    return fdatasync(fd);
+#endif
+}
+
 /*-----------------------------------------------------------------------*/
-static void cleanup_virtual_disk(void)
+/* Release the host blocks of a byte range                               */
+/*-----------------------------------------------------------------------*/
+int disk_punch_hole(int fd, off_t offset, off_t len)
 {
-    if (disk_file) {
-        fclose(disk_file);
-        disk_file = NULL;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return 1;
     }
-    
-    if (virtual_disk) {
-        free(virtual_disk);
-        virtual_disk = NULL;
+    return errno == EOPNOTSUPP || errno == ENOSYS ? -1 : 0;
+#else
+    (void)fd;
+    (void)offset;
+    (void)len;
+    return -1;
+#endif
+}
+
+/* Punch out sectors; a file system without holes keeps the blocks and
+   the data stays valid, which is remembered so zero writes stop trying */
+DRESULT disk_punch_sectors(DISK_DEVICE* dev, int fd, LBA_t sector, LBA_t count)
+{
+    int res = disk_punch_hole(fd, (off_t)sector * dev->sector_size, (off_t)count * dev->sector_size);
+
+    if (res < 0) {
+        dev->no_punch = 1;
     }
-    
-    disk_initialized = 0;
+    return res != 0 ? RES_OK : RES_ERROR;
 }
+#endif
 
 /*-----------------------------------------------------------------------*/
-/* Get Drive Status                                                      */
+/* Little endian fields of sidecar and container headers                 */
 /*-----------------------------------------------------------------------*/
-DSTATUS disk_status (
-    BYTE pdrv        /* Physical drive number to identify the drive */
-)
+void disk_st_le(BYTE* p, QWORD v, int n)
 {
-    switch (pdrv) {
-    case 0:
-        return disk_initialized ? 0 : STA_NOINIT;
-    default:
-        return STA_NOINIT;
+    for (int i = 0; i < n; i++) {
+        p[i] = (BYTE)(v >> (8 * i));
+    }
+}
+
+QWORD disk_ld_le(const BYTE* p, int n)
+{
+    QWORD v = 0;
+
+    for (int i = n - 1; i >= 0; i--) {
+        v = (v << 8) | p[i];
     }
+    return v;
 }
 
 /*-----------------------------------------------------------------------*/
-/* Initialize a Drive                                                    */
+/* Test a buffer for all zero bytes                                      */
 /*-----------------------------------------------------------------------*/
-DSTATUS disk_initialize (
-    BYTE pdrv                /* Physical drive number to identify the drive */
-)
+int disk_is_zero(const BYTE* p, size_t n)
 {
-    switch (pdrv) {
-    case 0:
-        if (init_virtual_disk()) {
-            return 0; /* Success */
-        } else {
-            return STA_NOINIT; /* Failed to initialize */
+    /* Bytes up to an aligned address, then 64 bytes per test */
+    for (; n && ((uintptr_t)p & 15); p++, n--) {
+        if (*p) return 0;
+    }
+#ifdef __SSE2__
+    for (; n >= 64; p += 64, n -= 64) {
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_load_si128((const __m128i*)p),
+                                              _mm_load_si128((const __m128i*)(p + 16))),
+                                 _mm_or_si128(_mm_load_si128((const __m128i*)(p + 32)),
+                                              _mm_load_si128((const __m128i*)(p + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF) {
+            return 0;
         }
-    default:
-        return STA_NOINIT;
     }
+#else
+    for (; n >= 64; p += 64, n -= 64) {
+        QWORD w[8];
+
+        memcpy(w, p, sizeof(w));
+        if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) {
+            return 0;
+        }
+    }
+#endif
+    for (; n; p++, n--) {
+        if (*p) return 0;
+    }
+    return 1;
 }
 
 /*-----------------------------------------------------------------------*/
-/* Read Sector(s)                                                       */
+/* Write sectors, punching out the whole host blocks they fill with zeros */
 /*-----------------------------------------------------------------------*/
-DRESULT disk_read (
-    BYTE pdrv,        /* Physical drive number to identify the drive */
-    BYTE *buff,        /* Data buffer to store read data */
-    LBA_t sector,    /* Start sector in LBA */
-    UINT count        /* Number of sectors to read */
-)
+typedef DRESULT (*DISK_WRITE_FN)(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count);
+typedef DRESULT (*DISK_WRITEV_FN)(DISK_DEVICE* dev, const BYTE* const* bufs, LBA_t sector, UINT count);
+typedef DRESULT (*DISK_TRIM_FN)(DISK_DEVICE* dev, LBA_t sector, LBA_t count);
+typedef DRESULT (*DISK_SYNC_FN)(DISK_DEVICE* dev);
+
+/* Sectors i to i+n of a contiguous (buff) or per-sector (bufs) transfer */
+static int sectors_zero(DISK_DEVICE* dev, const BYTE* buff, const BYTE* const* bufs, UINT i, UINT n)
 {
-    if (pdrv != 0 || !disk_initialized) {
-        return RES_PARERR;
+    if (buff) {
+        return disk_is_zero(buff + (size_t)i * dev->sector_size, (size_t)n * dev->sector_size);
     }
-    
-    if (sector >= TOTAL_SECTORS || (sector + count) > TOTAL_SECTORS) {
-        return RES_PARERR;
+    for (UINT k = 0; k < n; k++) {
+        if (!disk_is_zero(bufs[i + k], dev->sector_size)) return 0;
     }
-    
-    if (use_file_backend && disk_file) {
-        /* File-based backend */
-        if (fseek(disk_file, sector * SECTOR_SIZE, SEEK_SET) != 0) {
-            return RES_ERROR;
+    return 1;
+}
+
+static DRESULT write_sectors(DISK_DEVICE* dev, const BYTE* buff, const BYTE* const* bufs, LBA_t sector, UINT i, UINT n,
+                             DISK_WRITE_FN write_fn, DISK_WRITEV_FN writev_fn)
+{
+    if (n == 0) {
+        return RES_OK;
+    }
+    return buff ? write_fn(dev, buff + (size_t)i * dev->sector_size, sector + i, n)
+                : writev_fn(dev, bufs + i, sector + i, n);
+}
+
+static DRESULT write_sparse(DISK_DEVICE* dev, const BYTE* buff, const BYTE* const* bufs, LBA_t sector, UINT count,
+                            DISK_WRITE_FN write_fn, DISK_WRITEV_FN writev_fn, DISK_TRIM_FN trim_fn,
+                            DISK_SYNC_FN sync_fn)
+{
+    UINT group = dev->sector_size < DISK_SPARSE_BLOCK ? DISK_SPARSE_BLOCK / dev->sector_size : 1;
+    UINT start = 0, i = 0;
+    LBA_t punched = 0;
+    DRESULT res = RES_OK;
+
+    /* A preallocated image keeps its host blocks */
+    if (dev->no_punch || dev->preallocate || count < group) {
+        return write_sectors(dev, buff, bufs, sector, 0, count, write_fn, writev_fn);
+    }
+
+    while (i < count && res == RES_OK) {
+        UINT misalign = (UINT)((sector + i) % group);
+
+        if (misalign || count - i < group || !sectors_zero(dev, buff, bufs, i, group)) {
+            i += misalign ? group - misalign : group;
+            continue;
         }
-        
-        size_t bytes_to_read = count * SECTOR_SIZE;
-        size_t bytes_read = fread(buff, 1, bytes_to_read, disk_file);
-        
-        if (bytes_read != bytes_to_read) {
-            return RES_ERROR;
+
+        /* A run of zero host blocks, the data before it is written first */
+        UINT end = i + group;
+        while (count - end >= group && sectors_zero(dev, buff, bufs, end, group)) {
+            end += group;
         }
-    } else if (virtual_disk) {
-        /* Memory-based backend */
-        size_t offset = sector * SECTOR_SIZE;
-        size_t bytes_to_copy = count * SECTOR_SIZE;
-        memcpy(buff, virtual_disk + offset, bytes_to_copy);
+        res = write_sectors(dev, buff, bufs, sector, start, i - start, write_fn, writev_fn);
+        if (res == RES_OK) {
+            res = trim_fn(dev, sector + i, end - i);
+        }
+        if (res == RES_OK && dev->no_punch) {
+            res = write_sectors(dev, buff, bufs, sector, i, end - i, write_fn, writev_fn);
+        } else if (res == RES_OK) {
+            punched += end - i;
+        }
+        start = i = end;
+    }
+
+    if (res == RES_OK) {
+        res = write_sectors(dev, buff, bufs, sector, start, count - start, write_fn, writev_fn);
+    }
+    dev->stats.zero_sectors += punched;
+
+    /* The hole must be as durable as a written sector; only this backend
+       is synced, the layers over it sync themselves when their write ends */
+    if (res == RES_OK && punched && dev->sync_mode == DISK_SYNC_WRITE_THROUGH) {
+        res = sync_fn(dev);
+    }
+    return res;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Resolve the number of sectors on the disk                             */
+/*-----------------------------------------------------------------------*/
+static void resolve_disk_geometry(DISK_DEVICE* dev)
+{
+    struct stat st;
+
+    if (!dev->size_auto) {
+        return;
+    }
+
+    /* An existing image defines the disk size, otherwise use the default */
+    if (dev->backend != DISK_BACKEND_MEMORY &&
+        stat(dev->path, &st) == 0 && st.st_size >= dev->sector_size) {
+        dev->sector_count = (LBA_t)(st.st_size / dev->sector_size);
     } else {
-        return RES_ERROR;
+        dev->sector_count = (LBA_t)(DEFAULT_DISK_SIZE / dev->sector_size);
     }
-    
-    return RES_OK;
 }
 
 /*-----------------------------------------------------------------------*/
-/* Write Sector(s)                                                      */
+/* Give the image its full size without writing any sectors              */
 /*-----------------------------------------------------------------------*/
-#if FF_FS_READONLY == 0
-DRESULT disk_write (
-    BYTE pdrv,            /* Physical drive number to identify the drive */
-    const BYTE *buff,    /* Data to be written */
-    LBA_t sector,        /* Start sector in LBA */
-    UINT count            /* Number of sectors to write */
-)
+static int size_disk_image(DISK_DEVICE* dev, int fd)
 {
-    if (pdrv != 0 || !disk_initialized) {
-        return RES_PARERR;
+    struct stat st;
+    QWORD size = (QWORD)dev->sector_count * dev->sector_size;
+
+    if (fstat(fd, &st) != 0) {
+        return 0;
     }
-    
-    if (sector >= TOTAL_SECTORS || (sector + count) > TOTAL_SECTORS) {
-        return RES_PARERR;
+
+#if defined(__linux__) || defined(__FreeBSD__)
+    if (dev->preallocate) {
+        /* Reserve every block now so later writes cannot run out of space */
+        return posix_fallocate(fd, 0, (off_t)size) == 0;
     }
-    
-    if (use_file_backend && disk_file) {
-        /* File-based backend */
-        if (fseek(disk_file, sector * SECTOR_SIZE, SEEK_SET) != 0) {
-            return RES_ERROR;
+#endif
+
+    if ((QWORD)st.st_size >= size) {
+        return 1;
+    }
+
+    /* Extending the file leaves a hole that reads back as zeros */
+#ifdef _WIN32
+    return _chsize_s(fd, (__int64)size) == 0;
+#else
+    return ftruncate(fd, (off_t)size) == 0;
+#endif
+}
+
+/*-----------------------------------------------------------------------*/
+/* Memory backend                                                        */
+/*-----------------------------------------------------------------------*/
+static int mem_open(DISK_DEVICE* dev)
+{
+    size_t size = (size_t)dev->sector_count * dev->sector_size;
+
+#ifdef DISK_HAVE_MMAP
+    /* Anonymous mappings are zero filled on first touch and can use huge pages */
+    if (dev->mem_huge) {
+        void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        /* Needs pages reserved in /proc/sys/vm/nr_hugepages */
+        if (size % RAMDISK_HUGE_PAGE == 0) {
+            p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            dev->mem_kind = RAMDISK_HUGETLB;
         }
-        
-        size_t bytes_to_write = count * SECTOR_SIZE;
-        size_t bytes_written = fwrite(buff, 1, bytes_to_write, disk_file);
-        
-        if (bytes_written != bytes_to_write) {
-            return RES_ERROR;
+#endif
+        if (p == MAP_FAILED) {
+            p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            dev->mem_kind = RAMDISK_MAPPED;
+#ifdef MADV_HUGEPAGE
+            if (p != MAP_FAILED) {
+                madvise(p, size, MADV_HUGEPAGE);
+            }
+#endif
+        }
+        if (p != MAP_FAILED) {
+            dev->mem = (BYTE*)p;
+            return 1;
         }
-        
-        fflush(disk_file); /* Ensure data is written */
-    } else if (virtual_disk) {
-        /* Memory-based backend */
-        size_t offset = sector * SECTOR_SIZE;
-        size_t bytes_to_copy = count * SECTOR_SIZE;
-        memcpy(virtual_disk + offset, buff, bytes_to_copy);
-    } else {
-        return RES_ERROR;
     }
-    
+#endif
+
+    dev->mem_kind = RAMDISK_HEAP;
+    dev->mem = (BYTE*)calloc(size, 1);
+    return dev->mem != NULL;
+}
+
+static void mem_close(DISK_DEVICE* dev)
+{
+#ifdef DISK_HAVE_MMAP
+    if (dev->mem_kind != RAMDISK_HEAP) {
+        munmap(dev->mem, (size_t)dev->sector_count * dev->sector_size);
+        dev->mem = NULL;
+        return;
+    }
+#endif
+    free(dev->mem);
+    dev->mem = NULL;
+}
+
+static DRESULT mem_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count)
+{
+    memcpy(buff, dev->mem + (size_t)sector * dev->sector_size, (size_t)count * dev->sector_size);
+    return RES_OK;
+}
+
+static DRESULT mem_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    memcpy(dev->mem + (size_t)sector * dev->sector_size, buff, (size_t)count * dev->sector_size);
+    return RES_OK;
+}
+
+static DRESULT mem_sync(DISK_DEVICE* dev)
+{
+    (void)dev;
     return RES_OK;
 }
+
+static DRESULT mem_trim(DISK_DEVICE* dev, LBA_t sector, LBA_t count)
+{
+#ifdef DISK_HAVE_MMAP
+    /* Mapped RAM disks hand whole pages back, heap buffers keep their memory */
+    if (dev->mem_kind != RAMDISK_HEAP) {
+        size_t page = dev->mem_kind == RAMDISK_HUGETLB ? RAMDISK_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = ((size_t)sector * dev->sector_size + page - 1) / page * page;
+        size_t end = (size_t)(sector + count) * dev->sector_size / page * page;
+
+        if (start < end && madvise(dev->mem + start, end - start, MADV_DONTNEED) != 0) {
+            return RES_ERROR;
+        }
+    }
+#else
+    (void)dev;
+    (void)sector;
+    (void)count;
 #endif
+    return RES_OK;
+}
+
+static const DISK_OPS mem_ops = {
+    mem_open, mem_close, mem_read, mem_write, mem_sync, NULL, NULL, NULL, mem_trim
+};
 
 /*-----------------------------------------------------------------------*/
-/* Miscellaneous Functions                                               */
+/* stdio file backend                                                    */
 /*-----------------------------------------------------------------------*/
-DRESULT disk_ioctl (
-    BYTE pdrv,        /* Physical drive number (0..) */
-    BYTE cmd,        /* Control code */
-    void *buff        /* Buffer to send/receive control data */
-)
+
+/* Push buffered file writes according to the durability policy */
+static int flush_disk_file(DISK_DEVICE* dev, int durable)
 {
-    if (pdrv != 0) {
-        return RES_PARERR;
+    if (fflush(dev->file) != 0) {
+        return 0;
     }
-    
-    switch (cmd) {
-    case CTRL_SYNC:
-        /* Complete pending write process */
-        if (use_file_backend && disk_file) {
-            fflush(disk_file);
+#ifndef _WIN32
+    if (durable && disk_datasync(fileno(dev->file)) != 0) {
+        return 0;
+    }
+#else
+    (void)durable;
+#endif
+    return 1;
+}
+
+static int file_open(DISK_DEVICE* dev)
+{
+    /* Try to open existing disk image */
+    dev->file = fopen(dev->path, "r+b");
+    if (!dev->file) {
+        /* Create new disk image */
+        dev->file = fopen(dev->path, "w+b");
+        if (!dev->file) {
+            return 0; /* Failed to create */
         }
-        return RES_OK;
-        
-    case GET_SECTOR_COUNT:
-        *(LBA_t*)buff = TOTAL_SECTORS;
-        return RES_OK;
-        
-    case GET_SECTOR_SIZE:
-        *(WORD*)buff = SECTOR_SIZE;
-        return RES_OK;
-        
-    case GET_BLOCK_SIZE:
-        *(DWORD*)buff = 1; /* Erase block size in sectors */
-        return RES_OK;
-        
-    default:
-        return RES_PARERR;
     }
+
+    /* Size new or short images sparsely instead of writing zero sectors */
+    if (!size_disk_image(dev, fileno(dev->file))) {
+        fclose(dev->file);
+        dev->file = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+static void file_close(DISK_DEVICE* dev)
+{
+    fclose(dev->file);
+    dev->file = NULL;
+}
+
+static DRESULT file_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count)
+{
+    if (disk_fseek(dev->file, (QWORD)sector * dev->sector_size) != 0) {
+        return RES_ERROR;
+    }
+
+    size_t bytes_to_read = (size_t)count * dev->sector_size;
+    size_t bytes_read = fread(buff, 1, bytes_to_read, dev->file);
+
+    return bytes_read == bytes_to_read ? RES_OK : RES_ERROR;
 }
 
-/*-----------------------------------------------------------------------*/
-/* Get current time for FatFs timestamps                                */
-/*-----------------------------------------------------------------------*/
-DWORD get_fattime (void)
+static DRESULT file_write_data(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
 {
-    /* Return current time in FAT format */
-    /* For simplicity, return a fixed timestamp */
-    /* Format: bit31:25=Year(0..127 from 1980), bit24:21=Month(1..12), bit20:16=Day(1..31) */
-    /*         bit15:11=Hour(0..23), bit10:5=Minute(0..59), bit4:0=Second/2(0..29) */
-    
-    /* Example: 2025-10-11 14:30:00 */
-    /* Year: 2025-1980=45, Month: 10, Day: 11, Hour: 14, Minute: 30, Second: 0 */
-    return ((DWORD)(45 << 25)) | ((DWORD)(10 << 21)) | ((DWORD)(11 << 16)) | 
-           ((DWORD)(14 << 11)) | ((DWORD)(30 << 5)) | ((DWORD)(0 >> 1));
+    if (disk_fseek(dev->file, (QWORD)sector * dev->sector_size) != 0) {
+        return RES_ERROR;
+    }
+
+    size_t bytes_to_write = (size_t)count * dev->sector_size;
+    size_t bytes_written = fwrite(buff, 1, bytes_to_write, dev->file);
+
+    if (bytes_written != bytes_to_write) {
+        return RES_ERROR;
+    }
+
+    /* Buffered data is pushed out on CTRL_SYNC unless writing through */
+    if (dev->sync_mode == DISK_SYNC_WRITE_THROUGH && !flush_disk_file(dev, 1)) {
+        return RES_ERROR;
+    }
+
+    return RES_OK;
+}
+
+static DRESULT file_sync(DISK_DEVICE* dev)
+{
+    return flush_disk_file(dev, dev->sync_mode != DISK_SYNC_NONE) ? RES_OK : RES_ERROR;
+}
+
+#ifdef POSIX_FADV_WILLNEED
+static void file_prefetch(DISK_DEVICE* dev, LBA_t sector, UINT count)
+{
+    /* Let the kernel start reading while FatFs consumes the current sectors */
+    posix_fadvise(fileno(dev->file), (off_t)sector * dev->sector_size,
+                  (off_t)count * dev->sector_size, POSIX_FADV_WILLNEED);
+}
+#else
+#define file_prefetch NULL
+#endif
+
+#ifndef _WIN32
+static DRESULT file_trim(DISK_DEVICE* dev, LBA_t sector, LBA_t count)
+{
+    /* Buffered writes into the range would land after the hole otherwise */
+    if (fflush(dev->file) != 0) {
+        return RES_ERROR;
+    }
+    return disk_punch_sectors(dev, fileno(dev->file), sector, count);
+}
+
+static DRESULT file_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    return write_sparse(dev, buff, NULL, sector, count, file_write_data, NULL, file_trim, file_sync);
 }
+#else
+#define file_trim NULL
+#define file_write file_write_data
+#endif
+
+static const DISK_OPS file_ops = {
+    file_open, file_close, file_read, file_write, file_sync, file_prefetch, NULL, NULL, file_trim
+};
 
+#ifndef _WIN32
 /*-----------------------------------------------------------------------*/
-/* Additional helper functions for Python integration                    */
+/* Open the disk image as a raw descriptor covering the whole disk       */
 /*-----------------------------------------------------------------------*/
-
-/* Function to format the virtual disk with FAT filesystem */
-int format_virtual_disk(void)
+static int open_disk_fd(DISK_DEVICE* dev)
 {
-    if (!disk_initialized) {
-        if (!init_virtual_disk()) {
-            return 0;
-        }
+    dev->fd = open(dev->path, O_RDWR | O_CREAT, 0644);
+    if (dev->fd < 0) {
+        return 0;
     }
-    
-    /* This would typically call f_mkfs, but that requires integration with FatFs */
-    /* For now, we'll rely on FatFs to handle the formatting when mounting */
+
+    /* Short images would fault (mmap) or short-read (pread), so grow them */
+    if (!size_disk_image(dev, dev->fd)) {
+        close(dev->fd);
+        dev->fd = -1;
+        return 0;
+    }
+
     return 1;
 }
 
-/* Function to get disk info */
-void get_disk_info(DWORD* total_sectors, DWORD* sector_size)
+static void close_disk_fd(DISK_DEVICE* dev)
 {
-    if (total_sectors) *total_sectors = TOTAL_SECTORS;
-    if (sector_size) *sector_size = SECTOR_SIZE;
+    close(dev->fd);
+    dev->fd = -1;
 }
+#endif
 
-/* Cleanup function to be called when Python module unloads */
-void cleanup_disk_resources(void)
+#ifdef DISK_HAVE_PREAD
+/*-----------------------------------------------------------------------*/
+/* Positional transfers that carry no shared file position               */
+/*-----------------------------------------------------------------------*/
+int disk_pread_full(int fd, BYTE* buff, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pread(fd, buff, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        buff += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 1;
+}
+
+int disk_pwrite_full(int fd, const BYTE* buff, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buff, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        buff += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Write the sectors of a drive out as a standalone sparse raw image     */
+/*-----------------------------------------------------------------------*/
+DRESULT disk_export_image(DISK_DEVICE* dev, const char* path,
+                          DRESULT (*read_fn)(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count))
+{
+    UINT ss = dev->sector_size;
+    UINT chunk = DISK_EXPORT_CHUNK / ss;
+    BYTE* buf = (BYTE*)malloc(DISK_EXPORT_CHUNK);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    DRESULT res = (buf && fd >= 0) ? RES_OK : RES_ERROR;
+
+    for (LBA_t s = 0; res == RES_OK && s < dev->sector_count; s += chunk) {
+        UINT n = dev->sector_count - s < chunk ? (UINT)(dev->sector_count - s) : chunk;
+        size_t len = (size_t)n * ss;
+
+        res = read_fn(dev, buf, s, n);
+
+        /* Zeroed chunks stay holes in the output */
+        if (res == RES_OK && !disk_is_zero(buf, len) && !disk_pwrite_full(fd, buf, len, (off_t)s * ss)) {
+            res = RES_ERROR;
+        }
+    }
+
+    if (res == RES_OK && ftruncate(fd, (off_t)dev->sector_count * ss) != 0) {
+        res = RES_ERROR;
+    }
+    if (fd >= 0 && close(fd) != 0) {
+        res = RES_ERROR;
+    }
+    free(buf);
+    return res;
+}
+
+/*-----------------------------------------------------------------------*/
+/* pread/pwrite backend                                                  */
+/*-----------------------------------------------------------------------*/
+static DRESULT pread_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count)
+{
+    off_t start = (off_t)sector * dev->sector_size;
+    off_t end = start + (off_t)count * dev->sector_size;
+    off_t offset = start;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    /* Holes of a large read are cleared here instead of transferred. The
+       seeks move the shared file position, which no backend transfer uses */
+    while (end - start >= SPARSE_READ_MIN && offset < end) {
+        off_t data = lseek(dev->fd, offset, SEEK_DATA);
+
+        if (data < 0 && errno != ENXIO) {
+            break;      /* No hole support, read the rest */
+        }
+        if (data < 0 || data > end) {
+            data = end; /* ENXIO: nothing but hole up to the end of the file */
+        }
+        if (data > offset) {
+            memset(buff + (offset - start), 0, (size_t)(data - offset));
+            dev->stats.hole_sectors += (QWORD)(data - offset) / dev->sector_size;
+            offset = data;
+            continue;
+        }
+
+        off_t hole = lseek(dev->fd, offset, SEEK_HOLE);
+        if (hole < 0 || hole > end) {
+            hole = end;
+        }
+        if (!disk_pread_full(dev->fd, buff + (offset - start), (size_t)(hole - offset), offset)) {
+            return RES_ERROR;
+        }
+        offset = hole;
+    }
+#endif
+
+    /* No shared file position, safe for concurrent callers */
+    if (offset < end && !disk_pread_full(dev->fd, buff + (offset - start), (size_t)(end - offset), offset)) {
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+static DRESULT pread_write_data(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    if (!disk_pwrite_full(dev->fd, buff, (size_t)count * dev->sector_size, (off_t)sector * dev->sector_size)) {
+        return RES_ERROR;
+    }
+    if (dev->sync_mode == DISK_SYNC_WRITE_THROUGH && disk_datasync(dev->fd) != 0) {
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+static DRESULT pread_sync(DISK_DEVICE* dev)
+{
+    /* pwrite has no user-space buffering, only durability is left */
+    if (dev->sync_mode != DISK_SYNC_NONE && disk_datasync(dev->fd) != 0) {
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+#ifdef DISK_HAVE_PWRITEV
+static int pwritev_full(int fd, struct iovec* iov, int iovcnt, off_t offset)
+{
+    while (iovcnt > 0) {
+        ssize_t n = pwritev(fd, iov, iovcnt, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        offset += n;
+
+        /* Skip the buffers written completely, then trim a partial one */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (BYTE*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 1;
+}
+
+static DRESULT pread_writev_data(DISK_DEVICE* dev, const BYTE* const* bufs, LBA_t sector, UINT count)
+{
+    struct iovec iov[DISK_IOV_BATCH];
+    off_t offset = (off_t)sector * dev->sector_size;
+
+    for (UINT i = 0; i < count; ) {
+        UINT n = count - i < DISK_IOV_BATCH ? count - i : DISK_IOV_BATCH;
+
+        for (UINT k = 0; k < n; k++) {
+            iov[k].iov_base = (void*)bufs[i + k];
+            iov[k].iov_len = dev->sector_size;
+        }
+        if (!pwritev_full(dev->fd, iov, (int)n, offset)) {
+            return RES_ERROR;
+        }
+        offset += (off_t)n * dev->sector_size;
+        i += n;
+    }
+    if (dev->sync_mode == DISK_SYNC_WRITE_THROUGH && disk_datasync(dev->fd) != 0) {
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+#endif
+
+#ifdef POSIX_FADV_WILLNEED
+static void pread_prefetch(DISK_DEVICE* dev, LBA_t sector, UINT count)
+{
+    posix_fadvise(dev->fd, (off_t)sector * dev->sector_size,
+                  (off_t)count * dev->sector_size, POSIX_FADV_WILLNEED);
+}
+#else
+#define pread_prefetch NULL
+#endif
+
+/* Also serves the mmap backend, the shared mapping sees the hole as zeros */
+static DRESULT pread_trim(DISK_DEVICE* dev, LBA_t sector, LBA_t count)
+{
+    return disk_punch_sectors(dev, dev->fd, sector, count);
+}
+
+static DRESULT pread_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    return write_sparse(dev, buff, NULL, sector, count, pread_write_data, NULL, pread_trim, pread_sync);
+}
+
+#ifdef DISK_HAVE_PWRITEV
+static DRESULT pread_writev(DISK_DEVICE* dev, const BYTE* const* bufs, LBA_t sector, UINT count)
+{
+    return write_sparse(dev, NULL, bufs, sector, count, NULL, pread_writev_data, pread_trim, pread_sync);
+}
+#else
+#define pread_writev NULL
+#endif
+
+static const DISK_OPS pread_ops = {
+    open_disk_fd, close_disk_fd, pread_read, pread_write, pread_sync, pread_prefetch, pread_writev, NULL, pread_trim
+};
+#endif
+
+#ifdef DISK_HAVE_IO_URING
+/*-----------------------------------------------------------------------*/
+/* io_uring backend, the engine lives in diskio_uring.c                  */
+/*-----------------------------------------------------------------------*/
+static int uring_open(DISK_DEVICE* dev)
+{
+    if (!open_disk_fd(dev)) {
+        return 0;
+    }
+    if (!uring_setup(dev)) {
+        close_disk_fd(dev);
+        return 0;
+    }
+    return 1;
+}
+
+static void uring_close(DISK_DEVICE* dev)
+{
+    uring_teardown(dev);
+    close_disk_fd(dev);
+}
+
+static DRESULT uring_sync(DISK_DEVICE* dev)
+{
+    if (uring_drain(dev) != RES_OK) {
+        return RES_ERROR;
+    }
+    return pread_sync(dev);
+}
+
+static DRESULT uring_write_sparse(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    return write_sparse(dev, buff, NULL, sector, count, uring_write, NULL, uring_trim, pread_sync);
+}
+
+static DRESULT uring_writev_sparse(DISK_DEVICE* dev, const BYTE* const* bufs, LBA_t sector, UINT count)
+{
+    return write_sparse(dev, NULL, bufs, sector, count, NULL, uring_writev, uring_trim, pread_sync);
+}
+
+static const DISK_OPS uring_ops = {
+    uring_open, uring_close, uring_read, uring_write_sparse, uring_sync, uring_prefetch, uring_writev_sparse,
+    uring_drain, uring_trim
+};
+#endif
+
+#ifdef DISK_HAVE_DIRECT
+/*-----------------------------------------------------------------------*/
+/* O_DIRECT backend, transfers bypass the host page cache                */
+/*-----------------------------------------------------------------------*/
+static void direct_alignment(DISK_DEVICE* dev)
+{
+    dev->dio_align = DIRECT_ALIGN;
+    dev->dio_mem_align = DIRECT_ALIGN;
+#ifdef STATX_DIOALIGN
+    struct statx sx;
+
+    if (statx(dev->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &sx) == 0 &&
+        (sx.stx_mask & STATX_DIOALIGN) && sx.stx_dio_offset_align) {
+        dev->dio_align = sx.stx_dio_offset_align;
+        dev->dio_mem_align = sx.stx_dio_mem_align ? sx.stx_dio_mem_align : 1;
+    }
+#endif
+}
+
+static int direct_open(DISK_DEVICE* dev)
+{
+    size_t align;
+
+    /* Size the image through the page cache, then switch the descriptor over */
+    if (!open_disk_fd(dev)) {
+        return 0;
+    }
+    direct_alignment(dev);
+    align = dev->dio_align > DIRECT_ALIGN ? dev->dio_align : DIRECT_ALIGN;
+
+    /* Blocks past the end of the image cannot be transferred directly */
+    if ((QWORD)dev->sector_count * dev->sector_size % dev->dio_align != 0 ||
+        fcntl(dev->fd, F_SETFL, fcntl(dev->fd, F_GETFL) | O_DIRECT) != 0) {
+        close_disk_fd(dev);
+        return 0;
+    }
+
+    dev->dio_buf_size = (DIRECT_BOUNCE + dev->dio_align - 1) / dev->dio_align * dev->dio_align;
+    if (posix_memalign((void**)&dev->dio_buf, align, dev->dio_buf_size) != 0) {
+        dev->dio_buf = NULL;
+        close_disk_fd(dev);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void direct_close(DISK_DEVICE* dev)
+{
+    free(dev->dio_buf);
+    dev->dio_buf = NULL;
+    close_disk_fd(dev);
+}
+
+static int direct_aligned(DISK_DEVICE* dev, const BYTE* buff, off_t offset, size_t len)
+{
+    return (uintptr_t)buff % dev->dio_mem_align == 0 &&
+           offset % dev->dio_align == 0 && len % dev->dio_align == 0;
+}
+
+/* Move an unaligned transfer through the bounce buffer, block by block */
+static int direct_bounce(DISK_DEVICE* dev, BYTE* buff, off_t offset, size_t len, int write)
+{
+    size_t a = dev->dio_align;
+    off_t pos = offset - offset % (off_t)a;
+    off_t end = offset + (off_t)len;
+
+    while (pos < end) {
+        size_t n = (size_t)(end - pos);
+        if (n > dev->dio_buf_size) {
+            n = dev->dio_buf_size;
+        }
+        n = (n + a - 1) / a * a;
+
+        off_t lo = pos > offset ? pos : offset;
+        off_t hi = pos + (off_t)n < end ? pos + (off_t)n : end;
+        BYTE* p = dev->dio_buf + (lo - pos);
+
+        if (!write) {
+            if (!disk_pread_full(dev->fd, dev->dio_buf, n, pos)) {
+                return 0;
+            }
+            memcpy(buff + (lo - offset), p, (size_t)(hi - lo));
+        } else {
+            /* Fill the partly written head and tail blocks from the image */
+            if (lo > pos && !disk_pread_full(dev->fd, dev->dio_buf, a, pos)) {
+                return 0;
+            }
+            if (hi < pos + (off_t)n && !disk_pread_full(dev->fd, dev->dio_buf + n - a, a, pos + (off_t)n - (off_t)a)) {
+                return 0;
+            }
+            memcpy(p, buff + (lo - offset), (size_t)(hi - lo));
+            if (!disk_pwrite_full(dev->fd, dev->dio_buf, n, pos)) {
+                return 0;
+            }
+        }
+        pos += (off_t)n;
+    }
+    return 1;
+}
+
+static DRESULT direct_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count)
+{
+    off_t offset = (off_t)sector * dev->sector_size;
+    size_t len = (size_t)count * dev->sector_size;
+    int ok;
+
+    if (direct_aligned(dev, buff, offset, len)) {
+        ok = disk_pread_full(dev->fd, buff, len, offset);
+    } else {
+        ok = direct_bounce(dev, buff, offset, len, 0);
+    }
+    return ok ? RES_OK : RES_ERROR;
+}
+
+static DRESULT direct_write_data(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    off_t offset = (off_t)sector * dev->sector_size;
+    size_t len = (size_t)count * dev->sector_size;
+    int ok;
+
+    if (direct_aligned(dev, buff, offset, len)) {
+        ok = disk_pwrite_full(dev->fd, buff, len, offset);
+    } else {
+        ok = direct_bounce(dev, (BYTE*)buff, offset, len, 1);
+    }
+    if (!ok) {
+        return RES_ERROR;
+    }
+    /* O_DIRECT skips the page cache but not the drive's write cache */
+    if (dev->sync_mode == DISK_SYNC_WRITE_THROUGH && disk_datasync(dev->fd) != 0) {
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+static DRESULT direct_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    return write_sparse(dev, buff, NULL, sector, count, direct_write_data, NULL, pread_trim, pread_sync);
+}
+
+static const DISK_OPS direct_ops = {
+    direct_open, direct_close, direct_read, direct_write, pread_sync, NULL, NULL, NULL, pread_trim
+};
+#endif
+
+#ifdef DISK_HAVE_MMAP
+/*-----------------------------------------------------------------------*/
+/* Memory-mapped backend                                                 */
+/*-----------------------------------------------------------------------*/
+static int mmap_open(DISK_DEVICE* dev)
+{
+    size_t size = (size_t)dev->sector_count * dev->sector_size;
+
+    if (!open_disk_fd(dev)) {
+        return 0;
+    }
+
+    dev->map = (BYTE*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if (dev->map == MAP_FAILED) {
+        dev->map = NULL;
+        close_disk_fd(dev);
+        return 0;
+    }
+
+    dev->map_size = size;
+    return 1;
+}
+
+static void mmap_close(DISK_DEVICE* dev)
+{
+    msync(dev->map, dev->map_size, MS_SYNC);
+    munmap(dev->map, dev->map_size);
+    dev->map = NULL;
+    dev->map_size = 0;
+    close_disk_fd(dev);
+}
+
+static DRESULT mmap_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count)
+{
+    memcpy(buff, dev->map + (size_t)sector * dev->sector_size, (size_t)count * dev->sector_size);
+    return RES_OK;
+}
+
+static DRESULT mmap_write_data(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    memcpy(dev->map + (size_t)sector * dev->sector_size, buff, (size_t)count * dev->sector_size);
+    if (dev->sync_mode == DISK_SYNC_WRITE_THROUGH) {
+        /* msync needs a page aligned start address */
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = ((size_t)sector * dev->sector_size) & ~(page - 1);
+        size_t end = (size_t)(sector + count) * dev->sector_size;
+        if (msync(dev->map + start, end - start, MS_SYNC) != 0) {
+            return RES_ERROR;
+        }
+    }
+    return RES_OK;
+}
+
+static DRESULT mmap_sync(DISK_DEVICE* dev)
+{
+    int flags = dev->sync_mode == DISK_SYNC_NONE ? MS_ASYNC : MS_SYNC;
+    return msync(dev->map, dev->map_size, flags) == 0 ? RES_OK : RES_ERROR;
+}
+
+static void mmap_prefetch(DISK_DEVICE* dev, LBA_t sector, UINT count)
+{
+    /* madvise needs a page aligned start address */
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = ((size_t)sector * dev->sector_size) & ~(page - 1);
+    size_t end = (size_t)(sector + count) * dev->sector_size;
+
+    madvise(dev->map + start, end - start, MADV_WILLNEED);
+}
+
+/* Zeros copied into the mapping would allocate the pages they fill */
+static DRESULT mmap_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count)
+{
+    return write_sparse(dev, buff, NULL, sector, count, mmap_write_data, NULL, pread_trim, pread_sync);
+}
+
+static const DISK_OPS mmap_ops = {
+    mmap_open, mmap_close, mmap_read, mmap_write, mmap_sync, mmap_prefetch, NULL, NULL, pread_trim
+};
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* Backend table                                                         */
+/*-----------------------------------------------------------------------*/
+static const DISK_OPS* backend_ops(int backend)
+{
+    switch (backend) {
+    case DISK_BACKEND_MEMORY:
+        return &mem_ops;
+    case DISK_BACKEND_FILE:
+        return &file_ops;
+#ifdef DISK_HAVE_MMAP
+    case DISK_BACKEND_MMAP:
+        return &mmap_ops;
+#endif
+#ifdef DISK_HAVE_PREAD
+    case DISK_BACKEND_PREAD:
+        return &pread_ops;
+#endif
+#if defined(DISK_HAVE_IO_URING)
+    case DISK_BACKEND_URING:
+        return &uring_ops;
+#elif defined(DISK_HAVE_PREAD)
+    case DISK_BACKEND_URING:
+        return &pread_ops;      /* Built without io_uring */
+#endif
+#if defined(DISK_HAVE_DIRECT)
+    case DISK_BACKEND_DIRECT:
+        return &direct_ops;
+#elif defined(DISK_HAVE_PREAD)
+    case DISK_BACKEND_DIRECT:
+        return &pread_ops;      /* Platform without O_DIRECT */
+#endif
+    default:
+        return NULL;
+    }
+}
+
+/* Backend to use when the optional kernel features of ops are missing */
+static const DISK_OPS* fallback_ops(const DISK_OPS* ops)
+{
+#ifdef DISK_HAVE_IO_URING
+    if (ops == &uring_ops) {
+        return &pread_ops;
+    }
+#endif
+#ifdef DISK_HAVE_DIRECT
+    if (ops == &direct_ops) {
+        return &pread_ops;
+    }
+#endif
+    (void)ops;
+    return NULL;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Prefetch ahead of sequential read streams                             */
+/*-----------------------------------------------------------------------*/
+static void stream_readahead(DISK_DEVICE* dev, LBA_t sector, UINT count)
+{
+    DISK_READAHEAD* ra = &dev->ra;
+    UINT limit = ra->max_window;
+    LBA_t end;
+
+    if (limit == 0) {
+        return;
+    }
+
+    if (sector != ra->next) {
+        /* A lone FAT or directory sector read does not end the stream */
+        if (ra->window && ++ra->strays < 2) {
+            return;
+        }
+        ra->window = 0;
+        ra->strays = 0;
+        ra->next = sector + count;
+        ra->ahead = ra->next;
+        return;
+    }
+
+    /* The stream continues: start small and double the window up to the limit */
+    ra->strays = 0;
+    ra->next = sector + count;
+    ra->window = ra->window ? ra->window * 2 : (count * 4 > 8 ? count * 4 : 8);
+    if (dev->cache.capacity && limit > dev->cache.capacity / 2) {
+        limit = dev->cache.capacity / 2;    /* Never evict the prefetched window itself */
+    }
+    if (ra->window > limit) {
+        ra->window = limit;
+    }
+    if (ra->ahead < ra->next) {
+        ra->ahead = ra->next;
+    }
+
+    /* Refill once less than half a window is left ahead of the reader */
+    if (ra->window == 0 || ra->ahead - ra->next > ra->window / 2) {
+        return;
+    }
+    end = ra->next + ra->window;
+    if (end > dev->sector_count) {
+        end = dev->sector_count;
+    }
+    if (end <= ra->ahead) {
+        return;
+    }
+
+    /* A failed prefetch only costs the later read, so errors are ignored */
+    if (dev->cache.capacity) {
+        cache_prefetch(dev, ra->ahead, (UINT)(end - ra->ahead));
+    } else if (dev->ops->prefetch) {
+        dev->ops->prefetch(dev, ra->ahead, (UINT)(end - ra->ahead));
+    }
+    dev->stats.readahead_sectors += end - ra->ahead;
+    ra->ahead = end;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Initialize virtual disk storage                                       */
+/*-----------------------------------------------------------------------*/
+static int init_virtual_disk(DISK_DEVICE* dev)
+{
+    if (dev->initialized) {
+        return 1;
+    }
+
+    resolve_disk_geometry(dev);
+    dev->no_punch = 0;  /* Learned again from the host holding the image */
+
+    if (!dev->ops->open(dev)) {
+        /* Kernel without io_uring, or a file system without O_DIRECT */
+        const DISK_OPS* fallback = fallback_ops(dev->ops);
+
+        if (!fallback || !fallback->open(dev)) {
+            return 0;
+        }
+        dev->ops = fallback;
+    }
+    throttle_install(dev);
+
+    if (!cache_init(dev)) {
+        dev->ops->close(dev);
+        return 0;
+    }
+
+    dev->ra.window = 0;
+    dev->ra.next = dev->ra.ahead = 0;
+    dev->ra.strays = 0;
+
+    dev->initialized = 1;
+    return 1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Cleanup disk storage                                                  */
+/*-----------------------------------------------------------------------*/
+static void close_virtual_disk(DISK_DEVICE* dev)
+{
+    if (dev->initialized) {
+        cache_release(dev);
+        dev->ops->close(dev);
+    }
+
+    dev->initialized = 0;
+}
+
+/* Dirty cached sectors must reach the image first; when they cannot, the
+   drive stays open with its cache so nothing is lost */
+static DRESULT cleanup_virtual_disk(DISK_DEVICE* dev)
+{
+    if (dev->initialized && cache_flush(dev) != RES_OK) {
+        return RES_ERROR;
+    }
+
+    close_virtual_disk(dev);
+    return RES_OK;
+}
+
+/* Only a drive opened read-only on a block server refuses writes */
+static int is_read_only(const DISK_DEVICE* dev)
+{
+    return dev->backend == DISK_BACKEND_REMOTE && dev->read_only;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Get Drive Status                                                      */
+/*-----------------------------------------------------------------------*/
+DSTATUS disk_status (
+    BYTE pdrv        /* Physical drive number to identify the drive */
+)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !dev->initialized) {
+        return STA_NOINIT;
+    }
+
+    return is_read_only(dev) ? STA_PROTECT : 0;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Initialize a Drive                                                    */
+/*-----------------------------------------------------------------------*/
+DSTATUS disk_initialize (
+    BYTE pdrv                /* Physical drive number to identify the drive */
+)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !init_virtual_disk(dev)) {
+        return STA_NOINIT; /* Failed to initialize */
+    }
+
+    return is_read_only(dev) ? STA_PROTECT : 0; /* Success */
+}
+
+/*-----------------------------------------------------------------------*/
+/* Read Sector(s)                                                       */
+/*-----------------------------------------------------------------------*/
+DRESULT disk_read (
+    BYTE pdrv,        /* Physical drive number to identify the drive */
+    BYTE *buff,        /* Data buffer to store read data */
+    LBA_t sector,    /* Start sector in LBA */
+    UINT count        /* Number of sectors to read */
+)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !dev->initialized) {
+        return RES_PARERR;
+    }
+
+    if (sector >= dev->sector_count || count > dev->sector_count - sector) {
+        return RES_PARERR;
+    }
+
+    dev->stats.reads++;
+    dev->stats.sectors_read += count;
+
+    DRESULT res;
+    if (dev->cache.capacity) {
+        res = cache_read(dev, buff, sector, count);
+    } else {
+        res = dev->ops->read(dev, buff, sector, count);
+    }
+
+    if (res == RES_OK) {
+        stream_readahead(dev, sector, count);
+    }
+    return res;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Write Sector(s)                                                      */
+/*-----------------------------------------------------------------------*/
+#if FF_FS_READONLY == 0
+DRESULT disk_write (
+    BYTE pdrv,            /* Physical drive number to identify the drive */
+    const BYTE *buff,    /* Data to be written */
+    LBA_t sector,        /* Start sector in LBA */
+    UINT count            /* Number of sectors to write */
+)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !dev->initialized) {
+        return RES_PARERR;
+    }
+
+    if (sector >= dev->sector_count || count > dev->sector_count - sector) {
+        return RES_PARERR;
+    }
+    if (is_read_only(dev)) {
+        return RES_WRPRT;
+    }
+
+    dev->stats.writes++;
+    dev->stats.sectors_written += count;
+
+    if (dev->cache.capacity) {
+        return cache_write(dev, buff, sector, count);
+    }
+    return dev->ops->write(dev, buff, sector, count);
+}
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* Discard a sector range                                                */
+/*-----------------------------------------------------------------------*/
+static DRESULT trim_sectors(DISK_DEVICE* dev, LBA_t sector, LBA_t count)
+{
+    /* Dirty copies of discarded sectors need not reach the backend */
+    cache_discard(dev, sector, count);
+
+    /* A preallocated image keeps its host blocks */
+    if (!dev->ops->trim || dev->preallocate) {
+        return RES_OK;
+    }
+
+    DRESULT res = dev->ops->trim(dev, sector, count);
+    if (res == RES_OK) {
+        dev->stats.trimmed_sectors += count;
+    }
+    return res;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Miscellaneous Functions                                               */
+/*-----------------------------------------------------------------------*/
+DRESULT disk_ioctl (
+    BYTE pdrv,        /* Physical drive number (0..) */
+    BYTE cmd,        /* Control code */
+    void *buff        /* Buffer to send/receive control data */
+)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev) {
+        return RES_PARERR;
+    }
+
+    switch (cmd) {
+    case CTRL_SYNC:
+        /* Complete pending write process */
+        if (!dev->initialized) {
+            return RES_NOTRDY;
+        }
+        dev->stats.syncs++;
+        if (cache_flush(dev) != RES_OK) {
+            return RES_ERROR;
+        }
+        return dev->ops->sync(dev);
+
+    case CTRL_TRIM:
+        /* Sectors buff[0] to buff[1] no longer hold data */
+        if (!dev->initialized) {
+            return RES_NOTRDY;
+        }
+        if (((LBA_t*)buff)[1] < ((LBA_t*)buff)[0] || ((LBA_t*)buff)[1] >= dev->sector_count) {
+            return RES_PARERR;
+        }
+        return trim_sectors(dev, ((LBA_t*)buff)[0], ((LBA_t*)buff)[1] - ((LBA_t*)buff)[0] + 1);
+
+    case GET_SECTOR_COUNT:
+        *(LBA_t*)buff = dev->sector_count;
+        return RES_OK;
+
+    case GET_SECTOR_SIZE:
+        *(WORD*)buff = dev->sector_size;
+        return RES_OK;
+
+    case GET_BLOCK_SIZE:
+        /* f_mkfs aligns the data area to it, so clusters fill whole host
+           blocks and zeroed ones can be punched out, or whole emulated
+           erase blocks */
+        if (dev->throttle_on && dev->throttle.erase_block > dev->sector_size) {
+            *(DWORD*)buff = dev->throttle.erase_block / dev->sector_size;
+        } else {
+            *(DWORD*)buff = dev->sector_size < DISK_SPARSE_BLOCK ? DISK_SPARSE_BLOCK / dev->sector_size : 1;
+        }
+        return RES_OK;
+
+    default:
+        return RES_PARERR;
+    }
+}
+
+/*-----------------------------------------------------------------------*/
+/* Get current time for FatFs timestamps                                */
+/*-----------------------------------------------------------------------*/
+DWORD get_fattime (void)
+{
+    /* Return current time in FAT format */
+    /* For simplicity, return a fixed timestamp */
+    /* Format: bit31:25=Year(0..127 from 1980), bit24:21=Month(1..12), bit20:16=Day(1..31) */
+    /*         bit15:11=Hour(0..23), bit10:5=Minute(0..59), bit4:0=Second/2(0..29) */
+
+    /* Example: 2025-10-11 14:30:00 */
+    /* Year: 2025-1980=45, Month: 10, Day: 11, Hour: 14, Minute: 30, Second: 0 */
+    return ((DWORD)(45 << 25)) | ((DWORD)(10 << 21)) | ((DWORD)(11 << 16)) |
+           ((DWORD)(14 << 11)) | ((DWORD)(30 << 5)) | ((DWORD)(0 >> 1));
+}
+
+/*-----------------------------------------------------------------------*/
+/* Additional helper functions for Python integration                    */
+/*-----------------------------------------------------------------------*/
+
+/* Function to format the virtual disk with FAT filesystem */
+int format_virtual_disk(BYTE pdrv)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !init_virtual_disk(dev)) {
+        return 0;
+    }
+
+    /* This would typically call f_mkfs, but that requires integration with FatFs */
+    /* For now, we'll rely on FatFs to handle the formatting when mounting */
+    return 1;
+}
+
+/* Function to get disk info */
+void get_disk_info(BYTE pdrv, DWORD* total_sectors, DWORD* sector_size)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev) {
+        if (total_sectors) *total_sectors = 0;
+        if (sector_size) *sector_size = 0;
+        return;
+    }
+
+    if (!dev->initialized) {
+        resolve_disk_geometry(dev);
+    }
+    if (total_sectors) *total_sectors = dev->sector_count;
+    if (sector_size) *sector_size = dev->sector_size;
+}
+
+/* Function to select the backing store; takes effect on the next mount */
+DRESULT set_disk_backend(BYTE pdrv, int backend)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+    const DISK_OPS* ops = backend_ops(backend);
+
+    if (!dev || !ops) {
+        return RES_PARERR;
+    }
+
+    if (cleanup_virtual_disk(dev) != RES_OK) {
+        return RES_ERROR;
+    }
+    dev->backend = backend;
+    dev->ops = ops;
+    return RES_OK;
+}
+
+/* Function to select the write durability policy */
+int set_disk_sync_mode(BYTE pdrv, int mode)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || mode < DISK_SYNC_NONE || mode > DISK_SYNC_WRITE_THROUGH) {
+        return 0;
+    }
+
+    dev->sync_mode = mode;
+    return 1;
+}
+
+/* Function to attach the disk to an image file with the given geometry */
+DRESULT open_disk_image(BYTE pdrv, const char* path, QWORD size, UINT sector_size, int preallocate)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !path || !path[0] || strlen(path) >= DISK_PATH_MAX) {
+        return RES_PARERR;
+    }
+
+    if (sector_size < FF_MIN_SS || sector_size > FF_MAX_SS ||
+        (sector_size & (sector_size - 1)) != 0) {
+        return RES_PARERR;
+    }
+
+    /* size == 0 takes the size from an existing image */
+    if (size != 0 && (size < sector_size || size / sector_size > (LBA_t)-1)) {
+        return RES_PARERR;
+    }
+
+    if (cleanup_virtual_disk(dev) != RES_OK) {
+        return RES_ERROR;
+    }
+
+    /* RAM disks, overlays, compressed images and block servers are not plain images, go back to the default backend */
+    if (dev->backend == DISK_BACKEND_MEMORY || dev->backend == DISK_BACKEND_OVERLAY ||
+        dev->backend == DISK_BACKEND_COMPRESSED || dev->backend == DISK_BACKEND_REMOTE) {
+        dev->backend = DISK_BACKEND_FILE;
+        dev->ops = backend_ops(dev->backend);
+    }
+
+    strcpy(dev->path, path);
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    dev->sector_size = (WORD)sector_size;
+    dev->size_auto = (size == 0);
+    dev->preallocate = preallocate;
+    if (!dev->size_auto) {
+        dev->sector_count = (LBA_t)(size / sector_size);
+    }
+
+    return init_virtual_disk(dev) ? RES_OK : RES_NOTRDY;
+}
+
+/*-----------------------------------------------------------------------*/
+/* RAM disk loaded from and dumped to image files in bulk                */
+/*-----------------------------------------------------------------------*/
+static int load_ram_image(DISK_DEVICE* dev, const char* image)
+{
+    size_t size = (size_t)dev->sector_count * dev->sector_size;
+    size_t done = 0;
+    FILE* f = fopen(image, "rb");
+
+    if (!f) {
+        return 0;
+    }
+
+    /* A shorter image leaves the rest of the disk zeroed */
+    while (done < size) {
+        size_t n = size - done < RAMDISK_IO_CHUNK ? size - done : RAMDISK_IO_CHUNK;
+        size_t got = fread(dev->mem + done, 1, n, f);
+
+        done += got;
+        if (got < n) {
+            break;
+        }
+    }
+
+    int ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+/* Function to attach a drive to a RAM disk, optionally loaded from an image */
+DRESULT open_ram_disk(BYTE pdrv, QWORD size, UINT sector_size, const char* image, int huge_pages)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+    struct stat st;
+
+    if (!dev || sector_size < FF_MIN_SS || sector_size > FF_MAX_SS ||
+        (sector_size & (sector_size - 1)) != 0) {
+        return RES_PARERR;
+    }
+
+    /* size == 0 takes the size of the image, or the default without one */
+    if (size == 0) {
+        if (image && stat(image, &st) == 0) {
+            size = (QWORD)st.st_size;
+        } else if (!image) {
+            size = DEFAULT_DISK_SIZE;
+        } else {
+            return RES_NOTRDY;
+        }
+    }
+    if (size < sector_size || size / sector_size > (LBA_t)-1 || size > (size_t)-1) {
+        return RES_PARERR;
+    }
+
+    if (cleanup_virtual_disk(dev) != RES_OK) {
+        return RES_ERROR;
+    }
+
+    dev->backend = DISK_BACKEND_MEMORY;
+    dev->ops = &mem_ops;
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    dev->sector_size = (WORD)sector_size;
+    dev->sector_count = (LBA_t)(size / sector_size);
+    dev->size_auto = 0;
+    dev->mem_huge = huge_pages;
+
+    if (!init_virtual_disk(dev)) {
+        return RES_NOTRDY;
+    }
+    if (image && !load_ram_image(dev, image)) {
+        close_virtual_disk(dev);
+        return RES_NOTRDY;
+    }
+    return RES_OK;
+}
+
+/* Function to write a RAM disk to an image file, leaving zeroed blocks sparse */
+DRESULT dump_ram_disk(BYTE pdrv, const char* path)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !path || dev->backend != DISK_BACKEND_MEMORY) {
+        return RES_PARERR;
+    }
+    if (!dev->initialized) {
+        return RES_NOTRDY;
+    }
+    if (cache_flush(dev) != RES_OK) {
+        return RES_ERROR;
+    }
+
+    FILE* f = fopen(path, "wb");
+    size_t size = (size_t)dev->sector_count * dev->sector_size;
+    int ok = f != NULL;
+
+    for (size_t done = 0; ok && done < size; ) {
+        size_t n = size - done < RAMDISK_IO_CHUNK ? size - done : RAMDISK_IO_CHUNK;
+
+        /* The last block is always written so the file gets its full size */
+        if (done + n == size || !disk_is_zero(dev->mem + done, n)) {
+            ok = disk_fseek(f, done) == 0 && fwrite(dev->mem + done, 1, n, f) == n;
+        }
+        done += n;
+    }
+
+    if (f && fclose(f) != 0) {
+        ok = 0;
+    }
+    return ok ? RES_OK : RES_ERROR;
+}
+
+/* Function to attach a drive to a copy-on-write overlay; a new delta is
+   created over base, an existing one is reopened (base NULL: as recorded) */
+DRESULT open_overlay(BYTE pdrv, const char* base, const char* delta, UINT sector_size)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !delta || !delta[0] || strlen(delta) >= DISK_PATH_MAX ||
+        (base && strlen(base) >= DISK_PATH_MAX)) {
+        return RES_PARERR;
+    }
+    if (sector_size < FF_MIN_SS || sector_size > FF_MAX_SS ||
+        (sector_size & (sector_size - 1)) != 0) {
+        return RES_PARERR;
+    }
+#ifdef _WIN32
+    return RES_NOTRDY;
+#else
+    if (cleanup_virtual_disk(dev) != RES_OK) {
+        return RES_ERROR;
+    }
+
+    dev->backend = DISK_BACKEND_OVERLAY;
+    dev->ops = &overlay_ops;
+    strcpy(dev->path, delta);
+    strcpy(dev->base_path, base ? base : "");
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    dev->sector_size = (WORD)sector_size;     /* A reopened delta keeps its own */
+    dev->size_auto = 0;
+
+    return init_virtual_disk(dev) ? RES_OK : RES_NOTRDY;
+#endif
+}
+
+/* Function to merge an overlay drive into a standalone image */
+DRESULT flatten_overlay(BYTE pdrv, const char* path)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !path || !path[0] || dev->backend != DISK_BACKEND_OVERLAY) {
+        return RES_PARERR;
+    }
+    if (!dev->initialized) {
+        return RES_NOTRDY;
+    }
+    if (cache_flush(dev) != RES_OK) {
+        return RES_ERROR;
+    }
+
+    return overlay_flatten(dev, path);
+}
+
+/* Function to attach a drive to a compressed image; a new image is created
+   empty or from a raw image, an existing one is reopened with its geometry */
+DRESULT open_compressed(BYTE pdrv, const char* path, QWORD size, UINT sector_size, UINT block_size, const char* image)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+    struct stat st;
+
+    if (!dev || !path || !path[0] || strlen(path) >= DISK_PATH_MAX) {
+        return RES_PARERR;
+    }
+    if (sector_size < FF_MIN_SS || sector_size > FF_MAX_SS ||
+        (sector_size & (sector_size - 1)) != 0 ||
+        block_size < sector_size || (block_size & (block_size - 1)) != 0) {
+        return RES_PARERR;
+    }
+#ifdef _WIN32
+    return RES_NOTRDY;
+#else
+    /* Importing fills a new image only */
+    int exists = stat(path, &st) == 0 && st.st_size > 0;
+    if (image && exists) {
+        return RES_PARERR;
+    }
+
+    /* size == 0 takes the size of the image, or the default without one */
+    if (size == 0) {
+        if (image && stat(image, &st) == 0) {
+            size = (QWORD)st.st_size;
+        } else if (!image) {
+            size = DEFAULT_DISK_SIZE;
+        } else {
+            return RES_NOTRDY;
+        }
+    }
+    if (size < sector_size || size / sector_size > (LBA_t)-1) {
+        return RES_PARERR;
+    }
+
+    if (cleanup_virtual_disk(dev) != RES_OK) {
+        return RES_ERROR;
+    }
+
+    dev->backend = DISK_BACKEND_COMPRESSED;
+    dev->ops = &compress_ops;
+    strcpy(dev->path, path);
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    dev->sector_size = (WORD)sector_size;     /* An existing image keeps its own */
+    dev->sector_count = (LBA_t)(size / sector_size);
+    dev->compress_block_size = block_size;
+    dev->size_auto = 0;
+
+    if (!init_virtual_disk(dev)) {
+        return RES_NOTRDY;
+    }
+    if (image && compress_import(dev, image) != RES_OK) {
+        close_virtual_disk(dev);
+        return RES_NOTRDY;
+    }
+    return RES_OK;
+#endif
+}
+
+/* Function to write a compressed drive to a sparse raw image */
+DRESULT export_compressed(BYTE pdrv, const char* path)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !path || !path[0] || dev->backend != DISK_BACKEND_COMPRESSED) {
+        return RES_PARERR;
+    }
+    if (!dev->initialized) {
+        return RES_NOTRDY;
+    }
+    if (cache_flush(dev) != RES_OK) {
+        return RES_ERROR;
+    }
+
+    return compress_export(dev, path);
+}
+
+/* Function to attach a drive to a block server; the server's image defines
+   the geometry, a writable drive is refused while another client writes */
+DRESULT open_remote(BYTE pdrv, const char* socket_path, int writable)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !socket_path || !socket_path[0] || strlen(socket_path) >= DISK_PATH_MAX) {
+        return RES_PARERR;
+    }
+#ifdef _WIN32
+    return RES_NOTRDY;
+#else
+    if (cleanup_virtual_disk(dev) != RES_OK) {
+        return RES_ERROR;
+    }
+
+    dev->backend = DISK_BACKEND_REMOTE;
+    dev->ops = &remote_ops;
+    strcpy(dev->path, socket_path);
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    dev->read_only = !writable;
+    dev->size_auto = 0;
+
+    return init_virtual_disk(dev) ? RES_OK : RES_NOTRDY;
+#endif
+}
+
+/* Function to serve a drive to other processes until idle returns nonzero */
+DRESULT serve_disk(BYTE pdrv, const char* socket_path, int (*idle)(void* arg), void* arg)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !socket_path || !socket_path[0] || dev->backend == DISK_BACKEND_REMOTE) {
+        return RES_PARERR;
+    }
+
+    return remote_serve(pdrv, socket_path, idle, arg);
+}
+
+/* Function to freeze the current contents of a drive */
+DRESULT take_disk_snapshot(BYTE pdrv, UINT* id)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !id) {
+        return RES_PARERR;
+    }
+    if (!dev->initialized) {
+        return RES_NOTRDY;
+    }
+
+    return snapshot_create(dev, id);
+}
+
+/* Function to return a drive to a snapshot; the volume must be remounted */
+DRESULT rollback_disk_snapshot(BYTE pdrv, UINT id)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev) {
+        return RES_PARERR;
+    }
+    if (!dev->initialized) {
+        return RES_NOTRDY;
+    }
+
+    return snapshot_rollback(dev, id);
+}
+
+/* Function to drop a snapshot, keeping the current contents */
+DRESULT release_disk_snapshot(BYTE pdrv, UINT id)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev) {
+        return RES_PARERR;
+    }
+    if (!dev->initialized) {
+        return RES_NOTRDY;
+    }
+
+    return snapshot_release(dev, id);
+}
+
+/* Function to start checksumming a drive, with the table in a sidecar file
+   ("": next to the image, NULL: in memory only) */
+DRESULT enable_disk_checksums(BYTE pdrv, const char* path)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+    char sidecar[DISK_PATH_MAX + 4];
+
+    if (!dev) {
+        return RES_PARERR;
+    }
+    if (!dev->initialized) {
+        return RES_NOTRDY;
+    }
+
+    if (path && !path[0]) {
+        /* A RAM disk has no image to keep the table next to */
+        if (dev->backend == DISK_BACKEND_MEMORY) {
+            path = NULL;
+        } else {
+            snprintf(sidecar, sizeof(sidecar), "%s.crc", dev->path);
+            path = sidecar;
+        }
+    }
+
+    return checksum_enable(dev, path);
+}
+
+/* Function to stop checksumming a drive */
+DRESULT disable_disk_checksums(BYTE pdrv)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev) {
+        return RES_PARERR;
+    }
+    if (!dev->initialized) {
+        return RES_NOTRDY;
+    }
+
+    return checksum_disable(dev);
+}
+
+/* Function to verify the next count sectors of a drive (0: all of them) */
+DRESULT scrub_disk(BYTE pdrv, LBA_t count, DISK_SCRUB* result)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !result) {
+        return RES_PARERR;
+    }
+    if (!dev->initialized) {
+        return RES_NOTRDY;
+    }
+
+    return checksum_scrub(dev, count, result);
+}
+
+/* Function to emulate the timing of a slower device (NULL: full speed),
+   kept for images opened later */
+DRESULT set_disk_throttle(BYTE pdrv, const DISK_THROTTLE* throttle)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev) {
+        return RES_PARERR;
+    }
+
+    return throttle_set(dev, throttle);
+}
+
+/* Function to read the I/O counters of a drive */
+int get_disk_stats(BYTE pdrv, DISK_STATS* stats)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev || !stats) {
+        return 0;
+    }
+
+    *stats = dev->stats;
+    return 1;
+}
+
+/* Function to resize the block cache of a drive (0 sectors disables it) */
+int set_disk_cache(BYTE pdrv, UINT sectors)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev) {
+        return 0;
+    }
+
+    dev->cache_sectors = sectors;
+    if (!dev->initialized) {
+        return 1;   /* Allocated when the drive is initialized */
+    }
+
+    if (cache_flush(dev) != RES_OK) {
+        return 0;
+    }
+    cache_release(dev);
+    return cache_init(dev);
+}
+
+/* Function to set the largest readahead window of a drive (0 disables it) */
+int set_disk_readahead(BYTE pdrv, UINT max_sectors)
+{
+    DISK_DEVICE* dev = get_device(pdrv);
+
+    if (!dev) {
+        return 0;
+    }
+
+    dev->ra.max_window = max_sectors;
+    dev->ra.window = 0;
+    return 1;
+}
+
+/* Cleanup function to be called when Python module unloads */
+void cleanup_disk_resources(void)
 {
-    cleanup_virtual_disk();
-}
\ No newline at end of file
+    for (BYTE pdrv = 0; pdrv < FF_VOLUMES; pdrv++) {
+        DISK_DEVICE* dev = get_device(pdrv);
+
+        /* Nothing is left to keep the cache for */
+        cleanup_virtual_disk(dev);
+        close_virtual_disk(dev);
+    }
+}
@@ -0,0 +1,320 @@
+/*-----------------------------------------------------------------------*/
+/* Device table of the working disk I/O module                           */
+/*-----------------------------------------------------------------------*/
+
+#ifndef _DISKIO_WORKING_DEFINED
+#define _DISKIO_WORKING_DEFINED
+
+#include <stdio.h>
+#include "ff.h"
+#include "diskio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DISK_PATH_MAX       1024
+
+/* Backing store selection */
+#define DISK_BACKEND_MEMORY 0   /* calloc'd buffer, lost on exit */
+#define DISK_BACKEND_FILE   1   /* stdio FILE* on the image file */
+#define DISK_BACKEND_MMAP   2   /* MAP_SHARED mapping of the image file */
+#define DISK_BACKEND_PREAD  3   /* Positional pread/pwrite on a raw descriptor */
+#define DISK_BACKEND_URING  4   /* io_uring, falls back to DISK_BACKEND_PREAD */
+#define DISK_BACKEND_DIRECT 5   /* O_DIRECT pread/pwrite, falls back to DISK_BACKEND_PREAD */
+#define DISK_BACKEND_OVERLAY 6  /* Copy-on-write delta over a read-only base, see open_overlay() */
+#define DISK_BACKEND_COMPRESSED 7   /* Independently compressed blocks, see open_compressed() */
+#define DISK_BACKEND_REMOTE 8   /* Sectors served by another process, see open_remote() */
+
+/* Allocation of the DISK_BACKEND_MEMORY buffer */
+#define RAMDISK_HEAP        0   /* calloc */
+#define RAMDISK_MAPPED      1   /* Anonymous mapping, transparent huge pages advised */
+#define RAMDISK_HUGETLB     2   /* Anonymous MAP_HUGETLB mapping */
+
+/* Durability policy for writes */
+#define DISK_SYNC_NONE          0   /* CTRL_SYNC hands data to the OS only */
+#define DISK_SYNC_ON_SYNC       1   /* CTRL_SYNC also forces data to stable storage */
+#define DISK_SYNC_WRITE_THROUGH 2   /* Every disk_write reaches stable storage */
+
+/* I/O counters of a drive */
+typedef struct {
+	QWORD	reads;			/* disk_read calls */
+	QWORD	writes;			/* disk_write calls */
+	QWORD	sectors_read;	/* Sectors transferred by disk_read */
+	QWORD	sectors_written;	/* Sectors transferred by disk_write */
+	QWORD	syncs;			/* CTRL_SYNC requests */
+	QWORD	cache_hits;		/* Sectors served from the block cache */
+	QWORD	cache_misses;	/* Sectors the block cache had to load */
+	QWORD	cache_evictions;	/* Sectors dropped to make room */
+	QWORD	cache_writebacks;	/* Dirty sectors written to the backend */
+	QWORD	flush_writes;	/* Backend writes issued by cache flushes */
+	QWORD	readahead_sectors;	/* Sectors prefetched ahead of a sequential stream */
+	QWORD	trimmed_sectors;	/* Sectors handed back to the host by CTRL_TRIM */
+	QWORD	zero_sectors;	/* Zero sectors punched out instead of written */
+	QWORD	hole_sectors;	/* Sectors read from image holes without a transfer */
+	QWORD	checksum_errors;	/* Sectors failing checksum verification */
+	QWORD	scrubbed_sectors;	/* Sectors verified by scrubbing */
+	QWORD	device_us;		/* Time charged by the throttle layer */
+	QWORD	device_stalls;	/* Random stalls the throttle layer added */
+} DISK_STATS;
+
+/* Emulated timing of a slow device, 0 leaves out a term */
+typedef struct {
+	DWORD	read_latency_us;	/* Per read command */
+	DWORD	write_latency_us;	/* Per write or discard command */
+	DWORD	sync_latency_us;	/* Per CTRL_SYNC */
+	QWORD	read_bps;		/* Read bandwidth in bytes per second */
+	QWORD	write_bps;		/* Write bandwidth in bytes per second */
+	DWORD	erase_block;	/* Erase block in bytes (power of 2), reported by GET_BLOCK_SIZE */
+	DWORD	erase_penalty_us;	/* Per erase block a write covers only in part */
+	DWORD	stall_ppm;		/* Chance of a stall per command in parts per million */
+	DWORD	stall_us;		/* Mean stall, drawn from [stall_us/2, 3*stall_us/2) */
+	QWORD	seed;			/* Stall generator seed */
+	int		realtime;		/* Sleep for the charged time (0:only count it) */
+} DISK_THROTTLE;
+
+#define DISK_SCRUB_BAD	64	/* Failing sectors reported per scrub call */
+
+/* Outcome of a scrub call */
+typedef struct {
+	LBA_t	start;			/* First sector scanned */
+	LBA_t	next;			/* Where the next call continues */
+	LBA_t	scanned;		/* Sectors read */
+	LBA_t	recorded;		/* Sectors whose unknown checksum was recorded */
+	LBA_t	errors;			/* Sectors failing verification */
+	UINT	passes;			/* Times the scan wrapped past the last sector */
+	UINT	bad_count;		/* Entries in bad */
+	LBA_t	bad[DISK_SCRUB_BAD];	/* First failing sectors */
+} DISK_SCRUB;
+
+#define CACHE_NONE	0xFFFFFFFF	/* Null link of the block cache lists */
+
+/* Block cache slot */
+typedef struct {
+	LBA_t	sector;			/* Cached sector number */
+	BYTE	valid;			/* Slot holds a sector */
+	BYTE	dirty;			/* Slot is newer than the backend */
+	UINT	hash_next;		/* Next slot in the hash chain */
+	UINT	lru_prev;		/* Toward the most recently used slot */
+	UINT	lru_next;		/* Toward the least recently used slot */
+} DISK_CACHE_SLOT;
+
+/* Dirty slot reference, sorted by sector when the cache is flushed */
+typedef struct {
+	LBA_t	sector;
+	UINT	slot;
+} DISK_CACHE_REF;
+
+/* Write-back sector cache in front of the backend */
+typedef struct {
+	UINT	capacity;		/* Number of slots (0:cache disabled) */
+	UINT	used;			/* Slots holding a sector */
+	UINT	dirty;			/* Slots newer than the backend */
+	BYTE*	data;			/* capacity * sector_size bytes */
+	DISK_CACHE_SLOT* slots;
+	UINT*	buckets;		/* Hash chain heads */
+	UINT	hash_mask;		/* Number of buckets - 1 */
+	UINT	lru_head;		/* Most recently used slot */
+	UINT	lru_tail;		/* Least recently used slot */
+	UINT	free_head;		/* Unused slots, linked through hash_next */
+	BYTE*	bounce;			/* capacity / 2 sectors for multi-slot transfers */
+	DISK_CACHE_REF* flush_list;	/* capacity entries for cache_flush */
+	const BYTE** flush_vec;	/* capacity sector pointers for vectored writes */
+} DISK_CACHE;
+
+/* Sequential stream detector driving readahead */
+typedef struct {
+	UINT	max_window;		/* Largest readahead window in sectors (0:disabled) */
+	UINT	window;			/* Current window (0:no stream) */
+	LBA_t	next;			/* Sector following the last read of the stream */
+	LBA_t	ahead;			/* First sector not prefetched yet */
+	UINT	strays;			/* Non-sequential reads since the stream last advanced */
+} DISK_READAHEAD;
+
+typedef struct DISK_DEVICE DISK_DEVICE;
+typedef struct DISK_URING DISK_URING;
+typedef struct DISK_OVERLAY DISK_OVERLAY;
+typedef struct DISK_SNAPSHOT DISK_SNAPSHOT;
+typedef struct DISK_COMPRESS DISK_COMPRESS;
+typedef struct DISK_CHECKSUM DISK_CHECKSUM;
+typedef struct DISK_REMOTE DISK_REMOTE;
+
+/* Backend operations; sector range and drive state are checked by the caller */
+typedef struct {
+	int		(*open)(DISK_DEVICE* dev);		/* 1:Ok, 0:Failed */
+	void	(*close)(DISK_DEVICE* dev);
+	DRESULT	(*read)(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count);
+	DRESULT	(*write)(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count);
+	DRESULT	(*sync)(DISK_DEVICE* dev);
+	void	(*prefetch)(DISK_DEVICE* dev, LBA_t sector, UINT count);	/* Read hint, may be NULL */
+	DRESULT	(*writev)(DISK_DEVICE* dev, const BYTE* const* bufs, LBA_t sector, UINT count);	/* One buffer per sector, may be NULL */
+	DRESULT	(*drain)(DISK_DEVICE* dev);	/* Complete writev transfers still in flight, may be NULL */
+	DRESULT	(*trim)(DISK_DEVICE* dev, LBA_t sector, LBA_t count);	/* Release host storage of discarded sectors, may be NULL */
+} DISK_OPS;
+
+/* Physical drive */
+struct DISK_DEVICE {
+	const DISK_OPS* ops;	/* Backend of the drive */
+	int		backend;		/* DISK_BACKEND_* */
+	int		initialized;	/* Backend is open */
+	int		sync_mode;		/* DISK_SYNC_* */
+
+	/* Image geometry */
+	char	path[DISK_PATH_MAX];
+	WORD	sector_size;
+	LBA_t	sector_count;
+	int		size_auto;		/* Take the size from an existing image */
+	int		preallocate;	/* Reserve host blocks for the whole image */
+	int		no_punch;		/* Host file system cannot punch holes */
+	int		read_only;		/* Writes are refused (STA_PROTECT) */
+
+	/* Backend state */
+	BYTE*	mem;			/* DISK_BACKEND_MEMORY buffer */
+	int		mem_kind;		/* RAMDISK_* */
+	int		mem_huge;		/* Try huge pages for the buffer */
+	FILE*	file;			/* DISK_BACKEND_FILE stream */
+	int		fd;				/* DISK_BACKEND_MMAP/PREAD/COMPRESSED descriptor, delta of DISK_BACKEND_OVERLAY */
+	BYTE*	map;			/* DISK_BACKEND_MMAP mapping */
+	size_t	map_size;
+	DISK_URING* uring;		/* DISK_BACKEND_URING ring */
+	BYTE*	dio_buf;		/* DISK_BACKEND_DIRECT aligned bounce buffer */
+	size_t	dio_buf_size;
+	UINT	dio_align;		/* Offset and length alignment of direct transfers */
+	UINT	dio_mem_align;	/* Buffer address alignment of direct transfers */
+	char	base_path[DISK_PATH_MAX];	/* DISK_BACKEND_OVERLAY base ("":recorded in the delta) */
+	DISK_OVERLAY* overlay;
+	DISK_COMPRESS* compress;	/* DISK_BACKEND_COMPRESSED index and decoded blocks */
+	UINT	compress_block_size;	/* Block size of a new compressed image */
+	DISK_REMOTE* remote;	/* DISK_BACKEND_REMOTE connection, path is the server socket */
+
+	/* Point-in-time snapshots, oldest first */
+	DISK_SNAPSHOT* snaps;
+	UINT	snap_count;
+	UINT	snap_next_id;
+	const DISK_OPS* snap_lower;	/* Backend under the snapshot layer (NULL:no snapshots) */
+	DISK_OPS snap_ops;		/* Backend with writes preserving snapshot contents */
+
+	/* Device timing emulation, right over the backend */
+	DISK_THROTTLE throttle;
+	int		throttle_on;	/* Charge commands for time */
+	QWORD	throttle_rng;	/* Stall generator state */
+	QWORD	throttle_busy;	/* Monotonic time the emulated device is busy until */
+	const DISK_OPS* throttle_lower;	/* Backend under the throttle layer (NULL:not installed) */
+	DISK_OPS throttle_ops;
+
+	/* Integrity checksums, below any snapshot layer */
+	DISK_CHECKSUM* crc;
+	const DISK_OPS* crc_lower;	/* Backend under the checksum layer (NULL:no checksums) */
+	DISK_OPS crc_ops;		/* Backend with checksummed reads and writes */
+
+	UINT	cache_sectors;	/* Requested block cache capacity */
+	DISK_CACHE cache;
+	DISK_READAHEAD ra;
+
+	DISK_STATS stats;
+};
+
+/* Block cache (diskio_cache.c) */
+int cache_init(DISK_DEVICE* dev);
+void cache_release(DISK_DEVICE* dev);
+DRESULT cache_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count);
+DRESULT cache_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count);
+DRESULT cache_flush(DISK_DEVICE* dev);
+DRESULT cache_prefetch(DISK_DEVICE* dev, LBA_t sector, UINT count);
+void cache_discard(DISK_DEVICE* dev, LBA_t sector, LBA_t count);
+
+/* Host block punched out of file images when written as zeros */
+#define DISK_SPARSE_BLOCK	4096
+
+/* Test a buffer for all zero bytes (1:Zero) */
+int disk_is_zero(const BYTE* p, size_t n);
+
+/* Store and load n-byte little endian fields */
+void disk_st_le(BYTE* p, QWORD v, int n);
+QWORD disk_ld_le(const BYTE* p, int n);
+
+#ifndef _WIN32
+/* Positional transfers shared by the backends (1:Ok, 0:Failed) */
+#include <sys/types.h>
+int disk_pread_full(int fd, BYTE* buff, size_t len, off_t offset);
+int disk_pwrite_full(int fd, const BYTE* buff, size_t len, off_t offset);
+int disk_datasync(int fd);
+int disk_punch_hole(int fd, off_t offset, off_t len);	/* -1:Not supported by the host */
+DRESULT disk_punch_sectors(DISK_DEVICE* dev, int fd, LBA_t sector, LBA_t count);
+
+/* Bytes read per call by disk_export_image() */
+#define DISK_EXPORT_CHUNK	(1024 * 1024)
+/* Write the drive read through read_fn to a sparse raw image at path */
+DRESULT disk_export_image(DISK_DEVICE* dev, const char* path,
+                          DRESULT (*read_fn)(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count));
+#endif
+
+/* Copy-on-write overlay (diskio_overlay.c) */
+extern const DISK_OPS overlay_ops;
+DRESULT overlay_flatten(DISK_DEVICE* dev, const char* path);
+
+/* Compressed images (diskio_compress.c) */
+extern const DISK_OPS compress_ops;
+DRESULT compress_import(DISK_DEVICE* dev, const char* image);
+DRESULT compress_export(DISK_DEVICE* dev, const char* path);
+
+/* Snapshots (diskio_snapshot.c) */
+DRESULT snapshot_create(DISK_DEVICE* dev, UINT* id);
+DRESULT snapshot_rollback(DISK_DEVICE* dev, UINT id);
+DRESULT snapshot_release(DISK_DEVICE* dev, UINT id);
+
+/* Integrity checksums (diskio_checksum.c) */
+DWORD disk_crc32c(DWORD crc, const void* data, size_t len);
+DRESULT checksum_enable(DISK_DEVICE* dev, const char* path);
+DRESULT checksum_disable(DISK_DEVICE* dev);
+DRESULT checksum_scrub(DISK_DEVICE* dev, LBA_t count, DISK_SCRUB* result);
+
+/* Device timing emulation (diskio_throttle.c) */
+void throttle_install(DISK_DEVICE* dev);
+DRESULT throttle_set(DISK_DEVICE* dev, const DISK_THROTTLE* t);
+
+/* Block server and its clients (diskio_remote.c) */
+extern const DISK_OPS remote_ops;
+DRESULT remote_serve(BYTE pdrv, const char* path, int (*idle)(void* arg), void* arg);
+
+/* io_uring engine (diskio_uring.c), built with DISK_HAVE_IO_URING */
+int uring_setup(DISK_DEVICE* dev);
+void uring_teardown(DISK_DEVICE* dev);
+DRESULT uring_read(DISK_DEVICE* dev, BYTE* buff, LBA_t sector, UINT count);
+DRESULT uring_write(DISK_DEVICE* dev, const BYTE* buff, LBA_t sector, UINT count);
+DRESULT uring_writev(DISK_DEVICE* dev, const BYTE* const* bufs, LBA_t sector, UINT count);
+DRESULT uring_drain(DISK_DEVICE* dev);
+void uring_prefetch(DISK_DEVICE* dev, LBA_t sector, UINT count);
+DRESULT uring_trim(DISK_DEVICE* dev, LBA_t sector, LBA_t count);
+
+/* Helper functions for the Python bindings (1:Ok, 0:Failed unless noted) */
+int format_virtual_disk(BYTE pdrv);
+void get_disk_info(BYTE pdrv, DWORD* total_sectors, DWORD* sector_size);
+DRESULT set_disk_backend(BYTE pdrv, int backend);
+int set_disk_sync_mode(BYTE pdrv, int mode);
+DRESULT open_disk_image(BYTE pdrv, const char* path, QWORD size, UINT sector_size, int preallocate);
+DRESULT open_ram_disk(BYTE pdrv, QWORD size, UINT sector_size, const char* image, int huge_pages);
+DRESULT dump_ram_disk(BYTE pdrv, const char* path);
+DRESULT open_overlay(BYTE pdrv, const char* base, const char* delta, UINT sector_size);
+DRESULT flatten_overlay(BYTE pdrv, const char* path);
+DRESULT open_compressed(BYTE pdrv, const char* path, QWORD size, UINT sector_size, UINT block_size, const char* image);
+DRESULT export_compressed(BYTE pdrv, const char* path);
+DRESULT open_remote(BYTE pdrv, const char* socket_path, int writable);
+DRESULT serve_disk(BYTE pdrv, const char* socket_path, int (*idle)(void* arg), void* arg);
+DRESULT take_disk_snapshot(BYTE pdrv, UINT* id);
+DRESULT rollback_disk_snapshot(BYTE pdrv, UINT id);
+DRESULT release_disk_snapshot(BYTE pdrv, UINT id);
+DRESULT enable_disk_checksums(BYTE pdrv, const char* path);
+DRESULT disable_disk_checksums(BYTE pdrv);
+DRESULT scrub_disk(BYTE pdrv, LBA_t count, DISK_SCRUB* result);
+DRESULT set_disk_throttle(BYTE pdrv, const DISK_THROTTLE* throttle);
+int get_disk_stats(BYTE pdrv, DISK_STATS* stats);
+int set_disk_cache(BYTE pdrv, UINT sectors);
+int set_disk_readahead(BYTE pdrv, UINT max_sectors);
+void cleanup_disk_resources(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
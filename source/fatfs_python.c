@@ -2,14 +2,103 @@
 #include <Python.h>
 #include "ff.h"
 #include "diskio.h"
+#include "diskio_working.h"
 
-// External functions from diskio_working.c
-extern int format_virtual_disk(void);
-extern void get_disk_info(DWORD* total_sectors, DWORD* sector_size);
-extern void cleanup_disk_resources(void);
+// Filesystem object of each logical drive
+static FATFS* g_fs[FF_VOLUMES];
+// Options the drive was mounted with, reused when it is mounted again
+static BYTE g_mount_opt[FF_VOLUMES];
 
-// Global filesystem object
-static FATFS* g_fs = NULL;
+// f_mkfs work area, writes spanning whole host blocks let the zeroed
+// FAT and root directory become holes in sparse images
+#define MKFS_WORK_SIZE (16 * FF_MAX_SS)
+
+// Open file object. The FIL comes first, so a file handle given to Python
+// is also a FIL pointer.
+typedef struct {
+    FIL fil;
+#if FF_USE_FASTSEEK
+    DWORD* clmt;        // Cluster link map storage, fil.cltbl points to it while valid
+    DWORD clmt_size;    // Items allocated in clmt
+#endif
+} PYFIL;
+
+#if FF_USE_FASTSEEK
+// Files opened for reading get their link map at open from this size,
+// other files on their first seek
+#define FASTSEEK_OPEN_SIZE (4UL << 20)
+// Initial link map size in items: the map size, 2 per fragment and a terminator
+#define FASTSEEK_MAP_ITEMS 32
+#endif
+
+// Build the "N:" volume path of a drive
+static void volume_path(int drive, char* vol) {
+    vol[0] = (char)('0' + drive);
+    vol[1] = ':';
+    vol[2] = 0;
+}
+
+// Unregister and free the filesystem object of a drive
+static void release_volume(int drive) {
+    if (g_fs[drive]) {
+        char vol[3];
+        volume_path(drive, vol);
+        f_mount(NULL, vol, 0);
+        PyMem_Free(g_fs[drive]);
+        g_fs[drive] = NULL;
+    }
+}
+
+// Validate a drive number argument
+static int check_drive(int drive) {
+    return drive >= 0 && drive < FF_VOLUMES;
+}
+
+// Result code of attaching a drive to a backend; FR_DISK_ERR means the
+// cached writes of the previous one could not be flushed, it stays attached
+static PyObject* attach_result(DRESULT res) {
+    if (res == RES_PARERR) {
+        return PyLong_FromLong(FR_INVALID_PARAMETER);
+    }
+    if (res == RES_ERROR) {
+        return PyLong_FromLong(FR_DISK_ERR);
+    }
+    return PyLong_FromLong(res == RES_OK ? FR_OK : FR_NOT_READY);
+}
+
+#if FF_USE_FASTSEEK
+// Map the cluster chain of a file for fast seek, growing the map until the
+// chain fits. A seek then costs a step per fragment instead of a FAT read
+// per cluster.
+static FRESULT build_linkmap(PYFIL* pf) {
+    for (;;) {
+        if (!pf->clmt) {
+            pf->clmt = (DWORD*)PyMem_Malloc(FASTSEEK_MAP_ITEMS * sizeof(DWORD));
+            if (!pf->clmt) {
+                return FR_NOT_ENOUGH_CORE;
+            }
+            pf->clmt_size = FASTSEEK_MAP_ITEMS;
+        }
+        pf->clmt[0] = pf->clmt_size;
+        pf->fil.cltbl = pf->clmt;
+        FRESULT res = f_lseek(&pf->fil, CREATE_LINKMAP);
+        if (res == FR_OK) {
+            return FR_OK;
+        }
+        pf->fil.cltbl = NULL;
+        if (res != FR_NOT_ENOUGH_CORE) {
+            return res;
+        }
+        DWORD need = pf->clmt[0];   // Number of items the chain needs
+        DWORD* map = (DWORD*)PyMem_Realloc(pf->clmt, need * sizeof(DWORD));
+        if (!map) {
+            return FR_NOT_ENOUGH_CORE;
+        }
+        pf->clmt = map;
+        pf->clmt_size = need;
+    }
+}
+#endif
 
 // Python wrapper functions for FatFs
 
@@ -17,45 +106,357 @@ static PyObject* fatfs_mount(PyObject* self, PyObject* args) {
     const char* path;
     int drive;
     int opt;
+    int sync_mode = -1;
     
-    if (!PyArg_ParseTuple(args, "sii", &path, &drive, &opt)) {
+    if (!PyArg_ParseTuple(args, "sii|i", &path, &drive, &opt, &sync_mode)) {
         return NULL;
     }
     
-    if (g_fs) {
-        PyMem_Free(g_fs);
-        g_fs = NULL;
+    // The drive number selects the volume, path is kept for compatibility
+    (void)path;
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
     }
     
-    g_fs = (FATFS*)PyMem_Malloc(sizeof(FATFS));
-    if (!g_fs) {
+    // Optional durability policy for the disk backend
+    if (sync_mode >= 0 && !set_disk_sync_mode((BYTE)drive, sync_mode)) {
+        return PyLong_FromLong(FR_INVALID_PARAMETER);
+    }
+    
+    release_volume(drive);
+    
+    FATFS* fs = (FATFS*)PyMem_Malloc(sizeof(FATFS));
+    if (!fs) {
         return PyErr_NoMemory();
     }
     
-    FRESULT res = f_mount(g_fs, path, opt);
+    char vol[3];
+    volume_path(drive, vol);
+    FRESULT res = f_mount(fs, vol, opt);
     
     // If mount fails with "no filesystem", try to format the disk
     if (res == FR_NO_FILESYSTEM) {
         // Try to format the disk using simple format
-        BYTE work[512]; // Work area for f_mkfs
+        BYTE work[MKFS_WORK_SIZE]; // Work area for f_mkfs
         MKFS_PARM parm = {0};
         parm.fmt = FM_ANY;
-        res = f_mkfs(path, &parm, work, sizeof(work));
+        res = f_mkfs(vol, &parm, work, sizeof(work));
         
         if (res == FR_OK) {
             // Try mounting again after format
-            res = f_mount(g_fs, path, opt);
+            res = f_mount(fs, vol, opt);
         }
     }
     
-    if (res != FR_OK && g_fs) {
-        PyMem_Free(g_fs);
-        g_fs = NULL;
+    if (res != FR_OK) {
+        f_mount(NULL, vol, 0);
+        PyMem_Free(fs);
+        fs = NULL;
+    }
+    
+    g_fs[drive] = fs;
+    g_mount_opt[drive] = (BYTE)opt;
+    return PyLong_FromLong(res);
+}
+
+static PyObject* fatfs_open_compressed(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"path", "size", "sector_size", "block_size", "image", "drive", NULL};
+    const char* path;
+    unsigned long long size = 0;
+    unsigned int sector_size = 512;
+    unsigned int block_size = 65536;
+    const char* image = NULL;
+    int drive = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|KIIzi", kwlist,
+                                     &path, &size, &sector_size, &block_size, &image, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    release_volume(drive);
+    
+    DRESULT res = open_compressed((BYTE)drive, path, (QWORD)size, sector_size, block_size, image);
+    
+    return attach_result(res);
+}
+
+static PyObject* fatfs_export_compressed(PyObject* self, PyObject* args) {
+    const char* path;
+    int drive = 0;
+    
+    if (!PyArg_ParseTuple(args, "s|i", &path, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    DRESULT res = export_compressed((BYTE)drive, path);
+    
+    if (res == RES_PARERR) {
+        return PyLong_FromLong(FR_INVALID_PARAMETER);
+    }
+    if (res == RES_NOTRDY) {
+        return PyLong_FromLong(FR_NOT_READY);
+    }
+    
+    return PyLong_FromLong(res == RES_OK ? FR_OK : FR_DISK_ERR);
+}
+
+static PyObject* fatfs_open_remote(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"socket", "writable", "drive", NULL};
+    const char* socket_path;
+    int writable = 0;
+    int drive = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|pi", kwlist,
+                                     &socket_path, &writable, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    release_volume(drive);
+    
+    DRESULT res = open_remote((BYTE)drive, socket_path, writable);
+    
+    return attach_result(res);
+}
+
+// Runs between poll rounds of the block server, signal handlers may stop it
+static int serve_idle(void* arg) {
+    PyGILState_STATE gil = PyGILState_Ensure();
+    int stop = PyErr_CheckSignals() != 0;
+    
+    (void)arg;
+    PyGILState_Release(gil);
+    return stop;
+}
+
+static PyObject* fatfs_serve(PyObject* self, PyObject* args) {
+    const char* socket_path;
+    int drive = 0;
+    DRESULT res;
+    
+    if (!PyArg_ParseTuple(args, "s|i", &socket_path, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    // The server owns the image, it is not mounted here meanwhile
+    release_volume(drive);
+    
+    Py_BEGIN_ALLOW_THREADS
+    res = serve_disk((BYTE)drive, socket_path, serve_idle, NULL);
+    Py_END_ALLOW_THREADS
+    
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    if (res == RES_PARERR) {
+        return PyLong_FromLong(FR_INVALID_PARAMETER);
+    }
+    if (res == RES_NOTRDY) {
+        return PyLong_FromLong(FR_NOT_READY);
+    }
+    
+    return PyLong_FromLong(res == RES_OK ? FR_OK : FR_DISK_ERR);
+}
+
+static PyObject* fatfs_snapshot(PyObject* self, PyObject* args) {
+    int drive = 0;
+    UINT id = 0;
+    
+    if (!PyArg_ParseTuple(args, "|i", &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return Py_BuildValue("(iI)", FR_INVALID_DRIVE, id);
+    }
+    if (!g_fs[drive]) {
+        return Py_BuildValue("(iI)", FR_NOT_ENABLED, id);
+    }
+    
+    // Freeze the volume at a consistent point: FAT, FSINFO and directories written
+    char vol[3];
+    volume_path(drive, vol);
+    FRESULT res = f_syncfs(vol);
+    
+    if (res == FR_OK) {
+        DRESULT dres = take_disk_snapshot((BYTE)drive, &id);
+        res = dres == RES_OK ? FR_OK : (dres == RES_NOTRDY ? FR_NOT_READY : FR_DISK_ERR);
+    }
+    
+    return Py_BuildValue("(iI)", res, id);
+}
+
+static PyObject* fatfs_rollback(PyObject* self, PyObject* args) {
+    unsigned int snap;
+    int drive = 0;
+    
+    if (!PyArg_ParseTuple(args, "I|i", &snap, &drive)) {
+        return NULL;
     }
     
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    DRESULT dres = rollback_disk_snapshot((BYTE)drive, snap);
+    
+    if (dres == RES_PARERR) {
+        return PyLong_FromLong(FR_INVALID_PARAMETER);
+    }
+    if (dres != RES_OK) {
+        return PyLong_FromLong(dres == RES_NOTRDY ? FR_NOT_READY : FR_DISK_ERR);
+    }
+    
+    // The in-memory volume state is newer than the snapshot, drop it unwritten
+    release_volume(drive);
+    
+    FATFS* fs = (FATFS*)PyMem_Malloc(sizeof(FATFS));
+    if (!fs) {
+        return PyErr_NoMemory();
+    }
+    
+    char vol[3];
+    volume_path(drive, vol);
+    // Mount now whatever the options, so a bad snapshot is reported here
+    FRESULT res = f_mount(fs, vol, g_mount_opt[drive] | 1);
+    
+    if (res != FR_OK) {
+        f_mount(NULL, vol, 0);
+        PyMem_Free(fs);
+        fs = NULL;
+    }
+    
+    g_fs[drive] = fs;
     return PyLong_FromLong(res);
 }
 
+static PyObject* fatfs_enable_checksums(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"path", "drive", NULL};
+    const char* path = "";
+    int drive = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|zi", kwlist, &path, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    DRESULT res = enable_disk_checksums((BYTE)drive, path);
+    
+    if (res == RES_PARERR) {
+        return PyLong_FromLong(FR_INVALID_PARAMETER);
+    }
+    if (res == RES_NOTRDY) {
+        return PyLong_FromLong(FR_NOT_READY);
+    }
+    
+    return PyLong_FromLong(res == RES_OK ? FR_OK : FR_DISK_ERR);
+}
+
+static PyObject* fatfs_disable_checksums(PyObject* self, PyObject* args) {
+    int drive = 0;
+    
+    if (!PyArg_ParseTuple(args, "|i", &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    DRESULT res = disable_disk_checksums((BYTE)drive);
+    
+    if (res == RES_PARERR) {
+        return PyLong_FromLong(FR_INVALID_PARAMETER);
+    }
+    if (res == RES_NOTRDY) {
+        return PyLong_FromLong(FR_NOT_READY);
+    }
+    
+    return PyLong_FromLong(res == RES_OK ? FR_OK : FR_DISK_ERR);
+}
+
+static PyObject* fatfs_scrub(PyObject* self, PyObject* args) {
+    unsigned long long count = 0;
+    int drive = 0;
+    
+    if (!PyArg_ParseTuple(args, "|Ki", &count, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    DISK_SCRUB scrub;
+    DRESULT res = scrub_disk((BYTE)drive, (LBA_t)count, &scrub);
+    
+    if (res == RES_PARERR) {
+        return PyLong_FromLong(FR_INVALID_PARAMETER);
+    }
+    if (res != RES_OK) {
+        return PyLong_FromLong(res == RES_NOTRDY ? FR_NOT_READY : FR_DISK_ERR);
+    }
+    
+    PyObject* bad = PyList_New(scrub.bad_count);
+    if (!bad) {
+        return NULL;
+    }
+    for (UINT i = 0; i < scrub.bad_count; i++) {
+        PyList_SET_ITEM(bad, i, PyLong_FromUnsignedLongLong((unsigned long long)scrub.bad[i]));
+    }
+    
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:I,s:N}",
+        "start", (unsigned long long)scrub.start,
+        "next", (unsigned long long)scrub.next,
+        "scanned", (unsigned long long)scrub.scanned,
+        "recorded", (unsigned long long)scrub.recorded,
+        "errors", (unsigned long long)scrub.errors,
+        "passes", scrub.passes,
+        "bad_sectors", bad);
+}
+
+static PyObject* fatfs_release_snapshot(PyObject* self, PyObject* args) {
+    unsigned int snap;
+    int drive = 0;
+    
+    if (!PyArg_ParseTuple(args, "I|i", &snap, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    DRESULT res = release_disk_snapshot((BYTE)drive, snap);
+    
+    if (res == RES_PARERR) {
+        return PyLong_FromLong(FR_INVALID_PARAMETER);
+    }
+    if (res == RES_NOTRDY) {
+        return PyLong_FromLong(FR_NOT_READY);
+    }
+    
+    return PyLong_FromLong(res == RES_OK ? FR_OK : FR_DISK_ERR);
+}
+
 static PyObject* fatfs_open(PyObject* self, PyObject* args) {
     const char* path;
     int mode;
@@ -64,21 +465,33 @@ static PyObject* fatfs_open(PyObject* self, PyObject* args) {
         return NULL;
     }
     
-    FIL* fp = (FIL*)PyMem_Malloc(sizeof(FIL));
-    if (!fp) {
+    PYFIL* pf = (PYFIL*)PyMem_Malloc(sizeof(PYFIL));
+    if (!pf) {
         return PyErr_NoMemory();
     }
+#if FF_USE_FASTSEEK
+    pf->clmt = NULL;
+    pf->clmt_size = 0;
+#endif
     
-    FRESULT res = f_open(fp, path, mode);
+    FRESULT res = f_open(&pf->fil, path, mode);
     
     if (res != FR_OK) {
-        PyMem_Free(fp);
+        PyMem_Free(pf);
         // Return error code as integer for failed open
         return PyLong_FromLong((long)res);
     }
     
+#if FF_USE_FASTSEEK
+    // A large file opened for reading is likely to be read at random;
+    // without a map, seeks simply follow the FAT
+    if (!(mode & FA_WRITE) && f_size(&pf->fil) >= FASTSEEK_OPEN_SIZE) {
+        build_linkmap(pf);
+    }
+#endif
+    
     // Return file pointer as unsigned long long for successful open
-    return PyLong_FromUnsignedLongLong((unsigned long long)(uintptr_t)fp);
+    return PyLong_FromUnsignedLongLong((unsigned long long)(uintptr_t)pf);
 }
 
 static PyObject* fatfs_close(PyObject* self, PyObject* args) {
@@ -88,9 +501,12 @@ static PyObject* fatfs_close(PyObject* self, PyObject* args) {
         return NULL;
     }
     
-    FIL* fp = (FIL*)(uintptr_t)fp_ptr;
-    FRESULT res = f_close(fp);
-    PyMem_Free(fp);
+    PYFIL* pf = (PYFIL*)(uintptr_t)fp_ptr;
+    FRESULT res = f_close(&pf->fil);
+#if FF_USE_FASTSEEK
+    PyMem_Free(pf->clmt);
+#endif
+    PyMem_Free(pf);
     
     return PyLong_FromLong(res);
 }
@@ -135,6 +551,12 @@ static PyObject* fatfs_write(PyObject* self, PyObject* args) {
     FIL* fp = (FIL*)(uintptr_t)fp_ptr;
     UINT bytes_written = 0;
     
+#if FF_USE_FASTSEEK
+    // Writing past the end allocates clusters the link map does not know of
+    if (fp->cltbl && f_tell(fp) + (FSIZE_t)data_len > f_size(fp)) {
+        fp->cltbl = NULL;
+    }
+#endif
     FRESULT res = f_write(fp, data, (UINT)data_len, &bytes_written);
     
     return Py_BuildValue("(ii)", res, bytes_written);
@@ -147,7 +569,7 @@ static PyObject* fatfs_format(PyObject* self, PyObject* args) {
         return NULL;
     }
     
-    BYTE work[512]; // Work area for f_mkfs
+    BYTE work[MKFS_WORK_SIZE]; // Work area for f_mkfs
     MKFS_PARM parm = {0};
     parm.fmt = FM_ANY;
     FRESULT res = f_mkfs(path, &parm, work, sizeof(work));
@@ -156,10 +578,269 @@ static PyObject* fatfs_format(PyObject* self, PyObject* args) {
 }
 
 static PyObject* fatfs_get_disk_info(PyObject* self, PyObject* args) {
-    DWORD total_sectors, sector_size;
-    get_disk_info(&total_sectors, &sector_size);
+    int drive = 0;
+    
+    if (!PyArg_ParseTuple(args, "|i", &drive)) {
+        return NULL;
+    }
+    
+    DWORD total_sectors = 0, sector_size = 0;
+    if (check_drive(drive)) {
+        get_disk_info((BYTE)drive, &total_sectors, &sector_size);
+    }
+    
+    return Py_BuildValue("(kk)", (unsigned long)total_sectors, (unsigned long)sector_size);
+}
+
+static PyObject* fatfs_open_image(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"path", "size", "sector_size", "preallocate", "drive", NULL};
+    const char* path;
+    unsigned long long size = 0;
+    unsigned int sector_size = 512;
+    int preallocate = 0;
+    int drive = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|KIpi", kwlist,
+                                     &path, &size, &sector_size, &preallocate, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    // The volume belongs to the old image, it has to be mounted again
+    release_volume(drive);
+    
+    DRESULT res = open_disk_image((BYTE)drive, path, (QWORD)size, sector_size, preallocate);
+    
+    return attach_result(res);
+}
+
+static PyObject* fatfs_set_backend(PyObject* self, PyObject* args) {
+    int backend;
+    int drive = 0;
+    
+    if (!PyArg_ParseTuple(args, "i|i", &backend, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    return attach_result(set_disk_backend((BYTE)drive, backend));
+}
+
+static PyObject* fatfs_disk_stats(PyObject* self, PyObject* args) {
+    int drive = 0;
+    
+    if (!PyArg_ParseTuple(args, "|i", &drive)) {
+        return NULL;
+    }
+    
+    DISK_STATS stats;
+    if (!check_drive(drive) || !get_disk_stats((BYTE)drive, &stats)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+        "reads", (unsigned long long)stats.reads,
+        "writes", (unsigned long long)stats.writes,
+        "sectors_read", (unsigned long long)stats.sectors_read,
+        "sectors_written", (unsigned long long)stats.sectors_written,
+        "syncs", (unsigned long long)stats.syncs,
+        "cache_hits", (unsigned long long)stats.cache_hits,
+        "cache_misses", (unsigned long long)stats.cache_misses,
+        "cache_evictions", (unsigned long long)stats.cache_evictions,
+        "cache_writebacks", (unsigned long long)stats.cache_writebacks,
+        "flush_writes", (unsigned long long)stats.flush_writes,
+        "readahead_sectors", (unsigned long long)stats.readahead_sectors,
+        "trimmed_sectors", (unsigned long long)stats.trimmed_sectors,
+        "zero_sectors", (unsigned long long)stats.zero_sectors,
+        "hole_sectors", (unsigned long long)stats.hole_sectors,
+        "checksum_errors", (unsigned long long)stats.checksum_errors,
+        "scrubbed_sectors", (unsigned long long)stats.scrubbed_sectors,
+        "device_us", (unsigned long long)stats.device_us,
+        "device_stalls", (unsigned long long)stats.device_stalls);
+}
+
+static PyObject* fatfs_set_cache(PyObject* self, PyObject* args) {
+    unsigned int sectors;
+    int drive = 0;
+    
+    if (!PyArg_ParseTuple(args, "I|i", &sectors, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    if (!set_disk_cache((BYTE)drive, sectors)) {
+        return PyLong_FromLong(FR_NOT_ENOUGH_CORE);
+    }
+    
+    return PyLong_FromLong(FR_OK);
+}
+
+static PyObject* fatfs_open_ramdisk(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"size", "sector_size", "image", "huge_pages", "drive", NULL};
+    unsigned long long size = 0;
+    unsigned int sector_size = 512;
+    const char* image = NULL;
+    int huge_pages = 1;
+    int drive = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|KIzpi", kwlist,
+                                     &size, &sector_size, &image, &huge_pages, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    release_volume(drive);
+    
+    DRESULT res = open_ram_disk((BYTE)drive, (QWORD)size, sector_size, image, huge_pages);
+    
+    return attach_result(res);
+}
+
+static PyObject* fatfs_dump_ramdisk(PyObject* self, PyObject* args) {
+    const char* path;
+    int drive = 0;
+    
+    if (!PyArg_ParseTuple(args, "s|i", &path, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    DRESULT res = dump_ram_disk((BYTE)drive, path);
+    
+    if (res == RES_PARERR) {
+        return PyLong_FromLong(FR_INVALID_PARAMETER);
+    }
+    if (res == RES_NOTRDY) {
+        return PyLong_FromLong(FR_NOT_READY);
+    }
+    
+    return PyLong_FromLong(res == RES_OK ? FR_OK : FR_DISK_ERR);
+}
+
+static PyObject* fatfs_open_overlay(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"base", "delta", "sector_size", "drive", NULL};
+    const char* base;
+    const char* delta;
+    unsigned int sector_size = 512;
+    int drive = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "zs|Ii", kwlist,
+                                     &base, &delta, &sector_size, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    release_volume(drive);
+    
+    DRESULT res = open_overlay((BYTE)drive, base, delta, sector_size);
+    
+    return attach_result(res);
+}
+
+static PyObject* fatfs_flatten_overlay(PyObject* self, PyObject* args) {
+    const char* path;
+    int drive = 0;
+    
+    if (!PyArg_ParseTuple(args, "s|i", &path, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    DRESULT res = flatten_overlay((BYTE)drive, path);
+    
+    if (res == RES_PARERR) {
+        return PyLong_FromLong(FR_INVALID_PARAMETER);
+    }
+    if (res == RES_NOTRDY) {
+        return PyLong_FromLong(FR_NOT_READY);
+    }
+    
+    return PyLong_FromLong(res == RES_OK ? FR_OK : FR_DISK_ERR);
+}
+
+static PyObject* fatfs_set_readahead(PyObject* self, PyObject* args) {
+    unsigned int max_sectors;
+    int drive = 0;
+    
+    if (!PyArg_ParseTuple(args, "I|i", &max_sectors, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive) || !set_disk_readahead((BYTE)drive, max_sectors)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    return PyLong_FromLong(FR_OK);
+}
+
+static PyObject* fatfs_set_throttle(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"read_latency_us", "write_latency_us", "sync_latency_us", "read_bps", "write_bps",
+                             "erase_block", "erase_penalty_us", "stall_chance", "stall_us", "seed", "realtime",
+                             "drive", NULL};
+    DISK_THROTTLE t = {0};
+    unsigned long long read_bps = 0, write_bps = 0, seed = 1;
+    double stall_chance = 0.0;
+    int realtime = 1;
+    int drive = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$IIIKKIIdIKpi", kwlist,
+                                     &t.read_latency_us, &t.write_latency_us, &t.sync_latency_us,
+                                     &read_bps, &write_bps, &t.erase_block, &t.erase_penalty_us,
+                                     &stall_chance, &t.stall_us, &seed, &realtime, &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive)) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    if (stall_chance < 0.0 || stall_chance > 1.0) {
+        return PyLong_FromLong(FR_INVALID_PARAMETER);
+    }
+    
+    t.read_bps = read_bps;
+    t.write_bps = write_bps;
+    t.stall_ppm = (DWORD)(stall_chance * 1000000.0 + 0.5);
+    t.seed = seed;
+    t.realtime = realtime;
+    
+    DRESULT res = set_disk_throttle((BYTE)drive, &t);
     
-    return Py_BuildValue("(ii)", total_sectors, sector_size);
+    return PyLong_FromLong(res == RES_OK ? FR_OK : FR_INVALID_PARAMETER);
+}
+
+static PyObject* fatfs_clear_throttle(PyObject* self, PyObject* args) {
+    int drive = 0;
+    
+    if (!PyArg_ParseTuple(args, "|i", &drive)) {
+        return NULL;
+    }
+    
+    if (!check_drive(drive) || set_disk_throttle((BYTE)drive, NULL) != RES_OK) {
+        return PyLong_FromLong(FR_INVALID_DRIVE);
+    }
+    
+    return PyLong_FromLong(FR_OK);
 }
 
 // Extended file operations
@@ -171,7 +852,22 @@ static PyObject* fatfs_lseek(PyObject* self, PyObject* args) {
         return NULL;
     }
     
-    FIL* fp = (FIL*)(uintptr_t)fp_ptr;
+    PYFIL* pf = (PYFIL*)(uintptr_t)fp_ptr;
+    FIL* fp = &pf->fil;
+    
+#if FF_USE_FASTSEEK
+    if ((FSIZE_t)offset > f_size(fp)) {
+        // Only a normal seek can expand the file
+        fp->cltbl = NULL;
+    } else if (!fp->cltbl && f_size(fp) > 0) {
+        // Map the file on its first seek. When the map cannot be allocated,
+        // the seek follows the FAT as before.
+        FRESULT res = build_linkmap(pf);
+        if (res != FR_OK && res != FR_NOT_ENOUGH_CORE) {
+            return PyLong_FromLong(res);
+        }
+    }
+#endif
     FRESULT res = f_lseek(fp, offset);
     
     return PyLong_FromLong(res);
@@ -185,6 +881,9 @@ static PyObject* fatfs_truncate(PyObject* self, PyObject* args) {
     }
     
     FIL* fp = (FIL*)(uintptr_t)fp_ptr;
+#if FF_USE_FASTSEEK
+    fp->cltbl = NULL;   // The chain is cut, map it again on the next seek
+#endif
     FRESULT res = f_truncate(fp);
     
     return PyLong_FromLong(res);
@@ -449,6 +1148,40 @@ static PyObject* fatfs_getfree(PyObject* self, PyObject* args) {
         "total_sectors", tot_sect);
 }
 
+static PyObject* fatfs_fstrim(PyObject* self, PyObject* args) {
+    const char* path;
+    
+    if (!PyArg_ParseTuple(args, "s", &path)) {
+        return NULL;
+    }
+    
+    // The backend may discard nothing (no trim, snapshots, a preallocated
+    // image), so its own counter tells what was released. The drive is only
+    // known once f_trim has resolved the path, so sample every drive.
+    QWORD before[FF_VOLUMES];
+    DISK_STATS stats;
+    for (int d = 0; d < FF_VOLUMES; d++) {
+        before[d] = get_disk_stats((BYTE)d, &stats) ? stats.trimmed_sectors : 0;
+    }
+    
+    DWORD trim_clust;
+    FATFS* fs;
+    FRESULT res = f_trim(path, &trim_clust, &fs);
+    
+    if (res != FR_OK) {
+        return PyLong_FromLong(res);
+    }
+    
+    QWORD trimmed = 0;
+    if (fs->pdrv < FF_VOLUMES && get_disk_stats(fs->pdrv, &stats)) {
+        trimmed = stats.trimmed_sectors - before[fs->pdrv];
+    }
+    
+    return Py_BuildValue("{s:k,s:K}",
+        "trimmed_clusters", trim_clust,
+        "trimmed_sectors", (unsigned long long)trimmed);
+}
+
 static PyObject* fatfs_getlabel(PyObject* self, PyObject* args) {
     const char* path;
     
@@ -483,12 +1216,33 @@ static PyObject* fatfs_setlabel(PyObject* self, PyObject* args) {
 static PyMethodDef fatfs_methods[] = {
     // Core functions
     {"mount", fatfs_mount, METH_VARARGS, "Mount a filesystem"},
+    {"snapshot", fatfs_snapshot, METH_VARARGS, "Take a point-in-time snapshot of a volume"},
+    {"rollback", fatfs_rollback, METH_VARARGS, "Return a volume to a snapshot"},
+    {"release_snapshot", fatfs_release_snapshot, METH_VARARGS, "Drop a snapshot"},
+    {"enable_checksums", (PyCFunction)(void(*)(void))fatfs_enable_checksums, METH_VARARGS | METH_KEYWORDS, "Verify sectors against a checksum table"},
+    {"disable_checksums", fatfs_disable_checksums, METH_VARARGS, "Stop keeping sector checksums"},
+    {"scrub", fatfs_scrub, METH_VARARGS, "Verify a stretch of a drive against its checksums"},
     {"open", fatfs_open, METH_VARARGS, "Open a file"},
     {"close", fatfs_close, METH_VARARGS, "Close a file"},
     {"read", fatfs_read, METH_VARARGS, "Read from a file"},
     {"write", fatfs_write, METH_VARARGS, "Write to a file"},
     {"format", fatfs_format, METH_VARARGS, "Format a filesystem"},
     {"get_disk_info", fatfs_get_disk_info, METH_VARARGS, "Get disk information"},
+    {"set_backend", fatfs_set_backend, METH_VARARGS, "Select the disk image backend"},
+    {"disk_stats", fatfs_disk_stats, METH_VARARGS, "Get disk I/O counters"},
+    {"set_cache", fatfs_set_cache, METH_VARARGS, "Resize the sector block cache"},
+    {"set_readahead", fatfs_set_readahead, METH_VARARGS, "Set the sequential readahead window"},
+    {"set_throttle", (PyCFunction)(void(*)(void))fatfs_set_throttle, METH_VARARGS | METH_KEYWORDS, "Emulate the timing of a slower device"},
+    {"clear_throttle", fatfs_clear_throttle, METH_VARARGS, "Run a drive at full speed again"},
+    {"open_image", (PyCFunction)(void(*)(void))fatfs_open_image, METH_VARARGS | METH_KEYWORDS, "Attach the disk to an image file"},
+    {"open_ramdisk", (PyCFunction)(void(*)(void))fatfs_open_ramdisk, METH_VARARGS | METH_KEYWORDS, "Attach the disk to a RAM disk"},
+    {"dump_ramdisk", fatfs_dump_ramdisk, METH_VARARGS, "Write a RAM disk to an image file"},
+    {"open_overlay", (PyCFunction)(void(*)(void))fatfs_open_overlay, METH_VARARGS | METH_KEYWORDS, "Attach the disk to a copy-on-write overlay"},
+    {"flatten_overlay", fatfs_flatten_overlay, METH_VARARGS, "Merge an overlay into a standalone image"},
+    {"open_compressed", (PyCFunction)(void(*)(void))fatfs_open_compressed, METH_VARARGS | METH_KEYWORDS, "Attach the disk to a compressed image"},
+    {"export_compressed", fatfs_export_compressed, METH_VARARGS, "Write a compressed image out as a raw image"},
+    {"open_remote", (PyCFunction)(void(*)(void))fatfs_open_remote, METH_VARARGS | METH_KEYWORDS, "Attach the disk to a block server"},
+    {"serve", fatfs_serve, METH_VARARGS, "Serve the disk to other processes"},
     
     // Extended file operations
     {"lseek", fatfs_lseek, METH_VARARGS, "Move read/write pointer"},
@@ -515,6 +1269,7 @@ static PyMethodDef fatfs_methods[] = {
     
     // Volume management
     {"getfree", fatfs_getfree, METH_VARARGS, "Get free space information"},
+    {"fstrim", fatfs_fstrim, METH_VARARGS, "Discard the free clusters of a volume"},
     {"getlabel", fatfs_getlabel, METH_VARARGS, "Get volume label"},
     {"setlabel", fatfs_setlabel, METH_VARARGS, "Set volume label"},
     
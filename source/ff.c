@@ -22,6 +22,13 @@
 #include <string.h>
 #include "ff.h"			/* Basic definitions and declarations of API */
 #include "diskio.h"		/* Declarations of MAI */
+#if defined(__SSE2__)
+#include <emmintrin.h>	/* SSE2 kernels of the FAT scan */
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>	/* SSSE3/AVX2 kernels, selected at run time */
+#define FAT_SCAN_DISPATCH 1
+#endif
 
 /*--------------------------------------------------------------------------
 
@@ -259,6 +266,12 @@
 #if (FF_MAX_SS < FF_MIN_SS) || (FF_MAX_SS != 512 && FF_MAX_SS != 1024 && FF_MAX_SS != 2048 && FF_MAX_SS != 4096) || (FF_MIN_SS != 512 && FF_MIN_SS != 1024 && FF_MIN_SS != 2048 && FF_MIN_SS != 4096)
 #error Wrong sector size configuration
 #endif
+#if FF_FAT_CACHE && (FF_FAT_WINDOW < 1 || FF_FAT_WINDOW > 32)
+#error Wrong FF_FAT_WINDOW setting
+#endif
+#if FF_FREE_BITMAP && FF_INTDEF != 2
+#error FF_FREE_BITMAP wants C99 or later
+#endif
 #if FF_MAX_SS == FF_MIN_SS
 #define SS(fs)	((UINT)FF_MAX_SS)	/* Fixed sector size */
 #else
@@ -1102,6 +1115,397 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* FAT cache - Get a pointer to the FAT contents                         */
+/*-----------------------------------------------------------------------*/
+#if FF_FAT_RAM
+static FRESULT load_fatram (	/* Returns FR_OK, FR_DISK_ERR or FR_NOT_ENOUGH_CORE */
+	FATFS* fs		/* Filesystem object with the FAT geometry set */
+)
+{
+	UINT szb = (UINT)fs->fsize * SS(fs);
+
+
+	fs->fatram = ff_memalloc(szb + (fs->fsize + 7) / 8);	/* FAT followed by its dirty sector bitmap */
+	if (!fs->fatram) return FR_NOT_ENOUGH_CORE;
+	fs->fatdirty = fs->fatram + szb;
+	memset(fs->fatdirty, 0, (fs->fsize + 7) / 8);
+	fs->fdfirst = 0xFFFFFFFF; fs->fdlast = 0;
+	if (disk_read(fs->pdrv, fs->fatram, fs->fatbase, fs->fsize) != RES_OK) {
+		ff_memfree(fs->fatram);
+		fs->fatram = 0;
+		return FR_DISK_ERR;
+	}
+	return FR_OK;
+}
+
+
+#if !FF_FS_READONLY
+static FRESULT flush_fatram (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs		/* Filesystem object */
+)
+{
+	DWORD sect, n;
+
+
+	for (sect = fs->fdfirst; sect <= fs->fdlast; sect += n) {
+		if (!(fs->fatdirty[sect / 8] & 1 << sect % 8)) {	/* Skip clean sectors */
+			n = 1; continue;
+		}
+		for (n = 1; sect + n <= fs->fdlast && (fs->fatdirty[(sect + n) / 8] & 1 << (sect + n) % 8); n++) ;	/* Run of dirty sectors */
+		if (disk_write(fs->pdrv, fs->fatram + sect * SS(fs), fs->fatbase + sect, n) != RES_OK) return FR_DISK_ERR;
+		if (fs->n_fats == 2) disk_write(fs->pdrv, fs->fatram + sect * SS(fs), fs->fatbase + fs->fsize + sect, n);	/* Reflect it to 2nd FAT if needed */
+	}
+	if (fs->fdfirst <= fs->fdlast) memset(fs->fatdirty + fs->fdfirst / 8, 0, fs->fdlast / 8 - fs->fdfirst / 8 + 1);
+	fs->fdfirst = 0xFFFFFFFF; fs->fdlast = 0;
+	return FR_OK;
+}
+#endif
+#endif
+
+
+#if FF_FAT_RAM || (FF_FREE_BITMAP && !FF_FS_READONLY)
+static void free_fat_buffers (
+	FATFS* fs		/* Filesystem object */
+)
+{
+#if FF_FAT_RAM
+	if (fs->fatram) {
+		ff_memfree(fs->fatram);
+		fs->fatram = 0;
+	}
+#endif
+#if FF_FREE_BITMAP && !FF_FS_READONLY
+	if (fs->freemap) {
+		ff_memfree(fs->freemap);
+		fs->freemap = 0;
+	}
+#endif
+}
+#endif
+
+
+#if FF_FAT_CACHE && !FF_FS_READONLY
+static FRESULT flush_fat_slot (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,		/* Filesystem object */
+	UINT i			/* FAT cache slot to be written back */
+)
+{
+	DWORD dm = fs->fcdirty[i];
+	UINT lo, hi;
+	LBA_t sect;
+
+
+	if (dm == 0) return FR_OK;
+	for (lo = 0; !(dm & (DWORD)1 << lo); lo++) ;	/* First and last dirty sector of the window */
+	for (hi = FF_FAT_WINDOW - 1; !(dm & (DWORD)1 << hi); hi--) ;
+	sect = fs->fatbase + (LBA_t)fs->fcwin[i] * FF_FAT_WINDOW + lo;
+	if (disk_write(fs->pdrv, fs->fcbuf[i] + lo * SS(fs), sect, hi - lo + 1) != RES_OK) return FR_DISK_ERR;
+	fs->fcdirty[i] = 0;
+	if (fs->n_fats == 2) disk_write(fs->pdrv, fs->fcbuf[i] + lo * SS(fs), sect + fs->fsize, hi - lo + 1);	/* Reflect it to 2nd FAT if needed */
+	return FR_OK;
+}
+#endif
+
+
+#if (FF_FAT_CACHE || FF_FAT_RAM) && !FF_FS_READONLY
+static FRESULT sync_fat (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs		/* Filesystem object */
+)
+{
+#if FF_FAT_CACHE
+	UINT i;
+#endif
+
+#if FF_FAT_RAM
+	if (fs->fatram) return flush_fatram(fs);
+#endif
+#if FF_FAT_CACHE
+	for (i = 0; i < FF_FAT_CACHE; i++) {
+		if (flush_fat_slot(fs, i) != FR_OK) return FR_DISK_ERR;
+	}
+#endif
+	return FR_OK;
+}
+#endif
+
+
+static BYTE* fat_window (	/* Pointer to the FAT byte, 0:Disk error */
+	FATFS* fs,		/* Filesystem object */
+	DWORD ofs,		/* Byte offset in the FAT */
+	int wr			/* The byte is going to be changed */
+)
+{
+#if FF_FAT_CACHE
+	DWORD wnd;
+	UINT i, n;
+#endif
+
+#if FF_FAT_RAM
+	if (fs->fatram) {	/* Whole FAT in memory? */
+#if !FF_FS_READONLY
+		if (wr) {
+			DWORD sect = ofs / SS(fs);
+
+			fs->fatdirty[sect / 8] |= 1 << sect % 8;
+			if (sect < fs->fdfirst) fs->fdfirst = sect;
+			if (sect > fs->fdlast) fs->fdlast = sect;
+		}
+#endif
+		return fs->fatram + ofs;
+	}
+#endif
+#if FF_FAT_CACHE
+	wnd = ofs / SS(fs) / FF_FAT_WINDOW;	/* FAT window of the byte */
+	i = fs->fclast;
+	if (fs->fcwin[i] != wnd) {	/* Not in the last used slot? */
+		for (i = 0; i < FF_FAT_CACHE && fs->fcwin[i] != wnd; i++) ;
+		if (i == FF_FAT_CACHE) {	/* Not in the cache, load it into the least recently used slot */
+			UINT j;
+
+			for (i = 0, j = 1; j < FF_FAT_CACHE; j++) {
+				if (fs->fcused[j] < fs->fcused[i]) i = j;
+			}
+#if !FF_FS_READONLY
+			if (flush_fat_slot(fs, i) != FR_OK) return 0;
+#endif
+			n = FF_FAT_WINDOW;	/* The last window ends with the FAT */
+			if ((DWORD)n > fs->fsize - wnd * FF_FAT_WINDOW) n = (UINT)(fs->fsize - wnd * FF_FAT_WINDOW);
+			fs->fcwin[i] = 0xFFFFFFFF;
+			if (disk_read(fs->pdrv, fs->fcbuf[i], fs->fatbase + (LBA_t)wnd * FF_FAT_WINDOW, n) != RES_OK) return 0;
+			fs->fcwin[i] = wnd;
+		}
+		fs->fclast = i;
+	}
+	fs->fcused[i] = ++fs->fctick;
+	ofs -= wnd * FF_FAT_WINDOW * SS(fs);
+#if !FF_FS_READONLY
+	if (wr) fs->fcdirty[i] |= (DWORD)1 << (ofs / SS(fs));
+#endif
+	return fs->fcbuf[i] + ofs;
+#else
+	if (move_window(fs, fs->fatbase + ofs / SS(fs)) != FR_OK) return 0;
+#if !FF_FS_READONLY
+	if (wr) fs->wflag = 1;
+#endif
+	return fs->win + ofs % SS(fs);
+#endif
+}
+
+
+
+
+#if !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT access - Find free entries 32 at a time                           */
+/*-----------------------------------------------------------------------*/
+
+static UINT count_bits (	/* Number of set bits */
+	DWORD m			/* Bits to count */
+)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return (UINT)__builtin_popcount(m);
+#else
+	m = m - (m >> 1 & 0x55555555);
+	m = (m & 0x33333333) + (m >> 2 & 0x33333333);
+	return (UINT)(((m + (m >> 4)) & 0x0F0F0F0F) * 0x01010101 >> 24);
+#endif
+}
+
+
+/* Each kernel returns a mask with bit i set when the entry i of 32 packed
+/  entries at p is zero. p needs not be aligned. */
+
+static DWORD zero_mask12 (const BYTE* p)
+{
+	DWORD m = 0, v;
+	UINT i;
+
+	for (i = 0; i < 32; i += 2, p += 3) {	/* Two entries in three bytes */
+		v = p[0] | (DWORD)p[1] << 8 | (DWORD)p[2] << 16;
+		if ((v & 0xFFF) == 0) m |= (DWORD)1 << i;
+		if ((v & 0xFFF000) == 0) m |= (DWORD)2 << i;
+	}
+	return m;
+}
+
+
+static DWORD zero_mask16 (const BYTE* p)
+{
+#if defined(__SSE2__)
+	const __m128i z = _mm_setzero_si128();
+	DWORD m = 0;
+	UINT i;
+
+	for (i = 0; i < 32; i += 16, p += 32) {	/* Compare 16 entries and pack the results into bytes */
+		__m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)p), z);
+		__m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(p + 16)), z);
+		m |= (DWORD)_mm_movemask_epi8(_mm_packs_epi16(a, b)) << i;
+	}
+	return m;
+#else
+	DWORD m = 0;
+	UINT i;
+
+	for (i = 0; i < 32; i++, p += 2) {
+		if (ld_16(p) == 0) m |= (DWORD)1 << i;
+	}
+	return m;
+#endif
+}
+
+
+static DWORD zero_mask32 (const BYTE* p)
+{
+#if defined(__SSE2__)
+	const __m128i z = _mm_setzero_si128(), msk = _mm_set1_epi32(0x0FFFFFFF);
+	DWORD m = 0;
+	UINT i;
+
+	for (i = 0; i < 32; i += 16, p += 64) {	/* Upper 4 bits of the FAT32 entry are reserved */
+		__m128i a = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i*)p), msk), z);
+		__m128i b = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i*)(p + 16)), msk), z);
+		__m128i c = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i*)(p + 32)), msk), z);
+		__m128i d = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i*)(p + 48)), msk), z);
+		m |= (DWORD)_mm_movemask_epi8(_mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d))) << i;
+	}
+	return m;
+#else
+	DWORD m = 0;
+	UINT i;
+
+	for (i = 0; i < 32; i++, p += 4) {
+		if ((ld_32(p) & 0x0FFFFFFF) == 0) m |= (DWORD)1 << i;
+	}
+	return m;
+#endif
+}
+
+
+#ifdef FAT_SCAN_DISPATCH
+__attribute__((target("ssse3")))
+static DWORD zero_mask12_ssse3 (const BYTE* p)
+{
+	/* Spread each 3-byte pair into two words, then mask off the nibble of the other entry */
+	const __m128i shf = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+	const __m128i sht = _mm_setr_epi8(4, 5, 5, 6, 7, 8, 8, 9, 10, 11, 11, 12, 13, 14, 14, 15);
+	const __m128i msk = _mm_setr_epi16(0x0FFF, (short)0xFFF0, 0x0FFF, (short)0xFFF0, 0x0FFF, (short)0xFFF0, 0x0FFF, (short)0xFFF0);
+	const __m128i z = _mm_setzero_si128();
+	__m128i e0, e1, e2, e3;
+
+	e0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), shf);			/* Entries 0-7 */
+	e1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 12)), shf);	/* Entries 8-15 */
+	e2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 24)), shf);	/* Entries 16-23 */
+	e3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), sht);	/* Entries 24-31, loaded so as not to pass the 48 bytes */
+	e0 = _mm_cmpeq_epi16(_mm_and_si128(e0, msk), z);
+	e1 = _mm_cmpeq_epi16(_mm_and_si128(e1, msk), z);
+	e2 = _mm_cmpeq_epi16(_mm_and_si128(e2, msk), z);
+	e3 = _mm_cmpeq_epi16(_mm_and_si128(e3, msk), z);
+	return (DWORD)_mm_movemask_epi8(_mm_packs_epi16(e0, e1)) | (DWORD)_mm_movemask_epi8(_mm_packs_epi16(e2, e3)) << 16;
+}
+
+
+__attribute__((target("avx2")))
+static DWORD zero_mask16_avx2 (const BYTE* p)
+{
+	const __m256i z = _mm256_setzero_si256();
+	__m256i a = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)p), z);
+	__m256i b = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(p + 32)), z);
+
+	/* Packing works within 128-bit lanes, put the quadwords back in entry order */
+	return (DWORD)_mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8));
+}
+
+
+__attribute__((target("avx2")))
+static DWORD zero_mask32_avx2 (const BYTE* p)
+{
+	const __m256i z = _mm256_setzero_si256(), msk = _mm256_set1_epi32(0x0FFFFFFF);
+	__m256i a = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i*)p), msk), z);
+	__m256i b = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i*)(p + 32)), msk), z);
+	__m256i c = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i*)(p + 64)), msk), z);
+	__m256i d = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i*)(p + 96)), msk), z);
+	__m256i r = _mm256_packs_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+
+	return (DWORD)_mm256_movemask_epi8(_mm256_permutevar8x32_epi32(r, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7)));
+}
+#endif
+
+
+static DWORD (*zero_mask[3])(const BYTE*);	/* Kernels for FAT12, FAT16 and FAT32 */
+
+static void init_zero_mask (void)
+{
+	zero_mask[0] = zero_mask12;
+	zero_mask[1] = zero_mask16;
+	zero_mask[2] = zero_mask32;
+#ifdef FAT_SCAN_DISPATCH
+	if (__builtin_cpu_supports("ssse3")) zero_mask[0] = zero_mask12_ssse3;
+	if (__builtin_cpu_supports("avx2")) {
+		zero_mask[1] = zero_mask16_avx2;
+		zero_mask[2] = zero_mask32_avx2;
+	}
+#endif
+}
+
+
+static FRESULT fat_free_mask (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,		/* Filesystem object (FAT12/16/32) */
+	DWORD clst,		/* First entry of the 32, a multiple of 32 */
+	DWORD* mask		/* Returns bit i set if the cluster clst + i is free */
+)
+{
+	UINT ps = fs->fs_type == FS_FAT12 ? 3 : fs->fs_type == FS_FAT16 ? 4 : 8;	/* Size of an entry pair */
+	UINT gsz = ps * 16, span, i;
+	DWORD ofs = clst / 2 * ps, wsz, m;
+	BYTE *p, buf[128];
+
+
+	if (!zero_mask[0]) init_zero_mask();
+	p = fat_window(fs, ofs, 0);
+	if (!p) return FR_DISK_ERR;
+#if FF_FAT_RAM
+	if (fs->fatram) {
+		wsz = fs->fsize * SS(fs);
+		span = (UINT)(wsz - ofs);
+	} else
+#endif
+	{
+#if FF_FAT_CACHE
+		wsz = FF_FAT_WINDOW * SS(fs);
+#else
+		wsz = SS(fs);
+#endif
+		span = (UINT)(wsz - ofs % wsz);	/* Bytes left in the window */
+	}
+	if (span < gsz) {	/* The entries straddle a window boundary (FAT12) or the FAT end, gather them */
+		for (i = 0; ; ) {
+			if (span > gsz - i) span = gsz - i;
+			memcpy(buf + i, p, span);
+			i += span;
+			if (i == gsz) break;
+			if (ofs + i >= fs->fsize * SS(fs)) {	/* Past the FAT end */
+				memset(buf + i, 0xFF, gsz - i);
+				break;
+			}
+			p = fat_window(fs, ofs + i, 0);
+			if (!p) return FR_DISK_ERR;
+			span = (UINT)wsz;	/* From the top of the next window */
+		}
+		p = buf;
+	}
+	m = zero_mask[fs->fs_type - FS_FAT12](p);
+	if (clst == 0) m &= ~(DWORD)3;	/* Entries 0 and 1 are not clusters */
+	if (fs->n_fatent - clst < 32) m &= ((DWORD)1 << (fs->n_fatent - clst)) - 1;	/* Entries past the last cluster */
+	*mask = m;
+	return FR_OK;
+}
+#endif
+
+
+
+
 #if !FF_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* Synchronize filesystem and data on the storage                        */
@@ -1115,6 +1519,9 @@ static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 	res = sync_window(fs);
+#if FF_FAT_CACHE || FF_FAT_RAM
+	if (res == FR_OK) res = sync_fat(fs);
+#endif
 	if (res == FR_OK) {
 		if (fs->fsi_flag == 1) {	/* Allocation changed? */
 			fs->fsi_flag = 0;
@@ -1180,6 +1587,7 @@ static DWORD get_fat (		/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFF
 {
 	UINT wc, bc;
 	DWORD val;
+	BYTE *p;
 	FATFS *fs = obj->fs;
 
 
@@ -1192,21 +1600,21 @@ static DWORD get_fat (		/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFF
 		switch (fs->fs_type) {
 		case FS_FAT12 :
 			bc = (UINT)clst; bc += bc / 2;
-			if (move_window(fs, fs->fatbase + (bc / SS(fs))) != FR_OK) break;
-			wc = fs->win[bc++ % SS(fs)];		/* Get 1st byte of the entry */
-			if (move_window(fs, fs->fatbase + (bc / SS(fs))) != FR_OK) break;
-			wc |= fs->win[bc % SS(fs)] << 8;	/* Merge 2nd byte of the entry */
+			if ((p = fat_window(fs, bc++, 0)) == 0) break;
+			wc = *p;							/* Get 1st byte of the entry */
+			if ((p = fat_window(fs, bc, 0)) == 0) break;
+			wc |= *p << 8;						/* Merge 2nd byte of the entry */
 			val = (clst & 1) ? (wc >> 4) : (wc & 0xFFF);	/* Adjust bit position */
 			break;
 
 		case FS_FAT16 :
-			if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 2))) != FR_OK) break;
-			val = ld_16(fs->win + clst * 2 % SS(fs));		/* Simple WORD array */
+			if ((p = fat_window(fs, clst * 2, 0)) == 0) break;
+			val = ld_16(p);		/* Simple WORD array */
 			break;
 
 		case FS_FAT32 :
-			if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 4))) != FR_OK) break;
-			val = ld_32(fs->win + clst * 4 % SS(fs)) & 0x0FFFFFFF;	/* Simple DWORD array but mask out upper 4 bits */
+			if ((p = fat_window(fs, clst * 4, 0)) == 0) break;
+			val = ld_32(p) & 0x0FFFFFFF;	/* Simple DWORD array but mask out upper 4 bits */
 			break;
 #if FF_FS_EXFAT
 		case FS_EXFAT :
@@ -1226,8 +1634,8 @@ static DWORD get_fat (		/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFF
 					if (obj->n_frag != 0) {	/* Is it on the growing edge? */
 						val = 0x7FFFFFFF;	/* Generate EOC */
 					} else {
-						if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 4))) != FR_OK) break;
-						val = ld_32(fs->win + clst * 4 % SS(fs)) & 0x7FFFFFFF;
+						if ((p = fat_window(fs, clst * 4, 0)) == 0) break;
+						val = ld_32(p) & 0x7FFFFFFF;
 					}
 					break;
 				}
@@ -1266,38 +1674,43 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 		switch (fs->fs_type) {
 		case FS_FAT12:
 			bc = (UINT)clst; bc += bc / 2;	/* bc: byte offset of the entry */
-			res = move_window(fs, fs->fatbase + (bc / SS(fs)));
-			if (res != FR_OK) break;
-			p = fs->win + bc++ % SS(fs);
+			res = FR_DISK_ERR;
+			if ((p = fat_window(fs, bc++, 1)) == 0) break;
 			*p = (clst & 1) ? ((*p & 0x0F) | ((BYTE)val << 4)) : (BYTE)val;	/* Update 1st byte */
-			fs->wflag = 1;
-			res = move_window(fs, fs->fatbase + (bc / SS(fs)));
-			if (res != FR_OK) break;
-			p = fs->win + bc % SS(fs);
+			if ((p = fat_window(fs, bc, 1)) == 0) break;
 			*p = (clst & 1) ? (BYTE)(val >> 4) : ((*p & 0xF0) | ((BYTE)(val >> 8) & 0x0F));	/* Update 2nd byte */
-			fs->wflag = 1;
+			res = FR_OK;
 			break;
 
 		case FS_FAT16:
-			res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 2)));
-			if (res != FR_OK) break;
-			st_16(fs->win + clst * 2 % SS(fs), (WORD)val);	/* Simple WORD array */
-			fs->wflag = 1;
+			res = FR_DISK_ERR;
+			if ((p = fat_window(fs, clst * 2, 1)) == 0) break;
+			st_16(p, (WORD)val);	/* Simple WORD array */
+			res = FR_OK;
 			break;
 
 		case FS_FAT32:
 #if FF_FS_EXFAT
 		case FS_EXFAT:
 #endif
-			res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 4)));
-			if (res != FR_OK) break;
+			res = FR_DISK_ERR;
+			if ((p = fat_window(fs, clst * 4, 1)) == 0) break;
 			if (!FF_FS_EXFAT || fs->fs_type != FS_EXFAT) {
-				val = (val & 0x0FFFFFFF) | (ld_32(fs->win + clst * 4 % SS(fs)) & 0xF0000000);
+				val = (val & 0x0FFFFFFF) | (ld_32(p) & 0xF0000000);
 			}
-			st_32(fs->win + clst * 4 % SS(fs), val);
-			fs->wflag = 1;
+			st_32(p, val);
+			res = FR_OK;
 			break;
 		}
+#if FF_FREE_BITMAP
+		if (res == FR_OK && fs->freemap) {	/* Reflect the change to the free cluster bitmap */
+			if (val) {
+				fs->freemap[clst / 64] |= (QWORD)1 << clst % 64;
+			} else {
+				fs->freemap[clst / 64] &= ~((QWORD)1 << clst % 64);
+			}
+		}
+#endif
 	}
 	return res;
 }
@@ -1532,6 +1945,84 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 
 
 
+#if FF_FREE_BITMAP && !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Free cluster bitmap                                    */
+/*-----------------------------------------------------------------------*/
+
+static UINT lowest_bit (	/* Index of the lowest set bit */
+	QWORD m			/* Bits to scan (not 0) */
+)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return (UINT)__builtin_ctzll(m);
+#else
+	UINT n = 0;
+
+	while (!(m & 1)) {
+		m >>= 1; n++;
+	}
+	return n;
+#endif
+}
+
+
+static int build_freemap (	/* 1:Built, 0:Not built (no memory or disk error) */
+	FFOBJID* obj	/* Object on the volume */
+)
+{
+	FATFS *fs = obj->fs;
+	DWORD nw = (fs->n_fatent + 63) / 64, clst, nfree = 0, m;
+
+
+	fs->freemap = ff_memalloc(nw * sizeof (QWORD));
+	if (!fs->freemap) return 0;
+	memset(fs->freemap, 0, nw * sizeof (QWORD));
+	fs->freemap[0] = 3;		/* Clusters 0 and 1 do not exist */
+	for (clst = fs->n_fatent; clst < nw * 64; clst++) {	/* Nor do the ones past the end */
+		fs->freemap[clst / 64] |= (QWORD)1 << clst % 64;
+	}
+	for (clst = 0; clst < fs->n_fatent; clst += 32) {	/* Mark the clusters in use */
+		if (fat_free_mask(fs, clst, &m) != FR_OK) {
+			ff_memfree(fs->freemap);
+			fs->freemap = 0;
+			return 0;
+		}
+		fs->freemap[clst / 64] |= (QWORD)(DWORD)~m << clst % 64;
+		nfree += count_bits(m);
+	}
+	if (fs->free_clst != nfree) {	/* The scan also gives the free cluster count */
+		fs->free_clst = nfree;
+		fs->fsi_flag |= 1;
+	}
+	return 1;
+}
+
+
+static DWORD find_freemap (	/* 0:No free cluster, >=2:Free cluster# */
+	FATFS* fs,		/* Filesystem object */
+	DWORD scl		/* Cluster to search after */
+)
+{
+	DWORD nw = (fs->n_fatent + 63) / 64, w, n;
+	QWORD m;
+
+
+	w = ++scl < fs->n_fatent ? scl / 64 : 0;
+	m = ~fs->freemap[w];
+	if (scl < fs->n_fatent) m &= ~(QWORD)0 << scl % 64;	/* Clusters from scl in the first word */
+	for (n = 0; n <= nw; n++) {	/* Ends back in the first word for the clusters before scl */
+		if (m) return w * 64 + lowest_bit(m);
+		if (++w == nw) w = 0;
+		m = ~fs->freemap[w];
+	}
+	return 0;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* FAT handling - Stretch a chain or Create a new chain                  */
 /*-----------------------------------------------------------------------*/
@@ -1598,6 +2089,12 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 				ncl = 0;
 			}
 		}
+#if FF_FREE_BITMAP
+		if (ncl == 0 && (fs->freemap || build_freemap(obj))) {	/* Find another fragment in the bitmap */
+			ncl = find_freemap(fs, scl);
+			if (ncl == 0) return 0;				/* No free cluster found? */
+		}
+#endif
 		if (ncl == 0) {	/* The new cluster cannot be contiguous and find another fragment */
 			ncl = scl;	/* Start cluster */
 			for (;;) {
@@ -3371,9 +3868,18 @@ static UINT check_fs (	/* 0:FAT/FAT32 VBR, 1:exFAT VBR, 2:Not FAT and valid BS,
 {
 	WORD w, sign;
 	BYTE b;
+#if FF_FAT_CACHE
+	UINT i;
+#endif
 
 
 	fs->wflag = 0; fs->winsect = (LBA_t)0 - 1;		/* Invaidate window */
+#if FF_FAT_CACHE
+	for (i = 0; i < FF_FAT_CACHE; i++) {	/* Invalidate FAT cache */
+		fs->fcwin[i] = 0xFFFFFFFF; fs->fcdirty[i] = 0; fs->fcused[i] = 0;
+	}
+	fs->fctick = 0; fs->fclast = 0;
+#endif
 	if (move_window(fs, sect) != FR_OK) return 4;	/* Load the boot sector */
 	sign = ld_16(fs->win + BS_55AA);
 #if FF_FS_EXFAT
@@ -3499,6 +4005,9 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 	/* Following code attempts to mount the volume. (find an FAT volume, analyze the BPB and initialize the filesystem object) */
 
 	fs->fs_type = 0;					/* Invalidate the filesystem object */
+#if FF_FAT_RAM || (FF_FREE_BITMAP && !FF_FS_READONLY)
+	free_fat_buffers(fs);				/* Discard the FAT copies of the last mount */
+#endif
 	stat = disk_initialize(fs->pdrv);	/* Initialize the volume hosting physical drive */
 	if (stat & STA_NOINIT) { 			/* Check if the initialization succeeded */
 		return FR_NOT_READY;			/* Failed to initialize due to no medium or hard error */
@@ -3661,6 +4170,14 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 #endif	/* !FF_FS_READONLY */
 	}
 
+#if FF_FAT_RAM
+	if (fs->mopt & MNT_FAT_RAM) {	/* Load the whole FAT if requested */
+		FRESULT res = load_fatram(fs);
+
+		if (res != FR_OK) return res;
+	}
+#endif
+
 	fs->fs_type = (BYTE)fmt;/* FAT sub-type (the filesystem object gets valid) */
 	fs->id = ++Fsid;		/* Volume mount ID */
 
@@ -3739,7 +4256,7 @@ static FRESULT validate (	/* Returns FR_OK or FR_INVALID_OBJECT */
 FRESULT f_mount (
 	FATFS* fs,			/* Pointer to the filesystem object to be registered (NULL:unmount)*/
 	const TCHAR* path,	/* Logical drive number to be mounted/unmounted */
-	BYTE opt			/* Mount option: 0=Do not mount (delayed mount), 1=Mount immediately */
+	BYTE opt			/* Mount option: b0:Mount immediately (0=delayed mount), MNT_FAT_RAM */
 )
 {
 	FATFS *cfs;
@@ -3762,6 +4279,9 @@ FRESULT f_mount (
 		ff_mutex_delete(vol);
 #endif
 		cfs->fs_type = 0;		/* Invalidate the filesystem object to be unregistered */
+#if FF_FAT_RAM || (FF_FREE_BITMAP && !FF_FS_READONLY)
+		free_fat_buffers(cfs);
+#endif
 	}
 
 	if (fs) {					/* Register new filesystem object */
@@ -3780,10 +4300,17 @@ FRESULT f_mount (
 #endif
 #endif
 		fs->fs_type = 0;		/* Invalidate the new filesystem object */
+#if FF_FAT_RAM
+		fs->mopt = opt & MNT_FAT_RAM;
+		fs->fatram = 0;
+#endif
+#if FF_FREE_BITMAP && !FF_FS_READONLY
+		fs->freemap = 0;
+#endif
 		FatFs[vol] = fs;		/* Register it */
 	}
 
-	if (opt == 0) return FR_OK;	/* Do not mount now, it will be mounted in subsequent file functions */
+	if (!(opt & 1)) return FR_OK;	/* Do not mount now, it will be mounted in subsequent file functions */
 
 	res = mount_volume(&path, &fs, 0);	/* Force mounted the volume in this function */
 	LEAVE_FF(fs, res);
@@ -4287,6 +4814,29 @@ FRESULT f_sync (
 	LEAVE_FF(fs, res);
 }
 
+
+
+
+/*-----------------------------------------------------------------------*/
+/* API: Synchronize the Filesystem                                       */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_syncfs (
+	const TCHAR* path	/* Logical drive number */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = mount_volume(&path, &fs, 0);	/* Get logical drive */
+	if (res == FR_OK) {
+		res = sync_fs(fs);	/* Flush the window and FSInfo, then CTRL_SYNC the lower layer */
+	}
+
+	LEAVE_FF(fs, res);
+}
+
 #endif /* !FF_FS_READONLY */
 
 
@@ -4945,9 +5495,10 @@ FRESULT f_getfree (
 	FRESULT res;
 	FATFS *fs;
 	DWORD nfree, clst, stat;
+#if FF_FS_EXFAT
 	LBA_t sect;
 	UINT i;
-	FFOBJID obj;
+#endif
 
 
 	/* Get logical drive and mount the volume if needed */
@@ -4961,58 +5512,32 @@ FRESULT f_getfree (
 		} else {
 			/* Scan FAT to obtain the correct free cluster count */
 			nfree = 0;
-			if (fs->fs_type == FS_FAT12) {	/* FAT12: Scan bit field FAT entries */
-				clst = 2; obj.fs = fs;
-				do {
-					stat = get_fat(&obj, clst);
-					if (stat == 0xFFFFFFFF) {
-						res = FR_DISK_ERR; break;
+#if FF_FS_EXFAT
+			if (fs->fs_type == FS_EXFAT) {	/* exFAT: Scan allocation bitmap */
+				BYTE bm;
+				UINT b;
+
+				clst = fs->n_fatent - 2;	/* Number of clusters */
+				sect = fs->bitbase;			/* Bitmap sector */
+				i = 0;						/* Offset in the sector */
+				do {	/* Counts numbuer of clear bits (free clusters) in the bitmap */
+					if (i == 0) {	/* New sector? */
+						res = move_window(fs, sect++);
+						if (res != FR_OK) break;
 					}
-					if (stat == 1) {
-						res = FR_INT_ERR; break;
+					for (b = 8, bm = ~fs->win[i]; b && clst; b--, clst--) {	/* Count clear bits in a byte */
+						nfree += bm & 1;
+						bm >>= 1;
 					}
-					if (stat == 0) nfree++;
-				} while (++clst < fs->n_fatent);
-			} else {
-#if FF_FS_EXFAT
-				if (fs->fs_type == FS_EXFAT) {	/* exFAT: Scan allocation bitmap */
-					BYTE bm;
-					UINT b;
-
-					clst = fs->n_fatent - 2;	/* Number of clusters */
-					sect = fs->bitbase;			/* Bitmap sector */
-					i = 0;						/* Offset in the sector */
-					do {	/* Counts numbuer of clear bits (free clusters) in the bitmap */
-						if (i == 0) {	/* New sector? */
-							res = move_window(fs, sect++);
-							if (res != FR_OK) break;
-						}
-						for (b = 8, bm = ~fs->win[i]; b && clst; b--, clst--) {	/* Count clear bits in a byte */
-							nfree += bm & 1;
-							bm >>= 1;
-						}
-						i = (i + 1) % SS(fs);	/* Next byte */
-					} while (clst);
-				} else
+					i = (i + 1) % SS(fs);	/* Next byte */
+				} while (clst);
+			} else
 #endif
-				{	/* FAT16/32: Scan WORD/DWORD FAT entries */
-					clst = fs->n_fatent;	/* Number of entries */
-					sect = fs->fatbase;		/* Top of the FAT */
-					i = 0;					/* Offset in the sector */
-					do {	/* Counts numbuer of entries with zero in the FAT */
-						if (i == 0) {	/* New sector? */
-							res = move_window(fs, sect++);
-							if (res != FR_OK) break;
-						}
-						if (fs->fs_type == FS_FAT16) {
-							if (ld_16(fs->win + i) == 0) nfree++;	/* FAT16: Is this cluster free? */
-							i += 2;	/* Next entry */
-						} else {
-							if ((ld_32(fs->win + i) & 0x0FFFFFFF) == 0) nfree++;	/* FAT32: Is this cluster free? */
-							i += 4;	/* Next entry */
-						}
-						i %= SS(fs);
-					} while (--clst);
+			{	/* FAT12/16/32: Count zero entries 32 at a time */
+				for (clst = 0; clst < fs->n_fatent; clst += 32) {
+					res = fat_free_mask(fs, clst, &stat);
+					if (res != FR_OK) break;
+					nfree += count_bits(stat);
 				}
 			}
 			if (res == FR_OK) {		/* Update parameters if succeeded */
@@ -5029,6 +5554,71 @@ FRESULT f_getfree (
 
 
 
+#if FF_USE_TRIM
+/*-----------------------------------------------------------------------*/
+/* API: Discard All Free Clusters                                        */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_trim (
+	const TCHAR* path,	/* Logical drive number */
+	DWORD* nclst,		/* Pointer to a variable to return number of discarded clusters */
+	FATFS** fatfs		/* Pointer to a pointer to return corresponding filesystem object */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst, scl, stat, ntrim = 0;
+	LBA_t rt[2];
+	FFOBJID obj;
+
+
+	res = mount_volume(&path, &fs, FA_WRITE);	/* Get logical drive */
+	if (res == FR_OK) {
+		*fatfs = fs;				/* Return ptr to the fs object */
+		obj.fs = fs;
+		scl = 0;	/* Top of the current free block (0:none) */
+		for (clst = 2; clst <= fs->n_fatent; clst++) {	/* The entry past the end closes the last block */
+			stat = 1;
+			if (clst < fs->n_fatent) {
+#if FF_FS_EXFAT
+				if (fs->fs_type == FS_EXFAT) {	/* exFAT: Test the bit in the allocation bitmap */
+					res = move_window(fs, fs->bitbase + (clst - 2) / 8 / SS(fs));
+					if (res != FR_OK) break;
+					stat = (fs->win[(clst - 2) / 8 % SS(fs)] >> ((clst - 2) % 8)) & 1;
+				} else
+#endif
+				{	/* FAT12/16/32: Test the FAT entry */
+					stat = get_fat(&obj, clst);
+					if (stat == 0xFFFFFFFF) {
+						res = FR_DISK_ERR; break;
+					}
+					if (stat == 1) {
+						res = FR_INT_ERR; break;
+					}
+				}
+			}
+			if (stat == 0) {	/* Free cluster? */
+				if (scl == 0) scl = clst;
+			} else if (scl != 0) {	/* End of a free block */
+				rt[0] = clst2sect(fs, scl);					/* Start of the free data area */
+				rt[1] = clst2sect(fs, clst - 1) + fs->csize - 1;	/* End of the free data area */
+				if (disk_ioctl(fs->pdrv, CTRL_TRIM, rt) != RES_OK) {
+					res = FR_DISK_ERR; break;
+				}
+				ntrim += clst - scl;
+				scl = 0;
+			}
+		}
+		if (res == FR_OK) *nclst = ntrim;
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* API: Truncate File                                                    */
 /*-----------------------------------------------------------------------*/
@@ -184,8 +184,28 @@ typedef struct {
 	FFXCWDS	xcwds;		/* Crrent working directory structure */
 	FFXCWDS	xcwds2;		/* Working buffer to follow the path */
 #endif
+#endif
+#if FF_FAT_RAM
+	BYTE	mopt;		/* Mount options (MNT_FAT_RAM) */
+	BYTE*	fatram;		/* Whole FAT in memory (0:not loaded) */
+	BYTE*	fatdirty;	/* Dirty sectors of fatram[] (bitmap) */
+	DWORD	fdfirst;	/* First dirty sector of fatram[] (fdfirst > fdlast:none) */
+	DWORD	fdlast;		/* Last dirty sector of fatram[] */
+#endif
+#if FF_FREE_BITMAP && !FF_FS_READONLY
+	QWORD*	freemap;	/* Free cluster bitmap, bit set: in use (0:not built) */
+#endif
+#if FF_FAT_CACHE
+	DWORD	fcwin[FF_FAT_CACHE];	/* FAT window held in each FAT cache slot (0xFFFFFFFF:empty) */
+	DWORD	fcdirty[FF_FAT_CACHE];	/* Dirty sectors of each slot (b0:1st sector of the window) */
+	DWORD	fcused[FF_FAT_CACHE];	/* Last use of each slot */
+	DWORD	fctick;		/* FAT cache use counter */
+	UINT	fclast;		/* Slot of the last FAT access */
 #endif
 	BYTE	win[FF_MAX_SS];	/* Disk access window for directory, FAT (and file data in tiny cfg) */
+#if FF_FAT_CACHE
+	BYTE	fcbuf[FF_FAT_CACHE][FF_FAT_WINDOW * FF_MAX_SS];	/* FAT cache windows */
+#endif
 } FATFS;
 
 
@@ -327,6 +347,7 @@ FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data t
 FRESULT f_lseek (FIL* fp, FSIZE_t ofs);								/* Move file pointer of the file object */
 FRESULT f_truncate (FIL* fp);										/* Truncate the file */
 FRESULT f_sync (FIL* fp);											/* Flush cached data of the writing file */
+FRESULT f_syncfs (const TCHAR* path);								/* Flush cached data of the filesystem */
 FRESULT f_opendir (DIR* dp, const TCHAR* path);						/* Open a directory */
 FRESULT f_closedir (DIR* dp);										/* Close an open directory */
 FRESULT f_readdir (DIR* dp, FILINFO* fno);							/* Read a directory item */
@@ -342,6 +363,7 @@ FRESULT f_chdir (const TCHAR* path);								/* Change current directory */
 FRESULT f_chdrive (const TCHAR* path);								/* Change current drive */
 FRESULT f_getcwd (TCHAR* buff, UINT len);							/* Get current directory */
 FRESULT f_getfree (const TCHAR* path, DWORD* nclst, FATFS** fatfs);	/* Get number of free clusters on the drive */
+FRESULT f_trim (const TCHAR* path, DWORD* nclst, FATFS** fatfs);		/* Discard the free clusters on the drive */
 FRESULT f_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume label */
 FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
@@ -390,7 +412,7 @@ DWORD ff_wtoupper (DWORD uni);			/* Unicode upper-case conversion */
 
 /* O/S dependent functions (samples available in ffsystem.c) */
 
-#if FF_USE_LFN == 3		/* Dynamic memory allocation */
+#if FF_USE_LFN == 3 || FF_FAT_RAM || FF_FREE_BITMAP	/* Dynamic memory allocation */
 void* ff_memalloc (UINT msize);		/* Allocate memory block */
 void ff_memfree (void* mblock);		/* Free memory block */
 #endif
@@ -420,6 +442,9 @@ void ff_mutex_give (int vol);		/* Unlock sync object */
 /* Fast seek controls (2nd argument of f_lseek function) */
 #define CREATE_LINKMAP	((FSIZE_t)0 - 1)
 
+/* Mount options (3rd argument of f_mount function) */
+#define MNT_FAT_RAM	0x02	/* Keep the whole FAT in memory (FF_FAT_RAM) */
+
 /* Format options (2nd argument of f_mkfs function) */
 #define FM_FAT		0x01
 #define FM_FAT32	0x02
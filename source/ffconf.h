@@ -34,7 +34,7 @@
 /* This option switches f_mkfs(). (0:Disable or 1:Enable) */
 
 
-#define FF_USE_FASTSEEK	0
+#define FF_USE_FASTSEEK	1
 /* This option switches fast seek feature. (0:Disable or 1:Enable) */
 
 
@@ -178,7 +178,7 @@
 / Drive/Volume Configurations
 /---------------------------------------------------------------------------*/
 
-#define FF_VOLUMES		1
+#define FF_VOLUMES		10
 /* Number of volumes (logical drives) to be used. (1-10) */
 
 
@@ -206,7 +206,7 @@
 
 
 #define FF_MIN_SS		512
-#define FF_MAX_SS		512
+#define FF_MAX_SS		4096
 /* This set of options configures the range of sector size to be supported. (512,
 /  1024, 2048 or 4096) Always set both 512 for most systems, generic memory card and
 /  harddisk, but a larger value may be required for on-board flash memory and some
@@ -225,7 +225,7 @@
 /  f_fdisk(). 2^32 sectors maximum. This option has no effect when FF_LBA64 == 0. */
 
 
-#define FF_USE_TRIM		0
+#define FF_USE_TRIM		1
 /* This option switches support for ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable this feature, also CTRL_TRIM command should be implemented to
 /  the disk_ioctl(). */
@@ -243,6 +243,33 @@
 /  buffer in the filesystem object (FATFS) is used for the file data transfer. */
 
 
+#define FF_FAT_CACHE	4
+#define FF_FAT_WINDOW	8
+/* This set of options configures the FAT cache, FF_FAT_CACHE windows of FF_FAT_WINDOW
+/  consecutive FAT sectors (1-32) kept apart from the disk access window win[].
+/  Following a cluster chain or searching for a free cluster then does not evict the
+/  directory sector, and each window is written back with its copy in the 2nd FAT
+/  in one disk_write() at sync. FF_FAT_CACHE == 0 accesses the FAT through win[].
+/  The FAT cache adds FF_FAT_CACHE * FF_FAT_WINDOW * FF_MAX_SS bytes to FATFS. */
+
+
+#define FF_FAT_RAM		1
+/* This option switches support for keeping the whole FAT in memory. (0:Disable or
+/  1:Enable) A volume mounted with the MNT_FAT_RAM option of f_mount() loads the FAT
+/  into a heap block at mount and writes only the changed FAT sectors back at sync.
+/  To enable this feature, ff_memalloc() and ff_memfree() need to be added to the
+/  project. */
+
+
+#define FF_FREE_BITMAP	1
+/* This option switches the free cluster bitmap of FAT12/16/32 volumes. (0:Disable or
+/  1:Enable) It is built from the FAT when a cluster is first allocated after mount and
+/  kept up to date on every FAT change, so finding a free cluster scans 64 clusters per
+/  step instead of reading one FAT entry at a time. It takes n_fatent / 8 bytes from
+/  ff_memalloc(), a volume falls back to the FAT scan if it cannot be allocated.
+/  To enable this feature, C99 or later is needed. (FF_INTDEF == 2) */
+
+
 #define FF_FS_EXFAT		0
 /* This option switches support for exFAT filesystem. (0:Disable or 1:Enable)
 /  To enable exFAT, also LFN needs to be enabled. (FF_USE_LFN >= 1)